@@ -0,0 +1,909 @@
+#define _GNU_SOURCE
+#define DEFAULT_SHELL "./shell"
+#define DEFAULT_MAX_BYTES (256LL << 20)
+#define DEFAULT_RUNS 5
+#define LINE_BYTES 64
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// One measured shell invocation
+typedef struct Sample
+{
+    double wall_ms;
+    long peak_rss_kb; // Max over the shell and every process it reaped
+    long mallocs;     // Allocation calls made by the shell, -1 without the shim
+    int status;
+} Sample;
+
+typedef struct Result
+{
+    const char *name;
+    const char *param;
+    long ops; // Commands or bytes handled per run, used for the per-op columns
+    bool ops_are_bytes;
+    Sample median;
+} Result;
+
+typedef struct Case
+{
+    const char *name;
+    const char *description;
+    void (*run)(void);
+} Case;
+
+char *shell_path = DEFAULT_SHELL;
+char preload_path[4096] = ""; // malloc_count.so next to this binary, if built
+char tmp_dir[] = "/tmp/npshell-bench-XXXXXX";
+long long max_bytes = DEFAULT_MAX_BYTES;
+int runs = DEFAULT_RUNS;
+bool json = false;
+int results_printed = 0;
+
+void error_exit(char *msg)
+{
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+char *tmp_path(const char *name)
+{
+    static char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", tmp_dir, name);
+    return path;
+}
+
+FILE *open_script(const char *name)
+{
+    FILE *fp = fopen(tmp_path(name), "w");
+    if (fp == NULL)
+    {
+        error_exit("fopen");
+    }
+    return fp;
+}
+
+// Runs the shell on a script with stdout discarded
+Sample run_shell(const char *script_path)
+{
+    Sample sample;
+    char script[4096];
+    snprintf(script, sizeof(script), "%s", script_path); // tmp_path() reuses its buffer
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        error_exit("fork");
+    }
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1)
+        {
+            error_exit("dup2");
+        }
+        if (preload_path[0] != '\0')
+        {
+            setenv("LD_PRELOAD", preload_path, 1);
+            setenv("NPSHELL_MALLOC_LOG", tmp_path("mallocs"), 1);
+        }
+        execl(shell_path, shell_path, script, (char *)NULL);
+        error_exit("execl");
+    }
+    struct rusage ru;
+    if (wait4(pid, &sample.status, 0, &ru) == -1)
+    {
+        error_exit("wait4");
+    }
+    sample.wall_ms = now_ms() - start;
+    sample.peak_rss_kb = ru.ru_maxrss;
+    sample.mallocs = -1;
+    FILE *fp = fopen(tmp_path("mallocs"), "r");
+    if (fp != NULL)
+    {
+        if (fscanf(fp, "%ld", &sample.mallocs) != 1)
+        {
+            sample.mallocs = -1;
+        }
+        fclose(fp);
+        unlink(tmp_path("mallocs"));
+    }
+    return sample;
+}
+
+int compare_samples(const void *a, const void *b)
+{
+    double x = ((const Sample *)a)->wall_ms;
+    double y = ((const Sample *)b)->wall_ms;
+    return (x > y) - (x < y);
+}
+
+void print_result(Result *r)
+{
+    double per_op_us = r->median.wall_ms * 1e3 / (r->ops > 0 ? r->ops : 1);
+    double mb_per_s = r->ops_are_bytes ? (r->ops / 1048576.0) / (r->median.wall_ms / 1e3) : 0;
+    if (json)
+    {
+        printf("%s  {\"case\": \"%s\", \"param\": \"%s\", \"runs\": %d, \"wall_ms\": %.3f, "
+               "\"per_op_us\": %.3f, \"mb_per_s\": %.1f, \"peak_rss_kb\": %ld, \"mallocs\": %ld, \"status\": %d}",
+               results_printed ? ",\n" : "", r->name, r->param, runs, r->median.wall_ms,
+               r->ops_are_bytes ? 0 : per_op_us, mb_per_s, r->median.peak_rss_kb, r->median.mallocs, r->median.status);
+    }
+    else
+    {
+        printf("%s,%s,%d,%.3f,%.3f,%.1f,%ld,%ld,%d\n", r->name, r->param, runs, r->median.wall_ms,
+               r->ops_are_bytes ? 0 : per_op_us, mb_per_s, r->median.peak_rss_kb, r->median.mallocs, r->median.status);
+    }
+    fflush(stdout);
+    results_printed++;
+}
+
+// Runs the script `runs` times and reports the median run, peak RSS is the
+// worst seen over all runs
+void measure(const char *name, const char *param, const char *script, long ops, bool ops_are_bytes)
+{
+    Sample samples[runs];
+    long peak = 0;
+    for (int i = 0; i < runs; i++)
+    {
+        samples[i] = run_shell(tmp_path(script));
+        if (samples[i].peak_rss_kb > peak)
+        {
+            peak = samples[i].peak_rss_kb;
+        }
+    }
+    qsort(samples, runs, sizeof(Sample), compare_samples);
+    Result r = {name, param, ops, ops_are_bytes, samples[runs / 2]};
+    r.median.peak_rss_kb = peak;
+    print_result(&r);
+}
+
+// Fills a file with LINE_BYTES-long text lines
+void make_input(const char *name, long long size)
+{
+    char line[LINE_BYTES];
+    for (int i = 0; i < LINE_BYTES - 1; i++)
+    {
+        line[i] = (i % 8 == 7) ? ' ' : 'a' + i % 26;
+    }
+    line[LINE_BYTES - 1] = '\n';
+    FILE *fp = open_script(name);
+    for (long long written = 0; written < size; written += LINE_BYTES)
+    {
+        fwrite(line, 1, LINE_BYTES, fp);
+    }
+    fclose(fp);
+}
+
+void bench_spawn()
+{
+    const int n = 1000;
+    FILE *fp = open_script("spawn.sh");
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(fp, "true\n");
+    }
+    fclose(fp);
+    measure("spawn", "true", "spawn.sh", n, false);
+    fp = open_script("startup.sh");
+    fprintf(fp, "true\n");
+    fclose(fp);
+    measure("startup", "true", "startup.sh", 1, false);
+}
+
+void bench_chain()
+{
+    for (int len = 1; len <= 64; len *= 2)
+    {
+        const int n = 1024 / len;
+        char param[32];
+        snprintf(param, sizeof(param), "%d", len);
+        FILE *fp = open_script("chain.sh");
+        for (int i = 0; i < n; i++)
+        {
+            for (int j = 0; j < len; j++)
+            {
+                fprintf(fp, j == 0 ? "true" : " | true");
+            }
+            fprintf(fp, "\n");
+        }
+        fclose(fp);
+        measure("chain", param, "chain.sh", n, false);
+    }
+}
+
+// One pipeline of 100 to 10000 external cat stages: the per stage time is
+// the setup cost of a stage, with its pipe, pidfd and process
+void bench_stages()
+{
+    for (int len = 100; len <= 10000; len *= 10)
+    {
+        char param[32];
+        snprintf(param, sizeof(param), "%d", len);
+        FILE *fp = open_script("stages.sh");
+        fprintf(fp, "set -o utils=external\nseq 10");
+        for (int j = 1; j < len - 1; j++)
+        {
+            fprintf(fp, " | cat");
+        }
+        fprintf(fp, " | wc -l\n");
+        fclose(fp);
+        measure("stages", param, "stages.sh", len, false);
+    }
+}
+
+void bench_fanout()
+{
+    for (long long size = 1 << 20; size <= max_bytes; size *= 16)
+    {
+        char param[32];
+        snprintf(param, sizeof(param), "%lldMB", size >> 20);
+        make_input("fanout.txt", size);
+        FILE *fp = open_script("fanout.sh");
+        fprintf(fp, "cat %s ||| wc -c, wc -l, wc -w\n", tmp_path("fanout.txt"));
+        fclose(fp);
+        measure("fanout", param, "fanout.sh", size, true);
+        unlink(tmp_path("fanout.txt"));
+    }
+}
+
+// Bulk definition as from an rc file, then lookups spread over every alias
+void bench_alias()
+{
+    const int n = 20000;
+    for (int aliases = 500; aliases <= 50000; aliases *= 100)
+    {
+        char param[32];
+        snprintf(param, sizeof(param), "%d", aliases);
+        FILE *fp = open_script("alias.sh");
+        for (int i = 0; i < aliases; i++)
+        {
+            fprintf(fp, "alias a%d = cd .\n", i);
+        }
+        for (int i = 0; i < n; i++)
+        {
+            fprintf(fp, "a%d\n", (int)((i * 7919LL) % aliases));
+        }
+        fclose(fp);
+        measure("alias", param, "alias.sh", n + aliases, false);
+    }
+}
+
+// cd ignores extra arguments, so this measures tokenising and parsing only
+void bench_parse()
+{
+    for (int args = 16; args <= 65536; args *= 16)
+    {
+        const int n = 4096 * 16 / args + 1;
+        char param[32];
+        snprintf(param, sizeof(param), "%d", args);
+        FILE *fp = open_script("parse.sh");
+        for (int i = 0; i < n; i++)
+        {
+            fprintf(fp, "cd .");
+            for (int j = 0; j < args; j++)
+            {
+                fprintf(fp, " arg%d", j);
+            }
+            fprintf(fp, "\n");
+        }
+        fclose(fp);
+        measure("parse", param, "parse.sh", n, false);
+    }
+}
+
+// Writes `cd .` followed by about `size` bytes of words, every fourth one
+// quoted or escaped. seed keeps lines of a script apart so none of them is
+// a plan cache hit.
+long write_words(FILE *fp, long size, int seed)
+{
+    static const char *forms[] = {"w%d_%d", "\"dq %d %d\"", "'sq|%d,%d'", "esc\\ %d_%d"};
+    long written = fprintf(fp, "cd .");
+    for (int j = 0; written < size; j++)
+    {
+        written += fprintf(fp, " ");
+        written += fprintf(fp, forms[j % 4], seed, j);
+    }
+    written += fprintf(fp, "\n");
+    return written;
+}
+
+// Lexing throughput for a 4 MB script of distinct 256-byte lines, and for
+// single lines of 1 to 16 MB
+void bench_lex()
+{
+    FILE *fp = open_script("lex.sh");
+    long size = 0;
+    for (int i = 0; size < 4 << 20; i++)
+    {
+        size += write_words(fp, 256, i);
+    }
+    fclose(fp);
+    measure("lex", "script", "lex.sh", size, true);
+    for (long line = 1 << 20; line <= 16 << 20; line *= 4)
+    {
+        char param[32];
+        snprintf(param, sizeof(param), "%ldMB", line >> 20);
+        fp = open_script("lex.sh");
+        size = write_words(fp, line, 0);
+        fclose(fp);
+        measure("lex", param, "lex.sh", size, true);
+    }
+}
+
+// The same sleeps run one after another, then all at once as background
+// jobs collected by wait
+void bench_jobs()
+{
+    const int n = 20;
+    for (int background = 0; background <= 1; background++)
+    {
+        FILE *fp = open_script("jobs.sh");
+        for (int i = 0; i < n; i++)
+        {
+            fprintf(fp, background ? "sleep 0.05 &\n" : "sleep 0.05\n");
+        }
+        fprintf(fp, "wait\n");
+        fclose(fp);
+        measure("jobs", background ? "background" : "foreground", "jobs.sh", n, false);
+    }
+}
+
+// 20 pipelines killed by a 50 ms timeout, run one after another and all at
+// once in the background. Time past 50 ms per pipeline is the supervisor's
+// overshoot.
+void bench_timeout()
+{
+    const int n = 20;
+    for (int background = 0; background <= 1; background++)
+    {
+        FILE *fp = open_script("timeout.sh");
+        for (int i = 0; i < n; i++)
+        {
+            fprintf(fp, "timeout 0.05 sleep 10 | cat%s\n", background ? " &" : "");
+        }
+        fprintf(fp, "wait\n");
+        fclose(fp);
+        measure("timeout", background ? "background" : "foreground", "timeout.sh", n, false);
+    }
+}
+
+// Short pipelines of the utilities the shell can run in-process, with them
+// and with the coreutils binaries
+void bench_utils()
+{
+    const int n = 500;
+    make_input("utils.txt", 64 << 10);
+    for (int external = 0; external <= 1; external++)
+    {
+        FILE *fp = open_script("utils.sh");
+        fprintf(fp, "set -o utils=%s\n", external ? "external" : "builtin");
+        for (int i = 0; i < n; i++)
+        {
+            fprintf(fp, "cat %s | head -n 100 | tail -n 10 | wc\n", tmp_path("utils.txt"));
+        }
+        fclose(fp);
+        measure("utils", external ? "external" : "builtin", "utils.sh", n, false);
+    }
+    unlink(tmp_path("utils.txt"));
+}
+
+// cat | head | wc over 64 MB with the util stages fused into one process
+// and with a pipe between each of them
+void bench_fusion()
+{
+    const long size = 64 << 20;
+    make_input("fusion.txt", size);
+    for (int fused = 1; fused >= 0; fused--)
+    {
+        FILE *fp = open_script("fusion.sh");
+        fprintf(fp, "set -o fuse=%s\n", fused ? "on" : "off");
+        fprintf(fp, "cat %s | head -n 100000000 | wc -l\n", tmp_path("fusion.txt"));
+        fclose(fp);
+        measure("fusion", fused ? "fused" : "unfused", "fusion.sh", size, true);
+    }
+    unlink(tmp_path("fusion.txt"));
+}
+
+// 1000 two stage pipelines with tracing off and on
+void bench_trace()
+{
+    const int n = 1000;
+    for (int traced = 0; traced <= 1; traced++)
+    {
+        FILE *fp = open_script("trace.sh");
+        if (traced)
+        {
+            fprintf(fp, "set -o trace=%s\n", tmp_path("trace.json"));
+        }
+        for (int i = 0; i < n; i++)
+        {
+            fprintf(fp, "true | true\n");
+        }
+        fclose(fp);
+        measure("trace", traced ? "on" : "off", "trace.sh", n, false);
+    }
+    unlink(tmp_path("trace.json"));
+}
+
+// Branches of 300, 200 and 100 ms run at once, so a line should take about
+// as long as its slowest branch in every output mode. Then 64 MB through a
+// branch that copies it, with the collector moving it on or not.
+void bench_branches()
+{
+    const int n = 5;
+    const long size = 64 << 20;
+    const char *modes[] = {"ordered", "stream", "direct"};
+    make_input("branches.txt", size);
+    for (int i = 0; i < 3; i++)
+    {
+        char param[32];
+        snprintf(param, sizeof(param), "sleep-%s", modes[i]);
+        FILE *fp = open_script("branches.sh");
+        fprintf(fp, "set -o branches=%s\n", modes[i]);
+        for (int j = 0; j < n; j++)
+        {
+            fprintf(fp, "true ||| sleep 0.3, sleep 0.2, sleep 0.1\n");
+        }
+        fclose(fp);
+        measure("branches", param, "branches.sh", n, false);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        char param[32];
+        snprintf(param, sizeof(param), "copy-%s", modes[i]);
+        FILE *fp = open_script("branches.sh");
+        fprintf(fp, "set -o branches=%s\n", modes[i]);
+        fprintf(fp, "cat %s ||| wc -l, cat, wc -c\n", tmp_path("branches.txt"));
+        fclose(fp);
+        measure("branches", param, "branches.sh", size, true);
+    }
+    unlink(tmp_path("branches.txt"));
+}
+
+// One server client sending n requests, each passing /dev/null as stdout
+void server_client(const char *path, int n)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (fd == -1 || null_fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        error_exit("connect");
+    }
+    char control[CMSG_SPACE(sizeof(int))];
+    unsigned char reply[64];
+    for (int i = 0; i < n; i++)
+    {
+        struct iovec iov = {.iov_base = "true\n", .iov_len = 5};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &null_fd, sizeof(int));
+        if (sendmsg(fd, &msg, 0) == -1)
+        {
+            error_exit("sendmsg");
+        }
+        // Output went to the fd passed, the reply is the 9-byte status frame
+        ssize_t got = 0;
+        while (got < 9)
+        {
+            ssize_t r = read(fd, reply + got, 9 - got);
+            if (r <= 0 || reply[0] != 3)
+            {
+                error_exit("read");
+            }
+            got += r;
+        }
+    }
+    close(fd);
+}
+
+// Requests per second to one shell --listen from 1 to 16 concurrent
+// clients, each running `true`
+void bench_server()
+{
+    const int n = 2048;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s", tmp_path("server.sock"));
+    pid_t server = fork();
+    if (server == -1)
+    {
+        error_exit("fork");
+    }
+    if (server == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd == -1 || dup2(null_fd, STDERR_FILENO) == -1)
+        {
+            error_exit("dup2"); // Keeps the per-client accounting out of the results
+        }
+        execl(shell_path, shell_path, "--listen", path, (char *)NULL);
+        error_exit("execl");
+    }
+    while (access(path, F_OK) != 0)
+    {
+        usleep(1000);
+    }
+    for (int clients = 1; clients <= 16; clients *= 4)
+    {
+        Sample samples[runs];
+        for (int r = 0; r < runs; r++)
+        {
+            double start = now_ms();
+            for (int i = 0; i < clients; i++)
+            {
+                pid_t pid = fork();
+                if (pid == -1)
+                {
+                    error_exit("fork");
+                }
+                if (pid == 0)
+                {
+                    server_client(path, n / clients);
+                    _exit(EXIT_SUCCESS);
+                }
+            }
+            samples[r].status = 0;
+            for (int i = 0; i < clients; i++)
+            {
+                int status;
+                wait(&status);
+                samples[r].status |= status;
+            }
+            samples[r].wall_ms = now_ms() - start;
+            samples[r].peak_rss_kb = 0;
+            samples[r].mallocs = -1;
+        }
+        qsort(samples, runs, sizeof(Sample), compare_samples);
+        char param[32];
+        snprintf(param, sizeof(param), "%d", clients);
+        Result result = {"server", param, n, false, samples[runs / 2]};
+        print_result(&result);
+    }
+    kill(server, SIGINT);
+    waitpid(server, NULL, 0);
+}
+
+// complete against a $PATH directory of 30000 executables: one lookup that
+// builds the index, then 10000 lookups
+void bench_complete()
+{
+    const int executables = 30000;
+    const int n = 10000;
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", tmp_path("bin"));
+    if (mkdir(dir, 0755) == -1)
+    {
+        error_exit("mkdir");
+    }
+    for (int i = 0; i < executables; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "bin/cmd%05d", i);
+        int fd = open(tmp_path(name), O_WRONLY | O_CREAT, 0755);
+        if (fd == -1)
+        {
+            error_exit("open");
+        }
+        close(fd);
+    }
+    char *old_path = strdup(getenv("PATH") != NULL ? getenv("PATH") : "");
+    char path[8192];
+    snprintf(path, sizeof(path), "%s:%s", dir, old_path);
+    setenv("PATH", path, 1);
+    for (int lines = 1; lines <= n; lines *= n)
+    {
+        FILE *fp = open_script("complete.sh");
+        for (int i = 0; i < lines; i++)
+        {
+            fprintf(fp, "complete cmd1234%d\n", i % 10);
+        }
+        fclose(fp);
+        measure("complete", lines == 1 ? "cold" : "warm", "complete.sh", lines, false);
+    }
+    setenv("PATH", old_path, 1);
+    free(old_path);
+}
+
+// A four stage pipeline of external commands with each placement policy
+// Globs in a directory of 500k files: the first reads it, later ones in the
+// same script reuse the listing. bash runs the same scripts for comparison.
+void bench_glob()
+{
+    const int files = 500000;
+    const int n = 100;
+    char *shells[] = {shell_path, "/bin/bash"};
+    if (mkdir(tmp_path("logs"), 0755) == -1)
+    {
+        error_exit("mkdir");
+    }
+    for (int i = 0; i < files; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "logs/f%06d.log", i);
+        int fd = open(tmp_path(name), O_WRONLY | O_CREAT, 0644);
+        if (fd == -1)
+        {
+            error_exit("open");
+        }
+        close(fd);
+    }
+    for (int lines = 1; lines <= n; lines *= n)
+    {
+        FILE *fp = open_script("glob.sh");
+        for (int i = 0; i < lines; i++)
+        {
+            fprintf(fp, "true %s/f%04d*.log\n", tmp_path("logs"), i * 37 % 5000);
+        }
+        fclose(fp);
+        for (int i = 0; i < 2; i++)
+        {
+            if (access(shells[i], X_OK) != 0)
+            {
+                continue;
+            }
+            shell_path = shells[i];
+            measure(i == 0 ? "glob" : "glob-bash", lines == 1 ? "cold" : "warm", "glob.sh", lines, false);
+        }
+        shell_path = shells[0];
+    }
+}
+
+// $(cat f) captured into a here-string from 1 KB up to -m bytes, run by
+// this shell and by bash on the same script
+void bench_capture()
+{
+    char *shells[] = {shell_path, "/bin/bash"};
+    for (long long size = 1 << 10; size <= max_bytes; size *= 32)
+    {
+        char param[32];
+        if (size < (1 << 20))
+        {
+            snprintf(param, sizeof(param), "%lldKB", size >> 10);
+        }
+        else
+        {
+            snprintf(param, sizeof(param), "%lldMB", size >> 20);
+        }
+        make_input("capture.txt", size);
+        FILE *fp = open_script("capture.sh");
+        fprintf(fp, "wc -c <<< \"$(cat %s)\"\n", tmp_path("capture.txt"));
+        fclose(fp);
+        for (int i = 0; i < 2; i++)
+        {
+            if (access(shells[i], X_OK) != 0)
+            {
+                continue;
+            }
+            shell_path = shells[i];
+            measure(i == 0 ? "capture" : "capture-bash", param, "capture.sh", size, true);
+        }
+        shell_path = shells[0];
+        unlink(tmp_path("capture.txt"));
+    }
+}
+
+// A 64 MB sort with a short output and a tr with a 64 MB output, run
+// plainly, through cached with nothing kept (every run misses) and through
+// cached with the entry in place
+void bench_cached()
+{
+    const long size = 64 << 20;
+    const char *pipelines[] = {"sort", "tr"};
+    const char *modes[] = {"plain", "miss", "hit"};
+    make_input("cached.txt", size);
+    setenv("NPSHELL_CACHE", tmp_path("cache"), 1);
+    for (int p = 0; p < 2; p++)
+    {
+        for (int m = 0; m < 3; m++)
+        {
+            char param[32];
+            snprintf(param, sizeof(param), "%s-%s", pipelines[p], modes[m]);
+            FILE *fp = open_script("cached.sh");
+            fprintf(fp, "set -o cachesize=%s\n", m == 1 ? "0" : "1G");
+            fprintf(fp, "%s", m == 0 ? "" : "cached ");
+            if (p == 0)
+            {
+                fprintf(fp, "sort -r %s | md5sum\n", tmp_path("cached.txt"));
+            }
+            else
+            {
+                fprintf(fp, "tr a-z A-Z < %s\n", tmp_path("cached.txt"));
+            }
+            fclose(fp);
+            measure("cached", param, "cached.sh", size, true);
+        }
+    }
+    unsetenv("NPSHELL_CACHE");
+    unlink(tmp_path("cached.txt"));
+}
+
+void bench_placement()
+{
+    const long size = 64 << 20;
+    const char *policies[] = {"off", "compact", "spread"};
+    make_input("placement.txt", size);
+    for (int i = 0; i < 3; i++)
+    {
+        FILE *fp = open_script("placement.sh");
+        fprintf(fp, "set -o utils=external\nset -o placement=%s\n", policies[i]);
+        fprintf(fp, "cat %s | cat | cat | wc -c\n", tmp_path("placement.txt"));
+        fclose(fp);
+        measure("placement", policies[i], "placement.sh", size, true);
+    }
+    unlink(tmp_path("placement.txt"));
+}
+
+// The same 128 checksums run by parallel with 1 to 64 workers, the inputs
+// are read from the page cache so the work is CPU bound
+void bench_parallel()
+{
+    const int n = 128;
+    const int files = 8;
+    for (int i = 0; i < files; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "parallel%d.txt", i);
+        make_input(name, 4 << 20);
+    }
+    for (int workers = 1; workers <= 64; workers *= 2)
+    {
+        char param[32];
+        snprintf(param, sizeof(param), "%d", workers);
+        FILE *fp = open_script("parallel.sh");
+        fprintf(fp, "parallel -j %d md5sum :::", workers);
+        for (int i = 0; i < n; i++)
+        {
+            fprintf(fp, " %s/parallel%d.txt", tmp_dir, i % files);
+        }
+        fprintf(fp, "\n");
+        fclose(fp);
+        measure("parallel", param, "parallel.sh", n, false);
+    }
+}
+
+// A long-running shell must not grow: peak RSS and allocation calls should
+// be the same for 10k and 1M lines
+void bench_soak()
+{
+    for (int n = 10000; n <= 1000000; n *= 100)
+    {
+        char param[32];
+        snprintf(param, sizeof(param), "%d", n);
+        FILE *fp = open_script("soak.sh");
+        for (int i = 0; i < n; i++)
+        {
+            fprintf(fp, "cd . a b c d e f g h i j k l | x | y\n");
+        }
+        fclose(fp);
+        measure("soak", param, "soak.sh", n, false);
+    }
+}
+
+Case cases[] = {
+    {"spawn", "latency of a single fork+exec, and shell startup", bench_spawn},
+    {"chain", "latency of | chains of 1 to 64 stages", bench_chain},
+    {"stages", "one pipeline of 100 to 10000 external stages", bench_stages},
+    {"fanout", "||| throughput from 1 MB up to -m bytes", bench_fanout},
+    {"alias", "defining 500 and 50000 aliases and looking them up", bench_alias},
+    {"parse", "parse cost for lines of 16 to 65536 arguments", bench_parse},
+    {"lex", "lexing MB/s of a 4 MB script and of 1 to 16 MB lines", bench_lex},
+    {"jobs", "20 sleeps in the foreground and as background jobs", bench_jobs},
+    {"timeout", "20 pipelines ended by a 50 ms timeout, in turn and at once", bench_timeout},
+    {"utils", "cat | head | tail | wc with in-process and external utils", bench_utils},
+    {"fusion", "cat | head | wc throughput with and without stage fusion", bench_fusion},
+    {"branches", "||| branches of 100 to 300 ms, and 64 MB copied by a branch, per output mode", bench_branches},
+    {"trace", "true | true latency with tracing off and on", bench_trace},
+    {"server", "requests per second to shell --listen from 1 to 16 clients", bench_server},
+    {"complete", "command completion with 30000 executables in $PATH", bench_complete},
+    {"glob", "*.log-style globs in a directory of 500k files, against bash", bench_glob},
+    {"capture", "$(...) here-string capture of 1 KB up to -m bytes, against bash", bench_capture},
+    {"cached", "64 MB sort and tr run plainly, missing and hitting the cached prefix", bench_cached},
+    {"placement", "cat | cat | cat | wc throughput per CPU placement policy", bench_placement},
+    {"parallel", "128 md5sum runs by parallel with 1 to 64 workers", bench_parallel},
+    {"soak", "RSS and malloc calls over 10k and 1M lines", bench_soak},
+};
+
+void cleanup()
+{
+    char cmd[4096];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", tmp_dir);
+    if (system(cmd) == -1)
+    {
+        perror("system");
+    }
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-s shell] [-r runs] [-m max_fanout_bytes] [-j] [case...]\n", prog);
+    for (size_t i = 0; i < sizeof(cases) / sizeof(Case); i++)
+    {
+        fprintf(stderr, "  %-8s %s\n", cases[i].name, cases[i].description);
+    }
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "s:r:m:j")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            shell_path = optarg;
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 'm':
+            max_bytes = atoll(optarg);
+            break;
+        case 'j':
+            json = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (runs < 1 || access(shell_path, X_OK) != 0)
+    {
+        usage(argv[0]);
+    }
+    char *slash = strrchr(argv[0], '/');
+    snprintf(preload_path, sizeof(preload_path), "%.*smalloc_count.so", slash != NULL ? (int)(slash - argv[0] + 1) : 0, argv[0]);
+    if (access(preload_path, R_OK) != 0)
+    {
+        preload_path[0] = '\0';
+    }
+    else if (preload_path[0] != '/')
+    {
+        // LD_PRELOAD needs a path that resolves from the shell's cwd too
+        char *resolved = realpath(preload_path, NULL);
+        snprintf(preload_path, sizeof(preload_path), "%s", resolved);
+        free(resolved);
+    }
+    if (mkdtemp(tmp_dir) == NULL)
+    {
+        error_exit("mkdtemp");
+    }
+    atexit(cleanup);
+    printf(json ? "[\n" : "case,param,runs,wall_ms,per_op_us,mb_per_s,peak_rss_kb,mallocs,status\n");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(Case); i++)
+    {
+        bool selected = optind == argc;
+        for (int j = optind; j < argc; j++)
+        {
+            selected |= !strcmp(argv[j], cases[i].name);
+        }
+        if (selected)
+        {
+            cases[i].run();
+        }
+    }
+    printf(json ? "\n]\n" : "");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,61 @@
+// LD_PRELOAD shim for the soak benchmark: counts malloc, calloc and realloc
+// calls in the shell and writes the total to $NPSHELL_MALLOC_LOG at exit.
+// Both variables are removed from the environment so commands the shell
+// runs are not counted.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long calls = 0;
+static char log_path[4096];
+
+__attribute__((constructor)) static void init_count()
+{
+    char *path = getenv("NPSHELL_MALLOC_LOG");
+    if (path != NULL)
+    {
+        snprintf(log_path, sizeof(log_path), "%s", path);
+    }
+    unsetenv("NPSHELL_MALLOC_LOG");
+    unsetenv("LD_PRELOAD");
+    calls = 0;
+}
+
+__attribute__((destructor)) static void write_count()
+{
+    if (log_path[0] == '\0')
+    {
+        return;
+    }
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1)
+    {
+        dprintf(fd, "%lu\n", calls);
+        close(fd);
+    }
+}
+
+void *malloc(size_t size)
+{
+    calls++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    calls++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    calls++;
+    return __libc_realloc(ptr, size);
+}
@@ -1,9 +1,36 @@
 #define _XOPEN_SOURCE 700 // Enables vs code to see sigjmp_buf, not sure why
+#define _GNU_SOURCE        // tee, splice
 #define BUFFER_SIZE 1024
-#define MAX_CMD_SIZE 1024
+#define FANOUT_CHUNK (1 << 20)
 #define DEFAULT_MALLOC_SIZE 4
-#define HASH_TABLE_SIZE 517
-#define MAX_ALIAS_LEN 128
+#define HISTORY_SIZE 10000           // Lines kept in memory unless histsize is set
+#define HISTORY_FILE ".npshell_history"
+#define HISTORY_BLOCK 64            // Lines per search index block
+#define HISTORY_BLOOM_WORDS 64      // 4096-bit trigram filter per block
+#define TABLE_MIN_SIZE 16 // Tables are powers of two kept at most 3/4 full
+#define PLAN_CACHE_MAX 768          // Cache is flushed when it gets this full
+#define PLAN_MAX_TEXT (64 * 1024)   // Longer lines are compiled but not cached
+#define PATH_CACHE_TTL 1 // Seconds between checks of $PATH directory mtimes
+#define SUPERVISE_EVENTS 64 // epoll events handled per wakeup
+#define CACHE_SIZE (256ULL << 20) // Bound on the output cache unless cachesize is set
+#define CACHE_MAGIC "npcache1" // Starts each output cache file, changed with its layout
+#define CACHE_TMP_AGE 600 // Seconds before an unfinished cache file counts as left by a crash
+#define FD_RESERVE 64 // Spare fds for the shell's own files when raising RLIMIT_NOFILE
+#define TIMEOUT_STATUS 124 // Exit status of a timed out job, as with coreutils timeout
+#define TRACE_EVENTS 16384 // Ring of the newest events kept while tracing
+#define SERVER_MAX_CLIENTS 64 // Sessions at once unless --max-clients is given
+#define SERVER_REQUEST_MAX (64 * 1024)
+#define COMPLETION_LIST_MAX 200 // Matches listed by a second Tab
+#define GLOB_CACHE_DIRS 64 // Directory listings kept for glob patterns
+#define GLOB_DENTS_BLOCK (64 * 1024)
+#define PARALLEL_WINDOW 4 // Instances started per worker before the oldest has printed
+#define READ_BLOCK_SIZE (64 * 1024)
+#define LEX_PAD 16 // Zero bytes after a line being lexed, one SSE2 block
+#define UTIL_BLOCK (128 * 1024)
+#define UTIL_EXTERNAL -1 // Returned by run_util for options only the real binary has
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_KEEP_MAX (1024 * 1024) // Largest block kept across lines
+#define ARENA_ALIGN 16
 #define GREEN "\033[0;32m"
 #define BOLD_GREEN "\033[1;32m"
 #define RESET "\033[0;37m"
@@ -20,18 +47,38 @@
 #include <fcntl.h>
 #include <wait.h>
 #include <signal.h>
-#include <setjmp.h>
-
-enum ParseMode
-{
-    COMMAND_BEGIN,
-    COMMAND_READ,
-    ARGS_BEGIN,
-    ARGS_READ,
-    INPUT_BEGIN,
-    OUTPUT_BEGIN,
-    INPUT_READ,
-    OUTPUT_READ
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <spawn.h>
+#include <sched.h>
+#include <locale.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/pidfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <arpa/inet.h> // htonl
+#include <poll.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Where lex_line puts the word it is building
+enum WordTarget
+{
+    WORD_ARG,
+    WORD_INPUT, // After <
+    WORD_OUTPUT // After > or >>
 };
 
 typedef struct Command
@@ -44,6 +91,7 @@ typedef struct Command
     int out_count;
     char *input_file;
     char *output_file;
+    bool *patterns; // NULL, or which of argv are glob patterns
     struct Command *next;
 } Command;
 
@@ -55,52 +103,534 @@ typedef struct Pipeline
 
 } Pipeline;
 
-typedef struct HistoryNode
+// State of lex_line while it splits one line. Words are unquoted in place:
+// w trails r, so a word never moves unless quotes or escapes came before it.
+typedef struct Lexer
+{
+    char *r;
+    char *w;
+    char *word; // Start of the word being built, NULL between words
+    enum WordTarget target;
+    Command *cmd;
+    int argmax;
+    Pipeline *pipeline;
+    bool pattern; // The word has an unquoted *, ? or [
+    char **literal; // Start and end of each quoted or escaped run in the word
+    int literal_count;
+    int literal_cap;
+} Lexer;
+
+// Immutable, compiled form of a command line: one malloc holding the stage
+// array, every argv array and all strings. Plans are cached by line text
+// and stored in alias entries so repeated lines skip parsing.
+typedef struct Plan
 {
-    char input[MAX_CMD_SIZE];
-    struct HistoryNode *next;
-    struct HistoryNode *prev;
-} HistoryNode;
+    int cnt;
+    Command *stages;
+    char *text;
+} Plan;
 
+// The newest `cap` command lines, entry with sequence number seq lives in
+// ring[seq % cap]. Lines are also appended to the history file, which is
+// shared by every interactive session.
 typedef struct History
 {
-    HistoryNode *head;
-    HistoryNode *tail;
+    char **ring;
+    unsigned int cap;
+    unsigned int count;
+    unsigned int next_seq;
+    int fd;     // History file opened O_APPEND, -1 if not persisted
+    char *path;
+    struct HistoryIndex *index; // Built on the first search
 } History;
 
-typedef struct HashEntry
+// History search index: one bloom filter of trigrams per block of
+// HISTORY_BLOCK consecutive lines, so a search only scans the blocks that
+// may hold every trigram of the pattern. A line is indexed as "^" + text,
+// which makes a prefix search a search for its anchored trigrams.
+typedef struct HistoryIndex
 {
-    char alias[MAX_ALIAS_LEN];
-    char command_name[MAX_CMD_SIZE];
-    char command[MAX_CMD_SIZE];
-    bool present;
-} HashEntry;
+    unsigned long long (*blooms)[HISTORY_BLOOM_WORDS]; // Block b in blooms[b % nblocks]
+    unsigned int nblocks;
+} HistoryIndex;
 
-History *ptr = NULL;
-HashEntry hash_table[HASH_TABLE_SIZE];
-pid_t gpid; // To identify if the process is parent or child
-static sigjmp_buf senv;
-void int_handler(int signo)
+enum ProcKind
 {
-    if (gpid == getpid()) // For parent
-    {
-        siglongjmp(senv, 1);
-    }
-    else // For child
-    {
-        exit(130); // usual exit code for SIGINT
-    }
-}
+    PROC_STAGE,
+    PROC_FANOUT,
+    PROC_RELAY,
+    PROC_COLLECT
+};
 
-void unignore_int()
+// How launch_job pins stages to CPUs, set -o placement
+enum Placement
 {
-    signal(SIGINT, int_handler);
-}
+    PLACE_OFF,
+    PLACE_COMPACT,
+    PLACE_SPREAD,
+    PLACE_LIST
+};
 
-void ignore_int()
+// How the outputs of a pipeline's branches reach stdout, set -o branches
+enum BranchOutput
 {
-    signal(SIGINT, SIG_IGN);
-}
+    BRANCH_ORDERED, // Whole, in the order the branches are written
+    BRANCH_STREAM,  // Line by line as they come, each tagged with its branch
+    BRANCH_DIRECT   // Every branch writes to stdout itself
+};
+
+enum TimeMode
+{
+    TIME_OFF,
+    TIME_TABLE,
+    TIME_JSON
+};
+
+// Tags of the frames a server session sends its client: a byte of type, a
+// 4-byte big-endian length, then that many bytes
+enum FrameType
+{
+    FRAME_STDOUT = 1,
+    FRAME_STDERR = 2,
+    FRAME_STATUS = 3 // The exit status of a request, 4 bytes big-endian
+};
+
+// Where a CPU sits, each id is the lowest CPU that shares it
+typedef struct CpuInfo
+{
+    int cpu;
+    int core; // SMT siblings
+    int llc;  // Last level cache
+    int package;
+    int domain; // Index of its package and last level cache pair
+} CpuInfo;
+
+// Accounting for one process of a running pipeline
+typedef struct ProcStat
+{
+    pid_t pid;
+    int stage;
+    enum ProcKind kind;
+    char *name;
+    struct timespec start;
+    struct timespec end;
+    struct rusage usage;
+    int status;
+    unsigned long long bytes; // Written to the next pipe, -1 if there is none
+    int pidfd;   // -1 if pidfd_open failed, reap_unwatched polls it then
+    bool reaped;
+} ProcStat;
+
+// One Chrome trace event, recorded by whichever process of the shell saw it
+typedef struct TraceEvent
+{
+    char name[24];
+    char detail[48];
+    long long start_ns; // CLOCK_MONOTONIC, the same in every process
+    long long dur_ns;   // -1 for an instant event
+    pid_t pid;
+    int stage; // -1 outside a pipeline's stages
+} TraceEvent;
+
+// Mapped shared before anything is forked, so every child writes to it
+typedef struct TraceRing
+{
+    unsigned long next; // Events recorded so far, the ring keeps the last TRACE_EVENTS
+    TraceEvent events[TRACE_EVENTS];
+} TraceRing;
+
+// A launched pipeline. All its processes, helpers included, share one
+// process group, so Ctrl-C, Ctrl-Z, fg and bg reach every one of them.
+typedef struct Job
+{
+    int id;
+    pid_t pgid;     // 0 until the first process is started
+    pid_t last_pid; // Last stage, its status is the job's
+    int exit_status;
+    int live;  // Processes not reaped yet
+    bool stopped;
+    bool tty;  // Gets the terminal while it runs in the foreground
+    char *text;
+    char *names; // Where the next stage name is copied to
+    int count;   // Stages
+    enum TimeMode timing;
+    unsigned long long *bytes; // Pipe byte counters shared with the helpers
+    struct timespec start;
+    long long deadline_ms;   // CLOCK_MONOTONIC, 0 without a timeout
+    long long kill_after_ms; // timeout -k: SIGKILL this long after SIGTERM
+    bool timed_out;
+    ProcStat *stats; // A stage, its fan-out helper and its relay at most
+    int nstats;
+    struct Job *next;
+} Job;
+
+// The client a forked server session works for
+typedef struct Session
+{
+    pid_t pid; // 0 outside a session
+    int log_fd; // The server's stderr
+    int client;
+    int requests;
+    long long busy_ms; // Spent running requests
+    int out_fd;        // Pipes to the session's relay, see relay_frames
+    int err_fd;
+    int status_fd;
+} Session;
+
+// One run of the parallel builtin's template. Its output goes to a memfd that
+// is written out once every earlier instance has been printed.
+typedef struct Instance
+{
+    Job *job; // NULL once reaped, or if the line did not compile
+    int out_fd;
+    int status;
+    char *text;
+} Instance;
+
+// Running counts of wc over one input
+typedef struct WcCounts
+{
+    unsigned long long lines;
+    unsigned long long words;
+    unsigned long long bytes;
+    bool in_word;    // Last space or printable byte was printable
+    mbstate_t state; // Character split across two reads
+} WcCounts;
+
+typedef void (*WcCounter)(const unsigned char *p, size_t n, WcCounts *wc, bool words);
+
+// A util's options, parsed once in the shell to decide on fusion and again
+// in the stage that runs it
+typedef struct UtilArgs
+{
+    char *opts[128]; // By option letter, "" for a switch
+    char **files;
+    int nfiles;
+    unsigned long long count; // head and tail: lines or bytes
+    bool bytes;
+    bool from_start; // tail +N
+    bool headers;
+    bool show[4]; // wc: lines, words, chars, bytes
+} UtilArgs;
+
+// A util stage fused into the process of the stage before it. Instead of
+// reading a pipe it is handed that stage's output through input(), which
+// returns false once it wants no more so the stages before it stop early,
+// and finish() is called at the end of the input.
+typedef struct Filter
+{
+    const char *name;
+    bool (*input)(struct Filter *f, const char *buf, size_t len);
+    int (*finish)(struct Filter *f);
+    struct Filter *next; // NULL writes to stdout
+    UtilArgs args;
+    unsigned long long left; // head: still to pass on, tail +N: still to skip
+    WcCounts wc;
+    char *buf; // tail: the input that may still be printed
+    size_t len;
+    size_t cap;
+    size_t compact_at;
+    bool done;
+} Filter;
+
+// In-process utilities. A stage running one of these is forked as usual but
+// calls the util instead of exec'ing the binary, which saves the exec and the
+// dynamic loader. Output matches coreutils; options a util doesn't implement
+// make parse() fail and the stage execs the real binary.
+typedef struct Util
+{
+    const char *name;
+    bool (*parse)(Command *cmd, UtilArgs *args);
+    int (*run)(UtilArgs *args, Filter *out);
+    bool (*input)(Filter *f, const char *buf, size_t len);
+    int (*finish)(Filter *f);
+} Util;
+
+// Bump allocator for everything built while running one line of input
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct Arena
+{
+    ArenaBlock *head; // Block currently allocated from
+    void *last;       // Most recent allocation, can grow in place
+} Arena;
+
+typedef struct LineReader
+{
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t start; // First byte not yet handed out
+    size_t end;
+    bool eof;
+} LineReader;
+
+// A line with $(...) replaced and here-documents turned into memfds
+typedef struct Expansion
+{
+    char *text; // NULL while nothing was expanded
+    size_t len;
+    size_t cap;
+    int *fds; // Sealed memfds read by the line's commands
+    int nfds;
+} Expansion;
+
+enum Quoting
+{
+    QUOTE_NONE,   // Escaped for the lexer, which splits it into words
+    QUOTE_DOUBLE, // Inside "..."
+    QUOTE_RAW     // A here-document body, not lexed
+};
+
+// Open-addressing hash table with linear probing, keyed by string. Removed
+// slots become tombstones so probe chains stay intact; the table grows (or
+// is rebuilt to clear tombstones) when live + dead slots pass 3/4.
+typedef struct TableSlot
+{
+    const char *key; // NULL if empty, TOMBSTONE if removed
+    unsigned long long hash;
+    void *value;
+} TableSlot;
+
+typedef struct Table
+{
+    TableSlot *slots;
+    size_t size;
+    size_t used; // Live slots and tombstones
+    size_t live;
+} Table;
+
+typedef struct Alias
+{
+    const char *name;    // Interned
+    const char *command; // Interned
+    Plan *plan;          // Compiled on first use
+} Alias;
+
+// An interned string, freed when the last alias holding it lets it go
+typedef struct Interned
+{
+    size_t refs;
+    char str[];
+} Interned;
+
+History history = {NULL, 0, 0, 0, -1, NULL, NULL};
+Arena line_arena = {NULL, NULL};
+char TOMBSTONE[1];
+
+typedef struct PathEntry
+{
+    char *name;
+    char *path;
+    int dir_idx; // Index in path_dirs the command was found in
+    int hits;
+} PathEntry;
+
+typedef struct PathDir
+{
+    char *dir;
+    struct timespec mtime;
+} PathDir;
+
+// Completion trie, nodes live in one array and refer to each other by index
+typedef struct TrieNode
+{
+    int child;   // First child, -1 for none
+    int sibling; // Next child of the same parent, -1 for none
+    char c;
+    bool word; // A name ends here
+} TrieNode;
+
+typedef struct Trie
+{
+    TrieNode *nodes; // nodes[0] is the root, count is 0 until it is built
+    int count;
+    int cap;
+} Trie;
+
+// A $PATH directory's executables, read again when its mtime changes
+typedef struct CompletionDir
+{
+    char *dir;
+    struct timespec mtime;
+    Trie trie;
+} CompletionDir;
+
+typedef struct Completions
+{
+    char **names;
+    int count;
+    int cap;
+} Completions;
+
+enum Match
+{
+    MATCH_NONE,
+    MATCH_ONE,
+    MATCH_MANY
+};
+
+// Keys read_key makes of escape sequences, past the byte values
+enum Key
+{
+    KEY_UP = 256,
+    KEY_DOWN,
+    KEY_RIGHT,
+    KEY_LEFT,
+    KEY_HOME,
+    KEY_END,
+    KEY_DELETE
+};
+
+// The line being edited at the prompt
+typedef struct LineEdit
+{
+    char *buf;
+    size_t len;
+    size_t pos; // Cursor
+    size_t cap;
+    const char *prompt;
+    char *typed; // The line as typed, while history is being browsed
+    unsigned int history_back; // 0 for the typed line, else how far back
+} LineEdit;
+
+// One path component of a glob pattern, compiled to a token per byte or
+// wildcard
+enum GlobOp
+{
+    GLOB_CHAR,
+    GLOB_ANY,  // ?
+    GLOB_STAR, // *
+    GLOB_CLASS // [...]
+};
+
+typedef struct GlobToken
+{
+    enum GlobOp op;
+    unsigned char c;
+    unsigned long long class[4]; // One bit per byte value
+} GlobToken;
+
+typedef struct GlobPattern
+{
+    GlobToken *tokens;
+    int count;
+    size_t head_len; // Literal bytes before the first wildcard, as tokens
+    char *tail; // The literal bytes after the last wildcard, compared first
+    size_t tail_len;
+    bool dot; // Starts with a literal ., so hidden names can match
+} GlobPattern;
+
+// getdents64 records of a directory, reused while its mtime is unchanged
+typedef struct GlobDir
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec read; // Coarse clock before reading, the clock mtimes come from
+    char *buf;
+    size_t len;
+    unsigned long used;
+    char **names; // Sorted d_names, made when the listing is first reused
+    size_t count;
+} GlobDir;
+
+typedef struct WordList
+{
+    char **words;
+    int count;
+    int cap;
+} WordList;
+
+// Head of an output cache file, stdout and then stderr follow it
+typedef struct CacheEntry
+{
+    char magic[8];
+    int status;
+    unsigned long long out_len;
+    unsigned long long err_len;
+} CacheEntry;
+
+typedef struct CacheFile
+{
+    char name[33];
+    struct timespec mtime; // Set again on each replay, so it orders by last use
+    off_t size;
+} CacheFile;
+
+Table alias_table = {NULL, 0, 0, 0};
+unsigned long alias_changes = 0; // Aliases added or removed, for completion
+Table intern_table = {NULL, 0, 0, 0};
+Table path_table = {NULL, 0, 0, 0};
+Table plan_table = {NULL, 0, 0, 0};
+unsigned long plan_hits = 0;
+unsigned long plan_misses = 0;
+CompletionDir *completion_dirs = NULL;
+GlobDir glob_cache[GLOB_CACHE_DIRS]; // The least recently used is replaced
+unsigned long glob_clock = 0;
+char cache_dir[PATH_MAX] = ""; // Found on first use
+unsigned long long cache_limit = CACHE_SIZE;
+unsigned long cache_hits = 0;
+unsigned long cache_misses = 0;
+unsigned long jobs_launched = 0; // Tells cached a pipeline from a builtin after a prefix
+int completion_dir_count = 0;
+char *completion_env = NULL; // $PATH completion_dirs was made for
+Trie alias_trie = {NULL, 0, 0};
+unsigned long alias_trie_changes = 0;
+Trie builtin_trie = {NULL, 0, 0};
+// Handled by execute() itself, offered by completion
+const char *builtin_names[] = {"alias", "bg", "cached", "cd", "complete", "exit", "fg", "hash", "history",
+                               "jobs", "parallel", "plans", "set", "time", "timeout", "unalias", "wait"};
+PathDir *path_dirs = NULL;
+int path_dir_count = 0;
+char *path_cache_env = NULL; // $PATH the cache was built for
+time_t path_cache_checked = 0;
+bool use_posix_spawn = true;
+bool use_builtin_utils = true; // wc, head, tail and cat run in the forked stage
+bool use_fusion = true; // A run of util stages shares one process
+enum BranchOutput branch_output = BRANCH_ORDERED;
+const char *util_name = NULL; // For a util's error messages
+bool interactive = true; // Prompt, history and per-process status lines
+LineReader *line_source = NULL; // Batch input, here-documents read their body from it
+int last_status = 0;
+enum TimeMode timing = TIME_OFF; // Set by the time prefix for one pipeline
+enum Placement placement = PLACE_OFF;
+cpu_set_t *placement_sets = NULL; // Per stage with an explicit placement
+int placement_set_count = 0;
+char placement_text[256] = "off";
+int placement_next = 0;  // Successive pipelines start on successive CPUs
+CpuInfo *topology = NULL; // Allowed CPUs in compact order, read on first use
+int topology_count = 0;
+int topology_domains = 0;
+extern char **environ;
+Job *jobs = NULL; // Newest first
+pid_t shell_pgid;
+pid_t fg_pgid = 0; // Foreground job, Ctrl-C is passed on to it
+bool interrupted = false;
+int supervisor_fd = -1; // epoll set of child pidfds, signal_fd and stdin at the prompt
+int signal_fd = -1;
+int watched_fds = 0; // Open pidfds
+rlim_t fd_limit = 0; // Soft RLIMIT_NOFILE as last read or set, 0 before that
+sigset_t supervised_signals; // SIGCHLD and SIGINT, always blocked and read from signal_fd
+bool input_ready = false;
+Session session = {0};
+TraceRing *trace_ring = NULL; // NULL while tracing is off
+char trace_file[2 * PATH_MAX];
+pid_t trace_owner; // The shell, its children never write the file
+long long timeout_ms = 0; // Set by the timeout prefix for one line
+long long kill_after_ms = 0;
+// Bytes the lexer stops at outside quotes, anything else is part of a word
+bool lex_stops[256] = {
+    ['\0'] = true, ['\t'] = true, ['\n'] = true, ['\v'] = true, ['\f'] = true, ['\r'] = true, [' '] = true,
+    ['"'] = true,  ['\''] = true, [','] = true,  ['<'] = true,  ['>'] = true,  ['\\'] = true, ['|'] = true,
+    ['*'] = true,  ['?'] = true,  ['['] = true,
+};
 
 void error_exit(char *msg)
 {
@@ -108,740 +638,7479 @@ void error_exit(char *msg)
     exit(EXIT_FAILURE);
 }
 
-int calculate_hash(char *str)
+void *arena_alloc(Arena *arena, size_t size)
 {
-    long long hash_value = 0;
-    int n = strlen(str);
-    const long long p = 31;
-    const long long PRIME = 1000000007;
-    long long prime_pow = 1;
-    for (int i = 0; i < n; i++)
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock *block = arena->head;
+    if (block == NULL || block->size - block->used < size)
     {
-        hash_value = (hash_value + (str[i] * prime_pow) % PRIME) % PRIME;
-        prime_pow = (prime_pow * p) % PRIME;
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL)
+        {
+            error_exit("malloc");
+        }
+        block->size = block_size;
+        block->used = 0;
+        block->next = arena->head;
+        arena->head = block;
     }
-    return hash_value % HASH_TABLE_SIZE;
+    arena->last = block->data + block->used;
+    block->used += size;
+    return arena->last;
 }
 
-void init_table()
+// Grows ptr in place when it is the latest allocation, copies otherwise
+void *arena_realloc(Arena *arena, void *ptr, size_t old_size, size_t new_size)
 {
-    for (int i = 0; i < HASH_TABLE_SIZE; i++)
+    ArenaBlock *block = arena->head;
+    if (ptr != NULL && ptr == arena->last)
+    {
+        size_t offset = (char *)ptr - block->data;
+        size_t aligned = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (offset + aligned <= block->size)
+        {
+            block->used = offset + aligned;
+            return ptr;
+        }
+    }
+    void *grown = arena_alloc(arena, new_size);
+    if (ptr != NULL)
     {
-        hash_table[i].present = false;
+        memcpy(grown, ptr, old_size);
     }
+    return grown;
 }
 
-void insert_table(char *alias, char *command_name, char *command)
+// Frees the whole line in one go. One block is kept so that steady state
+// lines don't call malloc at all; it is the largest one up to ARENA_KEEP_MAX.
+void arena_reset(Arena *arena)
 {
-    int len = strlen(alias);
-    for (int i = 0; i < len; i++)
+    ArenaBlock *keep = NULL;
+    ArenaBlock *next;
+    for (ArenaBlock *block = arena->head; block != NULL; block = next)
     {
-        if (alias[i] == '\n')
+        next = block->next;
+        if (block->size <= ARENA_KEEP_MAX && (keep == NULL || block->size > keep->size))
         {
-            alias[i] = '\0';
-            break;
+            free(keep);
+            keep = block;
+        }
+        else
+        {
+            free(block);
         }
     }
-    int hash_value = calculate_hash(alias);
-    int probe_no = 0;
-    while (hash_table[hash_value].present == true && strcmp(alias, hash_table[hash_value].alias) != 0 && probe_no < HASH_TABLE_SIZE)
-    {
-        hash_value = (hash_value + 1) % HASH_TABLE_SIZE;
-        probe_no++;
-    }
-    if (strcmp(hash_table[hash_value].alias, alias) == 0)
+    if (keep != NULL)
     {
-        hash_table[hash_value].present = true;
-        strcpy(hash_table[hash_value].alias, alias);
-        strcpy(hash_table[hash_value].command_name, command_name);
-        strcpy(hash_table[hash_value].command, command);
-        return;
+        keep->used = 0;
+        keep->next = NULL;
     }
-    if (hash_table[hash_value].present == true)
+    arena->head = keep;
+    arena->last = NULL;
+}
+
+// FNV-1a, one xor and one multiply per byte
+unsigned long long calculate_hash(const char *str)
+{
+    unsigned long long hash_value = 14695981039346656037ULL;
+    for (; *str != '\0'; str++)
     {
-        perror("Hash Table full, cannot insert\n");
-        return;
+        hash_value = (hash_value ^ (unsigned char)*str) * 1099511628211ULL;
     }
-    hash_table[hash_value].present = true;
-    strcpy(hash_table[hash_value].alias, alias);
-    strcpy(hash_table[hash_value].command_name, command_name);
-    strcpy(hash_table[hash_value].command, command);
+    return hash_value;
 }
 
-HashEntry *search_table(char *alias)
+void table_resize(Table *table, size_t size)
 {
-    int len = strlen(alias);
-    for (int i = 0; i < len; i++)
+    TableSlot *old_slots = table->slots;
+    size_t old_size = table->size;
+    table->slots = calloc(size, sizeof(TableSlot));
+    if (table->slots == NULL)
+    {
+        error_exit("calloc");
+    }
+    table->size = size;
+    table->used = table->live;
+    for (size_t i = 0; i < old_size; i++)
     {
-        if (alias[i] == '\n')
+        if (old_slots[i].key == NULL || old_slots[i].key == TOMBSTONE)
         {
-            alias[i] = '\0';
-            break;
+            continue;
+        }
+        size_t idx = old_slots[i].hash & (size - 1);
+        while (table->slots[idx].key != NULL)
+        {
+            idx = (idx + 1) & (size - 1);
         }
+        table->slots[idx] = old_slots[i];
+    }
+    free(old_slots);
+}
+
+TableSlot *table_find(Table *table, const char *key)
+{
+    if (table->size == 0)
+    {
+        return NULL;
     }
-    int hash_value = calculate_hash(alias);
-    int probe_no = 0;
-    while (hash_table[hash_value].present == true && probe_no < HASH_TABLE_SIZE)
+    unsigned long long hash_value = calculate_hash(key);
+    size_t idx = hash_value & (table->size - 1);
+    while (table->slots[idx].key != NULL)
     {
-        if (strcmp(hash_table[hash_value].alias, alias) == 0)
+        if (table->slots[idx].key != TOMBSTONE && table->slots[idx].hash == hash_value && strcmp(table->slots[idx].key, key) == 0)
         {
-            return &hash_table[hash_value];
+            return &table->slots[idx];
         }
-        hash_value = (hash_value + 1) % HASH_TABLE_SIZE;
-        probe_no++;
+        idx = (idx + 1) & (table->size - 1);
     }
     return NULL;
 }
 
-void insert_input_in_history(char *input)
+// Returns the slot for key, adding it with a NULL value if it is missing.
+// The key pointer is stored as is, so it must outlive the entry.
+TableSlot *table_insert(Table *table, const char *key)
 {
-    if (input == NULL || *input == '\0' || *input == '\n' || strlen(input) == 0)
+    TableSlot *slot = table_find(table, key);
+    if (slot != NULL)
     {
-        return;
+        return slot;
     }
-    HistoryNode *hn = (HistoryNode *)malloc(sizeof(HistoryNode));
-    if (hn == NULL)
+    if ((table->used + 1) * 4 > table->size * 3)
     {
-        error_exit("malloc");
+        size_t size = table->size < TABLE_MIN_SIZE ? TABLE_MIN_SIZE : table->size;
+        // Grow if mostly live, otherwise rebuild at this size to drop tombstones
+        table_resize(table, (table->live + 1) * 2 > size ? size * 2 : size);
     }
-    strcpy(hn->input, input);
-    if (ptr->head == NULL)
+    unsigned long long hash_value = calculate_hash(key);
+    size_t idx = hash_value & (table->size - 1);
+    while (table->slots[idx].key != NULL && table->slots[idx].key != TOMBSTONE)
     {
-        ptr->head = hn;
-        hn->prev = NULL;
-        hn->next = NULL;
-        ptr->tail = hn;
+        idx = (idx + 1) & (table->size - 1);
     }
-    else
+    if (table->slots[idx].key == NULL)
     {
-        hn->next = ptr->head;
-        hn->prev = NULL;
-        ptr->head->prev = hn;
-        ptr->head = hn;
+        table->used++;
     }
+    table->live++;
+    table->slots[idx].key = key;
+    table->slots[idx].hash = hash_value;
+    table->slots[idx].value = NULL;
+    return &table->slots[idx];
+}
+
+void table_remove(Table *table, TableSlot *slot)
+{
+    slot->key = TOMBSTONE;
+    slot->value = NULL;
+    table->live--;
 }
 
-void pop()
+void table_clear(Table *table)
 {
-    if (ptr->head == NULL)
+    free(table->slots);
+    table->slots = NULL;
+    table->size = 0;
+    table->used = 0;
+    table->live = 0;
+}
+
+// Returns the one shared copy of str, held until each intern of it is
+// matched by a release
+const char *intern(const char *str)
+{
+    TableSlot *slot = table_find(&intern_table, str);
+    if (slot != NULL)
     {
-        return;
+        ((Interned *)slot->value)->refs++;
+        return slot->key;
     }
-    if (ptr->head->next == NULL)
+    size_t len = strlen(str) + 1;
+    Interned *interned = malloc(sizeof(Interned) + len);
+    if (interned == NULL)
     {
-        free(ptr->head);
-        ptr->head = NULL;
-        ptr->tail = NULL;
-        return;
+        error_exit("malloc");
     }
-    HistoryNode *hn = ptr->head;
-    ptr->head = hn->next;
-    ptr->head->prev = NULL;
-    hn->prev = NULL;
-    hn->next = NULL;
-    free(hn);
-    hn = NULL;
+    interned->refs = 1;
+    memcpy(interned->str, str, len);
+    table_insert(&intern_table, interned->str)->value = interned;
+    return interned->str;
 }
 
-void change_dir(char **args)
-
+void release(const char *str)
 {
-    if (args[1] == NULL)
+    TableSlot *slot = table_find(&intern_table, str);
+    Interned *interned = slot->value;
+    if (--interned->refs == 0)
+    {
+        table_remove(&intern_table, slot);
+        free(interned);
+    }
+}
 
+void insert_alias(const char *name, const char *command)
+{
+    const char *interned = intern(command); // command may be the old one
+    TableSlot *slot = table_find(&alias_table, name);
+    Alias *alias;
+    if (slot == NULL)
     {
-        perror("Expected argument to \"cd\"\n");
+        if ((alias = malloc(sizeof(Alias))) == NULL)
+        {
+            error_exit("malloc");
+        }
+        alias->name = intern(name);
+        table_insert(&alias_table, alias->name)->value = alias;
     }
-    else if (chdir(args[1]) != 0)
+    else
+    {
+        alias = slot->value;
+        free(alias->plan);
+        release(alias->command);
+    }
+    alias->command = interned;
+    alias->plan = NULL;
+    alias_changes++;
+}
 
+Alias *search_alias(char *line)
+{
+    char *nl = strchr(line, '\n');
+    if (nl != NULL)
     {
-        perror("chdir");
+        *nl = '\0';
     }
+    TableSlot *slot = table_find(&alias_table, line);
+    return slot != NULL ? slot->value : NULL;
 }
 
-void free_pipeline(Pipeline *pipeline)
+bool remove_alias(char *name)
+{
+    TableSlot *slot = table_find(&alias_table, name);
+    if (slot == NULL)
+    {
+        return false;
+    }
+    Alias *alias = slot->value;
+    free(alias->plan);
+    table_remove(&alias_table, slot);
+    release(alias->name);
+    release(alias->command);
+    free(alias);
+    alias_changes++;
+    return true;
+}
 
+// Handles "alias NAME = COMMAND" straight from the line text, the command is
+// kept exactly as typed. Returns false if the line is not of that form.
+bool define_alias(char *line)
 {
-    Command *tmp;
-    if (!pipeline)
+    char *p = line + strlen("alias");
+    if (!isspace(*p))
     {
-        return;
+        return false;
     }
-    Command *next;
-    for (tmp = pipeline->cmd_list->next; tmp != NULL; tmp = next)
+    while (isspace(*p))
     {
-        free(tmp->argv);
-        next = tmp->next;
-        free(tmp);
+        p++;
     }
-    pipeline->last = pipeline->cmd_list;
-    pipeline->last->next = NULL;
-    pipeline->cnt = 0;
+    char *name = p;
+    while (*p != '\0' && !isspace(*p) && *p != '=')
+    {
+        p++;
+    }
+    char *name_end = p;
+    while (isspace(*p))
+    {
+        p++;
+    }
+    if (name_end == name || *p != '=')
+    {
+        return false;
+    }
+    p++;
+    while (isspace(*p))
+    {
+        p++;
+    }
+    char *end = p + strlen(p);
+    while (end > p && isspace(end[-1]))
+    {
+        end--;
+    }
+    if (end == p)
+    {
+        return false;
+    }
+    *name_end = '\0';
+    *end = '\0';
+    insert_alias(name, p);
+    return true;
 }
 
-void close_all_pipes(int pipe_fd[][2], int count)
+void flush_path_cache(int from_dir)
 {
-    for (int i = 0; i < count; i++)
+    for (size_t i = 0; i < path_table.size; i++)
     {
-        close(pipe_fd[i][0]);
-        close(pipe_fd[i][1]);
+        PathEntry *pe = path_table.slots[i].value;
+        if (pe != NULL && pe->dir_idx >= from_dir)
+        {
+            table_remove(&path_table, &path_table.slots[i]);
+            free(pe->name);
+            free(pe->path);
+            free(pe);
+        }
     }
 }
 
-bool is_valid_filename(char *filename)
-
+void load_path_dirs()
 {
-    int len = strlen(filename);
-    for (int i = 0; i < len; i++)
+    for (int i = 0; i < path_dir_count; i++)
     {
-        if (isalpha(filename[i]))
+        free(path_dirs[i].dir);
+    }
+    free(path_dirs);
+    free(path_cache_env);
+    path_dirs = NULL;
+    path_dir_count = 0;
+    char *env = getenv("PATH");
+    path_cache_env = strdup(env != NULL ? env : "");
+    char *copy = strdup(path_cache_env);
+    if (path_cache_env == NULL || copy == NULL)
+    {
+        error_exit("strdup");
+    }
+    int max_dirs = 1;
+    for (char *c = copy; *c != '\0'; c++)
+    {
+        max_dirs += (*c == ':');
+    }
+    path_dirs = malloc(max_dirs * sizeof(PathDir));
+    if (path_dirs == NULL)
+    {
+        error_exit("malloc");
+    }
+    char *save = NULL;
+    for (char *dir = strtok_r(copy, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save))
+    {
+        struct stat st;
+        path_dirs[path_dir_count].dir = strdup(dir);
+        if (path_dirs[path_dir_count].dir == NULL)
         {
-            return true;
+            error_exit("strdup");
         }
+        memset(&path_dirs[path_dir_count].mtime, 0, sizeof(struct timespec));
+        if (stat(dir, &st) == 0)
+        {
+            path_dirs[path_dir_count].mtime = st.st_mtim;
+        }
+        path_dir_count++;
     }
-    return false;
+    free(copy);
+    path_cache_checked = time(NULL);
 }
 
-void execute(Pipeline *pipeline)
+// Drops cached paths that a change of $PATH or of a $PATH directory may have
+// made stale. Directory mtimes are only rechecked every PATH_CACHE_TTL seconds
+// so scripts running many short commands don't pay a stat per directory each
+// time.
+void validate_path_cache()
 {
-    if (!(pipeline->cnt))
+    char *env = getenv("PATH");
+    if (path_cache_env == NULL || strcmp(env != NULL ? env : "", path_cache_env) != 0)
     {
+        flush_path_cache(0);
+        load_path_dirs();
         return;
     }
-    if (!strcmp(pipeline->cmd_list->next->argv[0], "cd"))
+    time_t now = time(NULL);
+    if (now - path_cache_checked < PATH_CACHE_TTL)
     {
-        change_dir(pipeline->cmd_list->next->argv);
         return;
     }
-    if (!strcmp(pipeline->cmd_list->next->argv[0], "history"))
+    path_cache_checked = now;
+    for (int i = 0; i < path_dir_count; i++)
     {
-        pop();
-        HistoryNode *hn = ptr->head;
-        while (hn != NULL)
+        struct stat st;
+        struct timespec mtime = {0, 0};
+        if (stat(path_dirs[i].dir, &st) == 0)
         {
-            printf("%s", hn->input);
-            hn = hn->next;
+            mtime = st.st_mtim;
         }
-        return;
+        if (mtime.tv_sec != path_dirs[i].mtime.tv_sec || mtime.tv_nsec != path_dirs[i].mtime.tv_nsec)
+        {
+            // A new file here can shadow commands found in later directories
+            flush_path_cache(i);
+            for (int j = i; j < path_dir_count; j++)
+            {
+                if (stat(path_dirs[j].dir, &st) == 0)
+                {
+                    path_dirs[j].mtime = st.st_mtim;
+                }
+            }
+            return;
+        }
+    }
+}
+
+PathEntry *search_path_cache(char *name)
+{
+    TableSlot *slot = table_find(&path_table, name);
+    return slot != NULL ? slot->value : NULL;
+}
+
+void forget_command(char *name)
+{
+    TableSlot *slot = table_find(&path_table, name);
+    if (slot != NULL)
+    {
+        PathEntry *pe = slot->value;
+        table_remove(&path_table, slot);
+        free(pe->name);
+        free(pe->path);
+        free(pe);
+    }
+}
+
+// Returns the absolute path execvp would run for name, or NULL to let
+// execvp/posix_spawnp search $PATH themselves
+char *resolve_command(char *name)
+{
+    if (strchr(name, '/') != NULL)
+    {
+        return NULL;
+    }
+    PathEntry *pe = search_path_cache(name);
+    if (pe != NULL)
+    {
+        pe->hits++;
+        return pe->path;
     }
-    if (!strcmp(pipeline->cmd_list->next->argv[0], "alias"))
+    char path[PATH_MAX];
+    for (int i = 0; i < path_dir_count; i++)
     {
-        if (pipeline->cmd_list->next->argc < 4)
+        struct stat st;
+        if (path_dirs[i].dir[0] != '/')
         {
-            perror("Less arguments than expected");
-            return;
+            // Relative entries depend on the cwd, leave them to execvp
+            return NULL;
         }
-        char alias[MAX_ALIAS_LEN];
-        char command_name[MAX_CMD_SIZE];
-        char command[MAX_CMD_SIZE];
-        int cmd_idx = 0;
-        int n = pipeline->cmd_list->next->argc;
-        strcpy(alias, pipeline->cmd_list->next->argv[1]);
-        strcpy(command_name, pipeline->cmd_list->next->argv[3]);
-        for (int i = 3; i < n; i++)
+        if (snprintf(path, PATH_MAX, "%s/%s", path_dirs[i].dir, name) >= PATH_MAX)
         {
-            strcpy(cmd_idx + command, pipeline->cmd_list->next->argv[i]);
-            cmd_idx += strlen(pipeline->cmd_list->next->argv[i]);
-            if (i != n - 1)
-            {
-                command[cmd_idx++] = ' ';
-            }
-            else
-            {
-                command[cmd_idx] = '\0';
-            }
+            continue;
+        }
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || access(path, X_OK) != 0)
+        {
+            continue;
         }
-        insert_table(alias, command_name, command);
+        PathEntry *pe = malloc(sizeof(PathEntry));
+        if (pe == NULL)
+        {
+            error_exit("malloc");
+        }
+        pe->name = strdup(name);
+        pe->path = strdup(path);
+        if (pe->name == NULL || pe->path == NULL)
+        {
+            error_exit("strdup");
+        }
+        pe->dir_idx = i;
+        pe->hits = 1;
+        table_insert(&path_table, pe->name)->value = pe;
+        return pe->path;
+    }
+    return NULL;
+}
+
+// hash lists cached commands, hash -r empties the cache, hash name... adds
+void hash_builtin(Command *cmd)
+{
+    validate_path_cache();
+    if (cmd->argc == 2 && !strcmp(cmd->argv[1], "-r"))
+    {
+        flush_path_cache(0);
         return;
     }
-    if (!strcmp(pipeline->cmd_list->next->argv[0], "unalias"))
+    if (cmd->argc > 1)
     {
-        char alias[MAX_ALIAS_LEN];
-        strcpy(alias, pipeline->cmd_list->next->argv[1]);
-        HashEntry *he = search_table(alias);
-        if (he == NULL)
+        for (int i = 1; i < cmd->argc; i++)
         {
-            perror("Alias not found");
-            return;
+            if (resolve_command(cmd->argv[i]) == NULL && strchr(cmd->argv[i], '/') == NULL)
+            {
+                fprintf(stderr, "hash: %s: not found\n", cmd->argv[i]);
+            }
+            else if (search_path_cache(cmd->argv[i]) != NULL)
+            {
+                search_path_cache(cmd->argv[i])->hits = 0;
+            }
         }
-        he->present = false;
         return;
     }
-    if (!strcmp(pipeline->cmd_list->next->argv[0], "exit"))
+    if (path_table.live > 0)
     {
-        exit(EXIT_SUCCESS);
+        printf("hits\tcommand\n");
     }
-    int count = pipeline->cnt;
-    int pipe_fd[count - 1][2];
-    for (int i = 0; i < count - 1; i++)
+    for (size_t i = 0; i < path_table.size; i++)
     {
-        if (pipe(pipe_fd[i]) == -1)
+        PathEntry *pe = path_table.slots[i].value;
+        if (pe != NULL)
         {
-            error_exit("pipe");
+            printf("%4d\t%s\n", pe->hits, pe->path);
         }
     }
-    Command *cmd = pipeline->cmd_list->next;
-    int out_count = 0;
+    if (path_table.live == 0)
+    {
+        printf("hash: hash table empty\n");
+    }
+}
+
+ssize_t write_all(int fd, const char *buffer, size_t len)
+{
+    size_t written = 0;
+    while (written < len)
+    {
+        ssize_t n = write(fd, buffer + written, len - written);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            return -1;
+        }
+        written += n;
+    }
+    return written;
+}
+
+unsigned int trigram_bit(const char *p)
+{
+    return ((unsigned char)p[0] * 961u + (unsigned char)p[1] * 31u + (unsigned char)p[2]) % (HISTORY_BLOOM_WORDS * 64);
+}
+
+void index_line(HistoryIndex *index, const char *text, unsigned int seq)
+{
+    unsigned long long *bloom = index->blooms[seq / HISTORY_BLOCK % index->nblocks];
+    if (seq % HISTORY_BLOCK == 0)
+    {
+        memset(bloom, 0, sizeof(index->blooms[0])); // Reusing an evicted block
+    }
+    char prev[2] = {'^', text[0]};
+    if (text[0] == '\0')
+    {
+        return;
+    }
+    for (const char *p = text + 1; *p != '\0'; p++)
+    {
+        char tri[3] = {prev[0], prev[1], *p};
+        unsigned int bit = trigram_bit(tri);
+        bloom[bit / 64] |= 1ULL << (bit % 64);
+        prev[0] = prev[1];
+        prev[1] = *p;
+    }
+}
+
+void free_history_index()
+{
+    if (history.index != NULL)
+    {
+        free(history.index->blooms);
+        free(history.index);
+        history.index = NULL;
+    }
+}
+
+void build_history_index()
+{
+    history.index = malloc(sizeof(HistoryIndex));
+    if (history.index == NULL)
+    {
+        error_exit("malloc");
+    }
+    // One spare block for the partly evicted oldest one
+    history.index->nblocks = history.cap / HISTORY_BLOCK + 2;
+    history.index->blooms = calloc(history.index->nblocks, sizeof(history.index->blooms[0]));
+    if (history.index->blooms == NULL)
+    {
+        error_exit("calloc");
+    }
+    for (unsigned int seq = history.next_seq - history.count; seq != history.next_seq; seq++)
+    {
+        index_line(history.index, history.ring[seq % history.cap], seq);
+    }
+}
+
+// Calls found on each line containing pattern (starting with it if
+// anchored), newest first, until it returns false
+void search_history(const char *pattern, bool anchored, bool (*found)(const char *, unsigned int, void *), void *arg)
+{
+    size_t len = strlen(pattern);
+    char key[len + 2];
+    key[0] = '^';
+    memcpy(key + 1, pattern, len + 1);
+    char *k = anchored ? key : key + 1;
+    size_t klen = anchored ? len + 1 : len;
+    unsigned long long want[HISTORY_BLOOM_WORDS] = {0};
+    for (size_t i = 0; i + 3 <= klen; i++)
+    {
+        unsigned int bit = trigram_bit(k + i);
+        want[bit / 64] |= 1ULL << (bit % 64);
+    }
+    if (history.index == NULL && klen >= 3)
+    {
+        build_history_index();
+    }
+    unsigned int oldest = history.next_seq - history.count;
+    unsigned int seq = history.next_seq;
+    while (seq != oldest)
+    {
+        // Checks the filter of the block holding seq - 1
+        unsigned int block_start = (seq - 1) / HISTORY_BLOCK * HISTORY_BLOCK;
+        if (seq - oldest < seq - block_start)
+        {
+            block_start = oldest;
+        }
+        bool candidate = true;
+        if (klen >= 3)
+        {
+            unsigned long long *bloom = history.index->blooms[(seq - 1) / HISTORY_BLOCK % history.index->nblocks];
+            for (int w = 0; w < HISTORY_BLOOM_WORDS && candidate; w++)
+            {
+                candidate = (bloom[w] & want[w]) == want[w];
+            }
+        }
+        for (; candidate && seq != block_start; seq--)
+        {
+            const char *text = history.ring[(seq - 1) % history.cap];
+            bool match = anchored ? strncmp(text, pattern, len) == 0 : strstr(text, pattern) != NULL;
+            if (match && !found(text, seq - 1, arg))
+            {
+                return;
+            }
+        }
+        seq = block_start;
+    }
+}
+
+void add_history(const char *text, size_t len)
+{
+    unsigned int slot = history.next_seq % history.cap;
+    if (history.count == history.cap)
+    {
+        free(history.ring[slot]);
+    }
+    else
+    {
+        history.count++;
+    }
+    history.ring[slot] = strndup(text, len);
+    if (history.ring[slot] == NULL)
+    {
+        error_exit("strndup");
+    }
+    if (history.index != NULL)
+    {
+        index_line(history.index, history.ring[slot], history.next_seq);
+    }
+    history.next_seq++;
+}
+
+// Appends one line to the history file. O_APPEND keeps concurrent sessions
+// from overwriting each other, the lock keeps lines whole and makes us wait
+// out a compaction, after which the file is reopened.
+void append_history_file(const char *text, size_t len)
+{
+    char line[len + 1];
+    memcpy(line, text, len);
+    line[len] = '\n';
+    while (history.fd != -1)
+    {
+        struct stat fd_st, path_st;
+        if (flock(history.fd, LOCK_EX) == -1 || fstat(history.fd, &fd_st) == -1)
+        {
+            perror("history");
+            return;
+        }
+        if (stat(history.path, &path_st) == 0 && path_st.st_ino == fd_st.st_ino)
+        {
+            if (write_all(history.fd, line, len + 1) == -1)
+            {
+                perror("history");
+            }
+            flock(history.fd, LOCK_UN);
+            return;
+        }
+        close(history.fd);
+        history.fd = open(history.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    }
+}
+
+void insert_input_in_history(char *input)
+{
+    size_t len = strcspn(input, "\n");
+    if (len == 0 || history.cap == 0)
+    {
+        return;
+    }
+    add_history(input, len);
+    append_history_file(input, len);
+}
+
+// Rewrites the history file with only the lines we loaded, under the lock
+void compact_history_file()
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%d", history.path, getpid());
+    int tmp_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (tmp_fd == -1)
+    {
+        return;
+    }
+    bool ok = true;
+    for (unsigned int seq = history.next_seq - history.count; seq != history.next_seq && ok; seq++)
+    {
+        char *text = history.ring[seq % history.cap];
+        ok = write_all(tmp_fd, text, strlen(text)) != -1 && write_all(tmp_fd, "\n", 1) != -1;
+    }
+    if (close(tmp_fd) == -1 || !ok || rename(tmp, history.path) == -1)
+    {
+        unlink(tmp);
+    }
+}
+
+// Maps the history file and keeps its newest lines. The file is scanned from
+// the end, so startup cost depends on the ring size, not the file size. A
+// file holding more than twice as much as we keep is compacted.
+void load_history_file()
+{
+    int fd = open(history.path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        perror(history.path);
+        return;
+    }
+    struct stat st;
+    if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return;
+    }
+    if (st.st_size > 0)
+    {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            char *end = map + st.st_size;
+            if (end[-1] == '\n')
+            {
+                end--;
+            }
+            char *start = end;
+            for (unsigned int lines = 0; start > map && lines < history.cap; lines++)
+            {
+                char *line_end = lines == 0 ? end : start - 1; // Skips the newline
+                char *nl = memrchr(map, '\n', line_end - map);
+                start = nl != NULL ? nl + 1 : map;
+            }
+            for (char *line = start; line < end;)
+            {
+                char *nl = memchr(line, '\n', end - line);
+                size_t len = nl != NULL ? (size_t)(nl - line) : (size_t)(end - line);
+                if (len > 0)
+                {
+                    add_history(line, len);
+                }
+                line += len + 1;
+            }
+            if (start - map > end - start)
+            {
+                compact_history_file();
+            }
+            munmap(map, st.st_size);
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    history.fd = open(history.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+void resize_history(unsigned int cap)
+{
+    char **ring = calloc(cap > 0 ? cap : 1, sizeof(char *));
+    if (ring == NULL)
+    {
+        error_exit("calloc");
+    }
+    unsigned int keep = history.count < cap ? history.count : cap;
+    for (unsigned int seq = history.next_seq - history.count; seq != history.next_seq; seq++)
+    {
+        char *text = history.ring[seq % history.cap];
+        if (history.next_seq - seq <= keep)
+        {
+            ring[seq % cap] = text;
+        }
+        else
+        {
+            free(text);
+        }
+    }
+    free(history.ring);
+    free_history_index();
+    history.ring = ring;
+    history.cap = cap;
+    history.count = keep;
+}
+
+// The history file is ~/.npshell_history, or $NPSHELL_HISTFILE if set.
+// An empty $NPSHELL_HISTFILE keeps history in memory only.
+void init_history()
+{
+    char *size = getenv("NPSHELL_HISTSIZE");
+    resize_history(size != NULL ? (unsigned int)strtoul(size, NULL, 10) : HISTORY_SIZE);
+    char *file = getenv("NPSHELL_HISTFILE");
+    char *home = getenv("HOME");
+    char path[PATH_MAX];
+    if (file == NULL && home != NULL)
+    {
+        snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE);
+        file = path;
+    }
+    if (file == NULL || file[0] == '\0' || history.cap == 0)
+    {
+        return;
+    }
+    history.path = strdup(file);
+    if (history.path == NULL)
+    {
+        error_exit("strdup");
+    }
+    load_history_file();
+}
+
+bool print_history_line(const char *text, unsigned int seq, void *arg)
+{
+    if (arg != NULL && seq == *(unsigned int *)arg)
+    {
+        return true;
+    }
+    printf("%5u  %s\n", seq + 1, text);
+    return true;
+}
+
+// history prints the lines newest first, history -s PATTERN only the ones
+// containing PATTERN
+int history_builtin(Command *cmd)
+{
+    unsigned int current = history.next_seq - 1; // This history line
+    if (cmd->argc == 3 && !strcmp(cmd->argv[1], "-s"))
+    {
+        search_history(cmd->argv[2], false, print_history_line, &current);
+        return EXIT_SUCCESS;
+    }
+    if (cmd->argc != 1)
+    {
+        fprintf(stderr, "usage: history [-s pattern]\n");
+        return EXIT_FAILURE;
+    }
+    for (unsigned int i = 0; i < history.count; i++)
+    {
+        unsigned int seq = history.next_seq - 1 - i;
+        print_history_line(history.ring[seq % history.cap], seq, &current);
+    }
+    return EXIT_SUCCESS;
+}
+
+bool take_history_line(const char *text, unsigned int seq, void *arg)
+{
+    (void)seq; // Only print_history_line shows it
+    *(const char **)arg = text;
+    return false;
+}
+
+// !! is the previous line, !PREFIX the newest line starting with PREFIX.
+// Returns a copy of it, or NULL if there is none.
+char *expand_history(char *input)
+{
+    static char *line = NULL;
+    size_t len = strcspn(input + 1, "\n");
+    const char *found = NULL;
+    input[len + 1] = '\0';
+    if (!strcmp(input, "!!"))
+    {
+        if (history.count > 0)
+        {
+            found = history.ring[(history.next_seq - 1) % history.cap];
+        }
+    }
+    else if (len > 0)
+    {
+        search_history(input + 1, true, take_history_line, &found);
+    }
+    if (found == NULL)
+    {
+        return NULL;
+    }
+    free(line);
+    line = strdup(found);
+    if (line == NULL)
+    {
+        error_exit("strdup");
+    }
+    return line;
+}
+
+int trie_node(Trie *trie, char c)
+{
+    if (trie->count == trie->cap)
+    {
+        trie->cap = trie->cap > 0 ? 2 * trie->cap : 64;
+        trie->nodes = realloc(trie->nodes, trie->cap * sizeof(TrieNode));
+        if (trie->nodes == NULL)
+        {
+            error_exit("realloc");
+        }
+    }
+    trie->nodes[trie->count] = (TrieNode){.child = -1, .sibling = -1, .c = c, .word = false};
+    return trie->count++;
+}
+
+// Empties the trie down to its root, which also marks it as loaded
+void trie_reset(Trie *trie)
+{
+    trie->count = 0;
+    trie_node(trie, '\0');
+}
+
+void trie_insert(Trie *trie, const char *name)
+{
+    int node = 0;
+    for (; *name != '\0'; name++)
+    {
+        int child = trie->nodes[node].child;
+        while (child != -1 && trie->nodes[child].c != *name)
+        {
+            child = trie->nodes[child].sibling;
+        }
+        if (child == -1)
+        {
+            child = trie_node(trie, *name);
+            trie->nodes[child].sibling = trie->nodes[node].child;
+            trie->nodes[node].child = child;
+        }
+        node = child;
+    }
+    trie->nodes[node].word = true;
+}
+
+// The node reached by the len bytes of prefix, -1 if no name starts so
+int trie_find(Trie *trie, const char *prefix, size_t len)
+{
+    int node = trie->count > 0 ? 0 : -1;
+    for (size_t i = 0; i < len && node != -1; i++)
+    {
+        node = trie->nodes[node].child;
+        while (node != -1 && trie->nodes[node].c != prefix[i])
+        {
+            node = trie->nodes[node].sibling;
+        }
+    }
+    return node;
+}
+
+// Follows the path below node while there is only one way to go, writing
+// the bytes it passes to ext. Returns the node it stops at.
+int trie_extend(Trie *trie, int node, char *ext, size_t cap)
+{
+    size_t n = 0;
+    while (!trie->nodes[node].word && trie->nodes[node].child != -1 && trie->nodes[trie->nodes[node].child].sibling == -1 && n + 1 < cap)
+    {
+        node = trie->nodes[node].child;
+        ext[n++] = trie->nodes[node].c;
+    }
+    ext[n] = '\0';
+    return node;
+}
+
+void add_completion(Completions *list, const char *name, size_t len)
+{
+    if (list->count == list->cap)
+    {
+        list->cap = list->cap > 0 ? 2 * list->cap : 64;
+        list->names = realloc(list->names, list->cap * sizeof(char *));
+        if (list->names == NULL)
+        {
+            error_exit("realloc");
+        }
+    }
+    list->names[list->count] = strndup(name, len);
+    if (list->names[list->count++] == NULL)
+    {
+        error_exit("strndup");
+    }
+}
+
+// Adds every name below node, name holds the len bytes leading to it
+void trie_collect(Trie *trie, int node, char *name, size_t len, Completions *list)
+{
+    if (trie->nodes[node].word)
+    {
+        add_completion(list, name, len);
+    }
+    for (int child = trie->nodes[node].child; child != -1 && len + 1 < PATH_MAX; child = trie->nodes[child].sibling)
+    {
+        name[len] = trie->nodes[child].c;
+        trie_collect(trie, child, name, len + 1, list);
+    }
+}
+
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Sorts the list and drops the duplicates, such as a command found in two
+// $PATH directories
+void sort_completions(Completions *list)
+{
+    qsort(list->names, list->count, sizeof(char *), compare_names);
+    int kept = 0;
+    for (int i = 0; i < list->count; i++)
+    {
+        if (kept > 0 && !strcmp(list->names[i], list->names[kept - 1]))
+        {
+            free(list->names[i]);
+            continue;
+        }
+        list->names[kept++] = list->names[i];
+    }
+    list->count = kept;
+}
+
+void free_completions(Completions *list)
+{
+    for (int i = 0; i < list->count; i++)
+    {
+        free(list->names[i]);
+    }
+    free(list->names);
+    *list = (Completions){NULL, 0, 0};
+}
+
+// Reads the executables of one $PATH directory into its trie
+void load_completion_dir(CompletionDir *cd)
+{
+    trie_reset(&cd->trie);
+    DIR *dir = opendir(cd->dir);
+    if (dir == NULL)
+    {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        if (entry->d_name[0] == '.' || entry->d_type == DT_DIR || faccessat(dirfd(dir), entry->d_name, X_OK, 0) != 0)
+        {
+            continue;
+        }
+        if (entry->d_type != DT_REG && (fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || S_ISDIR(st.st_mode)))
+        {
+            continue; // A link to a directory
+        }
+        trie_insert(&cd->trie, entry->d_name);
+    }
+    closedir(dir);
+}
+
+// Brings the completion index up to date. A $PATH directory is read again
+// only when its mtime has changed, a new $PATH starts over, and the alias
+// trie is rebuilt after aliases were added or removed. Nothing is read
+// before the first completion.
+void refresh_completion()
+{
+    char *env = getenv("PATH");
+    env = env != NULL ? env : "";
+    if (completion_env == NULL || strcmp(env, completion_env) != 0)
+    {
+        for (int i = 0; i < completion_dir_count; i++)
+        {
+            free(completion_dirs[i].dir);
+            free(completion_dirs[i].trie.nodes);
+        }
+        free(completion_dirs);
+        free(completion_env);
+        completion_env = strdup(env);
+        completion_dirs = calloc(strlen(env) / 2 + 1, sizeof(CompletionDir));
+        completion_dir_count = 0;
+        if (completion_env == NULL || completion_dirs == NULL)
+        {
+            error_exit("malloc");
+        }
+        for (char *start = env; *start != '\0';)
+        {
+            size_t len = strcspn(start, ":");
+            if (len > 0 && (completion_dirs[completion_dir_count].dir = strndup(start, len)) != NULL)
+            {
+                completion_dir_count++;
+            }
+            start += len + (start[len] == ':');
+        }
+    }
+    for (int i = 0; i < completion_dir_count; i++)
+    {
+        CompletionDir *cd = &completion_dirs[i];
+        struct stat st;
+        struct timespec mtime = {0, 0};
+        if (stat(cd->dir, &st) == 0)
+        {
+            mtime = st.st_mtim;
+        }
+        if (cd->trie.count == 0 || mtime.tv_sec != cd->mtime.tv_sec || mtime.tv_nsec != cd->mtime.tv_nsec)
+        {
+            load_completion_dir(cd);
+            cd->mtime = mtime;
+        }
+    }
+    if (alias_trie.count == 0 || alias_trie_changes != alias_changes)
+    {
+        trie_reset(&alias_trie);
+        for (size_t i = 0; i < alias_table.size; i++)
+        {
+            Alias *alias = alias_table.slots[i].value;
+            if (alias != NULL)
+            {
+                trie_insert(&alias_trie, alias->name);
+            }
+        }
+        alias_trie_changes = alias_changes;
+    }
+    if (builtin_trie.count == 0)
+    {
+        trie_reset(&builtin_trie);
+        for (size_t i = 0; i < sizeof(builtin_names) / sizeof(builtin_names[0]); i++)
+        {
+            trie_insert(&builtin_trie, builtin_names[i]);
+        }
+    }
+}
+
+// Completes the len bytes of prefix as a command name: builtins, aliases
+// and executables in $PATH. Writes what every match continues with to ext
+// and adds the matches to list if it is not NULL. Returns how the matches
+// stand: none, one, or several.
+enum Match complete_command(const char *prefix, size_t len, char *ext, size_t cap, Completions *list)
+{
+    enum Match match = MATCH_NONE;
+    char name[PATH_MAX];
+    refresh_completion();
+    memcpy(name, prefix, len < PATH_MAX ? len : PATH_MAX - 1);
+    for (int i = -2; i < completion_dir_count; i++)
+    {
+        Trie *trie = i == -2 ? &builtin_trie : i == -1 ? &alias_trie : &completion_dirs[i].trie;
+        int node = trie_find(trie, prefix, len);
+        if (node == -1)
+        {
+            continue;
+        }
+        char found[PATH_MAX];
+        int end = trie_extend(trie, node, found, sizeof(found) < cap ? sizeof(found) : cap);
+        bool one = trie->nodes[end].word && trie->nodes[end].child == -1;
+        if (match == MATCH_NONE)
+        {
+            strcpy(ext, found);
+            match = one ? MATCH_ONE : MATCH_MANY;
+        }
+        else
+        {
+            size_t common = 0;
+            while (ext[common] != '\0' && ext[common] == found[common])
+            {
+                common++;
+            }
+            // The same name in two directories is still one match
+            match = match == MATCH_ONE && one && ext[common] == found[common] ? MATCH_ONE : MATCH_MANY;
+            ext[common] = '\0';
+        }
+        if (list != NULL && len < PATH_MAX)
+        {
+            trie_collect(trie, node, name, len, list);
+        }
+    }
+    return match;
+}
+
+// Completes the len bytes of word as a path, reading its directory each time
+enum Match complete_file(const char *word, size_t len, char *ext, size_t cap, Completions *list)
+{
+    enum Match match = MATCH_NONE;
+    char dir_path[PATH_MAX];
+    const char *slash = memrchr(word, '/', len);
+    const char *base = slash != NULL ? slash + 1 : word;
+    size_t base_len = word + len - base;
+    snprintf(dir_path, sizeof(dir_path), "%.*s", slash != NULL ? (int)(slash - word) + 1 : 1, slash != NULL ? word : ".");
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL)
+    {
+        return MATCH_NONE;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        const char *name = entry->d_name;
+        if (strncmp(name, base, base_len) != 0 || (name[0] == '.' && base_len == 0) || !strcmp(name, ".") || !strcmp(name, ".."))
+        {
+            continue;
+        }
+        struct stat st;
+        bool is_dir = entry->d_type == DT_DIR || ((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) && fstatat(dirfd(dir), name, &st, 0) == 0 && S_ISDIR(st.st_mode));
+        char found[PATH_MAX];
+        snprintf(found, sizeof(found) < cap ? sizeof(found) : cap, "%s%s", name + base_len, is_dir ? "/" : "");
+        if (match == MATCH_NONE)
+        {
+            strcpy(ext, found);
+            match = MATCH_ONE;
+        }
+        else
+        {
+            size_t common = 0;
+            while (ext[common] != '\0' && ext[common] == found[common])
+            {
+                common++;
+            }
+            ext[common] = '\0';
+            match = MATCH_MANY;
+        }
+        if (list != NULL)
+        {
+            snprintf(found, sizeof(found), "%s%s", name, is_dir ? "/" : "");
+            add_completion(list, found, strlen(found));
+        }
+    }
+    closedir(dir);
+    return match;
+}
+
+// complete PREFIX prints the commands PREFIX completes to, one per line
+int complete_builtin(Command *cmd)
+{
+    Completions list = {NULL, 0, 0};
+    char ext[PATH_MAX];
+    const char *prefix = cmd->argc > 1 ? cmd->argv[1] : "";
+    complete_command(prefix, strlen(prefix), ext, sizeof(ext), &list);
+    sort_completions(&list);
+    for (int i = 0; i < list.count; i++)
+    {
+        printf("%s\n", list.names[i]);
+    }
+    int status = list.count > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    free_completions(&list);
+    return status;
+}
+
+int change_dir(char **args)
+
+{
+    if (args[1] == NULL)
+
+    {
+        perror("Expected argument to \"cd\"\n");
+        return EXIT_FAILURE;
+    }
+    else if (chdir(args[1]) != 0)
+
+    {
+        perror("chdir");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void print_json_string(FILE *fp, char *str)
+{
+    fputc('"', fp);
+    for (; *str != '\0'; str++)
+    {
+        if (*str == '"' || *str == '\\')
+        {
+            fprintf(fp, "\\%c", *str);
+        }
+        else if ((unsigned char)*str < 0x20)
+        {
+            fprintf(fp, "\\u%04x", *str);
+        }
+        else
+        {
+            fputc(*str, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+long long timespec_ns(struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+// Start of a traced span, 0 without reading the clock while tracing is off
+long long trace_clock()
+{
+    struct timespec now;
+    if (trace_ring == NULL)
+    {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_ns(&now);
+}
+
+// Records an event of process pid into the shared ring, overwriting the
+// oldest one once it is full. end_ns is -1 for an instant event.
+void trace_event(const char *name, long long start_ns, long long end_ns, pid_t pid, int stage, const char *detail)
+{
+    if (trace_ring == NULL)
+    {
+        return;
+    }
+    unsigned long slot = __atomic_fetch_add(&trace_ring->next, 1, __ATOMIC_RELAXED);
+    TraceEvent *ev = &trace_ring->events[slot % TRACE_EVENTS];
+    snprintf(ev->name, sizeof(ev->name), "%s", name);
+    snprintf(ev->detail, sizeof(ev->detail), "%s", detail != NULL ? detail : "");
+    ev->start_ns = start_ns;
+    ev->dur_ns = end_ns == -1 ? -1 : end_ns - start_ns;
+    ev->pid = pid;
+    ev->stage = stage;
+}
+
+// A span of this process from start_ns, taken with trace_clock, until now
+void trace_span(const char *name, long long start_ns, int stage, const char *detail)
+{
+    if (trace_ring != NULL)
+    {
+        trace_event(name, start_ns, trace_clock(), getpid(), stage, detail);
+    }
+}
+
+// Writes the events in the ring to the trace file in Chrome trace-event
+// JSON, oldest first. Children recorded theirs in the same ring, only the
+// shell writes it out.
+void write_trace()
+{
+    if (trace_ring == NULL || getpid() != trace_owner)
+    {
+        return;
+    }
+    FILE *fp = fopen(trace_file, "w");
+    if (fp == NULL)
+    {
+        perror(trace_file);
+        return;
+    }
+    unsigned long end = trace_ring->next;
+    unsigned long start = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"npshell\"}}", trace_owner, trace_owner);
+    for (unsigned long i = start; i < end; i++)
+    {
+        TraceEvent *ev = &trace_ring->events[i % TRACE_EVENTS];
+        fprintf(fp, ",\n{\"name\":");
+        print_json_string(fp, ev->name);
+        fprintf(fp, ",\"ph\":\"%s\",\"ts\":%.3f", ev->dur_ns == -1 ? "i\",\"s\":\"t" : "X", ev->start_ns / 1e3);
+        if (ev->dur_ns != -1)
+        {
+            fprintf(fp, ",\"dur\":%.3f", ev->dur_ns / 1e3);
+        }
+        fprintf(fp, ",\"pid\":%d,\"tid\":%d,\"args\":{\"stage\":%d,\"detail\":", trace_owner, ev->pid, ev->stage);
+        print_json_string(fp, ev->detail);
+        fprintf(fp, "}}");
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+// Starts recording into a fresh ring written to file, or stops with "off".
+// Either way the events so far are written to the previous file first.
+bool set_trace(const char *file)
+{
+    static bool registered = false;
+    write_trace();
+    if (!strcmp(file, "off"))
+    {
+        if (trace_ring != NULL)
+        {
+            munmap(trace_ring, sizeof(TraceRing));
+            trace_ring = NULL;
+        }
+        return true;
+    }
+    if (file[0] == '\0')
+    {
+        return false;
+    }
+    char cwd[PATH_MAX];
+    if (file[0] != '/' && getcwd(cwd, sizeof(cwd)) != NULL)
+    {
+        // Later cd commands must not move the file
+        snprintf(trace_file, sizeof(trace_file), "%s/%s", cwd, file);
+    }
+    else
+    {
+        snprintf(trace_file, sizeof(trace_file), "%s", file);
+    }
+    if (trace_ring == NULL)
+    {
+        // Shared, so forked children and helpers record into it too
+        trace_ring = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (trace_ring == MAP_FAILED)
+        {
+            trace_ring = NULL;
+            perror("mmap");
+            return false;
+        }
+    }
+    trace_ring->next = 0;
+    trace_owner = getpid();
+    if (!registered)
+    {
+        atexit(write_trace);
+        registered = true;
+    }
+    return true;
+}
+
+// Fallback for fds tee(2) cannot handle, memory use stays at one buffer
+void fanout_copy(int in_fd, int branch_fd, int next_fd, unsigned long long *bytes)
+{
+    char buffer[BUFFER_SIZE * 64];
+    bool branch_open = true;
+    bool next_open = true;
+    ssize_t bytes_read;
+    while ((branch_open || next_open) && (bytes_read = read(in_fd, buffer, sizeof(buffer))) > 0)
+    {
+        *bytes += bytes_read;
+        if (branch_open && write_all(branch_fd, buffer, bytes_read) == -1)
+        {
+            branch_open = false;
+        }
+        if (next_open && write_all(next_fd, buffer, bytes_read) == -1)
+        {
+            next_open = false;
+        }
+    }
+}
+
+// Copies everything arriving on in_fd to both branch_fd and next_fd. tee(2)
+// duplicates the pipe pages into the branch and splice(2) then moves the same
+// bytes on to the next stage, so no data passes through user space and at most
+// a pipe's worth of data is in flight. A reader that goes away is dropped and
+// the remaining one keeps receiving the stream.
+void fanout(int in_fd, int branch_fd, int next_fd, unsigned long long *bytes)
+{
+    signal(SIGPIPE, SIG_IGN);
+    bool branch_open = true;
+    bool next_open = true;
+    while (branch_open || next_open)
+    {
+        if (!branch_open || !next_open)
+        {
+            int out_fd = branch_open ? branch_fd : next_fd;
+            ssize_t n = splice(in_fd, NULL, out_fd, NULL, FANOUT_CHUNK, SPLICE_F_MOVE);
+            if (n == 0)
+            {
+                return;
+            }
+            if (n == -1 && errno == EPIPE)
+            {
+                return;
+            }
+            if (n == -1 && errno != EINTR)
+            {
+                error_exit("splice");
+            }
+            if (n > 0)
+            {
+                *bytes += n;
+            }
+            continue;
+        }
+        ssize_t n = tee(in_fd, branch_fd, FANOUT_CHUNK, 0);
+        if (n == 0)
+        {
+            return;
+        }
+        if (n == -1)
+        {
+            if (errno == EPIPE)
+            {
+                branch_open = false;
+            }
+            else if (errno == EINVAL)
+            {
+                fanout_copy(in_fd, branch_fd, next_fd, bytes);
+                return;
+            }
+            else if (errno != EINTR)
+            {
+                error_exit("tee");
+            }
+            continue;
+        }
+        *bytes += n;
+        while (n > 0)
+        {
+            ssize_t moved = next_open ? splice(in_fd, NULL, next_fd, NULL, n, SPLICE_F_MOVE) : 0;
+            if (moved == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (moved == -1 && errno != EPIPE)
+            {
+                error_exit("splice");
+            }
+            if (moved <= 0)
+            {
+                // Next stage is gone, drain what the branch already received
+                next_open = false;
+                char buffer[BUFFER_SIZE];
+                moved = read(in_fd, buffer, n < BUFFER_SIZE ? n : BUFFER_SIZE);
+                if (moved <= 0)
+                {
+                    return;
+                }
+            }
+            n -= moved;
+        }
+    }
+}
+
+int compare_fds(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// Closes every fd above stderr but the n in keep, which is sorted. A helper
+// forked from the shell never execs, so CLOEXEC doesn't clear what it
+// inherited; close_range does it in a syscall per gap.
+void close_other_fds(int *keep, int n, int stage)
+{
+    long long traced = trace_clock();
+    qsort(keep, n, sizeof(int), compare_fds);
+    unsigned int from = STDERR_FILENO + 1;
+    for (int k = 0; k < n; k++)
+    {
+        if (keep[k] < (int)from)
+        {
+            continue;
+        }
+        if ((unsigned int)keep[k] > from)
+        {
+            close_range(from, keep[k] - 1, 0);
+        }
+        from = keep[k] + 1;
+    }
+    close_range(from, ~0U, 0);
+    trace_span("close_range", traced, stage, NULL);
+}
+
+// Pipes are made as launch_job reaches the stages that use them, each is a
+// span of its own in a trace
+void make_pipe(int fd[2], int stage)
+{
+    long long traced = trace_clock();
+    if (pipe2(fd, O_CLOEXEC) == -1)
+    {
+        error_exit("pipe");
+    }
+    trace_span("pipe", traced, stage, NULL);
+}
+
+// Moves a freshly forked child into its job's process group and puts back
+// the signal dispositions the shell changed for itself
+void enter_job(Job *job)
+{
+    sigset_t none;
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    setpgid(0, job->pgid);
+    if (job->tty && job->pgid == 0)
+    {
+        tcsetpgrp(STDIN_FILENO, getpid()); // SIGTTOU is still ignored here
+    }
+    signal(SIGTTOU, SIG_DFL);
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+}
+
+// Forks the helper which feeds stage i (a branch after || or |||) through
+// fan_fd while passing its input, in_fd, on to stage i + 1 through next_fd
+pid_t spawn_fanout(int in_fd, int fan_fd[2], int next_fd, int i, unsigned long long *bytes, Job *job)
+{
+    pid_t ret = fork();
+    if (ret == -1)
+    {
+        error_exit("fork");
+    }
+    if (ret != 0)
+    {
+        return ret;
+    }
+    enter_job(job);
+    int keep[] = {in_fd, fan_fd[1], next_fd};
+    close_other_fds(keep, 3, i);
+    long long traced = trace_clock();
+    fanout(in_fd, fan_fd[1], next_fd, bytes);
+    if (trace_ring != NULL)
+    {
+        char detail[32];
+        snprintf(detail, sizeof(detail), "%llu bytes", *bytes);
+        trace_span("fanout", traced, i, detail);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+// Moves stage i's output on to next_fd and counts the bytes, only used when
+// the pipeline is timed
+pid_t spawn_relay(int relay_fd[2], int next_fd, int i, unsigned long long *bytes, Job *job)
+{
+    pid_t ret = fork();
+    if (ret == -1)
+    {
+        error_exit("fork");
+    }
+    if (ret != 0)
+    {
+        return ret;
+    }
+    enter_job(job);
+    signal(SIGPIPE, SIG_IGN);
+    int keep[] = {relay_fd[0], next_fd};
+    close_other_fds(keep, 2, i);
+    long long traced = trace_clock();
+    ssize_t n;
+    while ((n = splice(relay_fd[0], NULL, next_fd, NULL, FANOUT_CHUNK, SPLICE_F_MOVE)) != 0)
+    {
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            break;
+        }
+        *bytes += n;
+    }
+    trace_span("relay", traced, i, NULL);
+    _exit(EXIT_SUCCESS);
+}
+
+int make_memfd(const char *name)
+{
+    int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+    {
+        error_exit("memfd_create");
+    }
+    return fd;
+}
+
+// Moves what is waiting on a branch's pipe to fd, 0 at the end of it
+ssize_t collect_move(int in_fd, int fd)
+{
+    ssize_t n = splice(in_fd, NULL, fd, NULL, FANOUT_CHUNK, SPLICE_F_MOVE);
+    if (n == -1 && errno == EINVAL)
+    {
+        // A terminal, or an fd opened with O_APPEND
+        char buffer[BUFFER_SIZE * 64];
+        n = read(in_fd, buffer, sizeof(buffer));
+        if (n > 0 && write_all(fd, buffer, n) == -1)
+        {
+            return -1;
+        }
+    }
+    return n;
+}
+
+// Copies a branch held in a memfd to out_fd and closes it
+void collect_held(int held, int out_fd)
+{
+    off_t off = 0;
+    ssize_t n;
+    while ((n = sendfile(out_fd, held, &off, FANOUT_CHUNK)) > 0)
+    {
+    }
+    if (n == -1 && errno == EINVAL)
+    {
+        char buffer[BUFFER_SIZE * 64];
+        while ((n = pread(held, buffer, sizeof(buffer), off)) > 0 && write_all(out_fd, buffer, n) != -1)
+        {
+            off += n;
+        }
+    }
+    close(held);
+}
+
+// Writes the branches' output to out_fd in the order they are written in.
+// The first unfinished branch goes straight through, later ones are held
+// in memfds until the branches before them end, so every branch runs at
+// once without a pipe filling up.
+void collect_ordered(int *fds, int n, int out_fd)
+{
+    struct pollfd pfds[n];
+    int held[n];
+    for (int k = 0; k < n; k++)
+    {
+        pfds[k] = (struct pollfd){fds[k], POLLIN, 0};
+        held[k] = -1;
+    }
+    int current = 0;
+    while (current < n)
+    {
+        if (poll(pfds, n, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error_exit("poll");
+        }
+        for (int k = current; k < n; k++)
+        {
+            if (pfds[k].fd == -1 || pfds[k].revents == 0)
+            {
+                continue;
+            }
+            if (k != current && held[k] == -1)
+            {
+                held[k] = make_memfd("branch");
+            }
+            ssize_t moved = collect_move(pfds[k].fd, k == current ? out_fd : held[k]);
+            if (moved == 0 || (moved == -1 && errno != EINTR && errno != EAGAIN))
+            {
+                close(pfds[k].fd);
+                pfds[k].fd = -1; // poll skips negative fds
+            }
+        }
+        while (current < n && pfds[current].fd == -1)
+        {
+            if (++current < n && held[current] != -1)
+            {
+                collect_held(held[current], out_fd);
+                held[current] = -1;
+            }
+        }
+    }
+}
+
+// Writes the complete lines in buf to out_fd in one write, each after the
+// branch's tag
+void write_tagged(int out_fd, int k, const char *buf, size_t len)
+{
+    char tag[16];
+    int tag_len = snprintf(tag, sizeof(tag), "[%d] ", k + 1);
+    size_t lines = 0;
+    for (const char *p = buf; (p = memchr(p, '\n', buf + len - p)) != NULL; p++)
+    {
+        lines++;
+    }
+    char *out = malloc(len + lines * tag_len);
+    if (out == NULL)
+    {
+        error_exit("malloc");
+    }
+    size_t o = 0;
+    for (size_t start = 0; start < len;)
+    {
+        size_t end = (char *)memchr(buf + start, '\n', len - start) - buf + 1;
+        memcpy(out + o, tag, tag_len);
+        memcpy(out + o + tag_len, buf + start, end - start);
+        o += tag_len + end - start;
+        start = end;
+    }
+    write_all(out_fd, out, o);
+    free(out);
+}
+
+// Writes each line of every branch to out_fd as soon as it is complete,
+// tagged with the branch's number. A last line without a newline gets one.
+void collect_stream(int *fds, int n, int out_fd)
+{
+    struct pollfd pfds[n];
+    char *bufs[n];
+    size_t lens[n];
+    size_t caps[n];
+    for (int k = 0; k < n; k++)
+    {
+        pfds[k] = (struct pollfd){fds[k], POLLIN, 0};
+        bufs[k] = NULL;
+        lens[k] = caps[k] = 0;
+    }
+    for (int open = n; open > 0;)
+    {
+        if (poll(pfds, n, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error_exit("poll");
+        }
+        for (int k = 0; k < n; k++)
+        {
+            if (pfds[k].fd == -1 || pfds[k].revents == 0)
+            {
+                continue;
+            }
+            if (caps[k] - lens[k] < BUFFER_SIZE * 64)
+            {
+                caps[k] = 2 * caps[k] + BUFFER_SIZE * 64;
+                if ((bufs[k] = realloc(bufs[k], caps[k])) == NULL)
+                {
+                    error_exit("realloc");
+                }
+            }
+            ssize_t got = read(pfds[k].fd, bufs[k] + lens[k], caps[k] - lens[k] - 1);
+            if (got == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                if (lens[k] > 0)
+                {
+                    bufs[k][lens[k]++] = '\n';
+                    write_tagged(out_fd, k, bufs[k], lens[k]);
+                }
+                close(pfds[k].fd);
+                pfds[k].fd = -1;
+                free(bufs[k]);
+                open--;
+                continue;
+            }
+            char *nl = memrchr(bufs[k] + lens[k], '\n', got);
+            lens[k] += got;
+            if (nl != NULL)
+            {
+                size_t done = nl - bufs[k] + 1;
+                write_tagged(out_fd, k, bufs[k], done);
+                memmove(bufs[k], bufs[k] + done, lens[k] - done);
+                lens[k] -= done;
+            }
+        }
+    }
+}
+
+// Forks the helper which writes the outputs of a pipeline's branches, read
+// from fds, to out_fd (stdout if -1) as set -o branches says
+pid_t spawn_collector(int *fds, int n, int out_fd, Job *job)
+{
+    pid_t ret = fork();
+    if (ret == -1)
+    {
+        error_exit("fork");
+    }
+    if (ret != 0)
+    {
+        return ret;
+    }
+    enter_job(job);
+    out_fd = out_fd != -1 ? out_fd : STDOUT_FILENO;
+    int *keep = malloc((n + 1) * sizeof(int));
+    if (keep == NULL)
+    {
+        error_exit("malloc");
+    }
+    memcpy(keep, fds, n * sizeof(int));
+    keep[n] = out_fd;
+    close_other_fds(keep, n + 1, job->count - 1);
+    free(keep);
+    long long traced = trace_clock();
+    if (branch_output == BRANCH_STREAM)
+    {
+        collect_stream(fds, n, out_fd);
+    }
+    else
+    {
+        collect_ordered(fds, n, out_fd);
+    }
+    trace_span("collect", traced, job->count - 1, NULL);
+    _exit(EXIT_SUCCESS);
+}
+
+bool is_valid_filename(char *filename)
+
+{
+    if (filename == NULL)
+    {
+        return false;
+    }
+    int len = strlen(filename);
+    for (int i = 0; i < len; i++)
+    {
+        if (isalpha(filename[i]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void redirect_fd(char *file, int flags, int target_fd)
+{
+    int fd = open(file, flags, 0777);
+    if (fd == -1)
+
+    {
+        error_exit("open");
+    }
+    if (dup2(fd, target_fd) == -1)
+
+    {
+        error_exit("dup2");
+    }
+    if (close(fd) == -1)
+
+    {
+        error_exit("close");
+    }
+}
+
+// Scans a util's arguments from argv[start] the way getopt does. Letters
+// in flags are switches, letters in valued take a value, attached or as the
+// next argument; opts[letter] is set to the value, or "" for a switch.
+// Returns false for anything else, long options included.
+bool util_args(Command *cmd, int start, const char *flags, const char *valued, UtilArgs *args)
+{
+    bool options_done = false;
+    memset(args, 0, sizeof(UtilArgs));
+    args->files = arena_alloc(&line_arena, (cmd->argc + 1) * sizeof(char *));
+    for (int i = start; i < cmd->argc; i++)
+    {
+        char *arg = cmd->argv[i];
+        if (options_done || arg[0] != '-' || arg[1] == '\0')
+        {
+            args->files[args->nfiles++] = arg;
+            continue;
+        }
+        if (!strcmp(arg, "--"))
+        {
+            options_done = true;
+            continue;
+        }
+        for (char *c = arg + 1; *c != '\0'; c++)
+        {
+            if (*c == '-' || (unsigned char)*c >= 128)
+            {
+                return false;
+            }
+            if (strchr(flags, *c) != NULL)
+            {
+                args->opts[(int)*c] = "";
+                continue;
+            }
+            if (strchr(valued, *c) == NULL)
+            {
+                return false;
+            }
+            if (c[1] != '\0')
+            {
+                args->opts[(int)*c] = c + 1;
+            }
+            else if (i + 1 < cmd->argc)
+            {
+                args->opts[(int)*c] = cmd->argv[++i];
+            }
+            else
+            {
+                return false;
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+// A plain decimal count, optionally after sign (which tail accepts)
+bool util_count(char *str, char sign, unsigned long long *value, bool *signed_value)
+{
+    *signed_value = str[0] == sign;
+    str += *signed_value;
+    if (!isdigit(str[0]))
+    {
+        return false;
+    }
+    errno = 0;
+    char *end;
+    *value = strtoull(str, &end, 10);
+    return *end == '\0' && errno == 0;
+}
+
+void *util_buffer(size_t size)
+{
+    void *buf = malloc(size);
+    if (buf == NULL)
+    {
+        error_exit("malloc");
+    }
+    return buf;
+}
+
+ssize_t util_read(int fd, char *buf, size_t len)
+{
+    ssize_t n;
+    while ((n = read(fd, buf, len)) == -1 && errno == EINTR)
+    {
+    }
+    return n;
+}
+
+void util_write(const char *buf, size_t len)
+{
+    if (write_all(STDOUT_FILENO, buf, len) == -1)
+    {
+        fprintf(stderr, "%s: write error: %s\n", util_name, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+}
+
+// Passes a util's output on to the stage fused after it, or writes it to
+// stdout. Returns false once nothing downstream wants more.
+bool util_output(Filter *out, const char *buf, size_t len)
+{
+    if (out == NULL)
+    {
+        util_write(buf, len);
+        return true;
+    }
+    if (!out->done && !out->input(out, buf, len))
+    {
+        out->done = true;
+    }
+    return !out->done;
+}
+
+// "==> name <==" before each file of head or tail, blank line between them
+bool util_header(const char *name, bool *first, Filter *out)
+{
+    char header[PATH_MAX + 16];
+    int len = snprintf(header, sizeof(header), "%s==> %s <==\n", *first ? "" : "\n", name);
+    *first = false;
+    return util_output(out, header, len < (int)sizeof(header) ? len : (int)sizeof(header) - 1);
+}
+
+// Opens a head/tail operand, "-" is stdin
+int util_open(const char *file)
+{
+    if (!strcmp(file, "-"))
+    {
+        return STDIN_FILENO;
+    }
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "%s: cannot open '%s' for reading: %s\n", util_name, file, strerror(errno));
+    }
+    return fd;
+}
+
+// Moves the rest of in_fd to stdout without passing it through user space:
+// copy_file_range between regular files, splice when either end is a pipe
+// and sendfile from a regular file. Returns 0 at end of input, or -1 with
+// errno EINVAL if none of them works for these fds.
+int kernel_copy(int in_fd)
+{
+    struct stat in_st, out_st;
+    ssize_t n = -1;
+    if (fstat(in_fd, &in_st) == -1 || fstat(STDOUT_FILENO, &out_st) == -1)
+    {
+        return -1;
+    }
+    errno = EINVAL;
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode))
+    {
+        while ((n = copy_file_range(in_fd, NULL, STDOUT_FILENO, NULL, FANOUT_CHUNK, 0)) > 0 || (n == -1 && errno == EINTR))
+        {
+        }
+    }
+    else if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))
+    {
+        while ((n = splice(in_fd, NULL, STDOUT_FILENO, NULL, FANOUT_CHUNK, SPLICE_F_MOVE)) > 0 || (n == -1 && errno == EINTR))
+        {
+        }
+    }
+    else if (S_ISREG(in_st.st_mode))
+    {
+        while ((n = sendfile(STDOUT_FILENO, in_fd, NULL, FANOUT_CHUNK)) > 0 || (n == -1 && errno == EINTR))
+        {
+        }
+    }
+    if (n == -1 && (errno == EXDEV || errno == EBADF || errno == ENOSYS || errno == EOPNOTSUPP))
+    {
+        errno = EINVAL; // Nothing was copied yet
+    }
+    return n;
+}
+
+// Moves the rest of in_fd to out. Returns 0, or errno if the copy failed.
+int copy_fd(int in_fd, char *buf, Filter *out)
+{
+    if (out == NULL && kernel_copy(in_fd) == 0)
+    {
+        return 0;
+    }
+    if (out == NULL && errno != EINVAL)
+    {
+        return errno;
+    }
+    ssize_t n;
+    while ((n = util_read(in_fd, buf, UTIL_BLOCK)) > 0)
+    {
+        if (!util_output(out, buf, n))
+        {
+            return 0;
+        }
+    }
+    return n == 0 ? 0 : errno;
+}
+
+// Byte classes for wc -w: as in coreutils, a printable byte starts a word,
+// white space ends it and anything else (control and non-ASCII bytes in a
+// single-byte locale) does neither
+bool wc_is_space(unsigned char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+bool wc_is_print(unsigned char c)
+{
+    return c > ' ' && c < 0x7f;
+}
+
+void wc_count_scalar(const unsigned char *p, size_t n, WcCounts *wc, bool words)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        wc->lines += p[i] == '\n';
+        if (!words || wc_is_space(p[i]))
+        {
+            wc->in_word = false;
+        }
+        else if (wc_is_print(p[i]))
+        {
+            wc->words += !wc->in_word;
+            wc->in_word = true;
+        }
+    }
+}
+
+#if defined(__x86_64__)
+// 16 bytes at a time. Spaces and printables become bit masks, so the words
+// started in a block are the printables not preceded by a printable. Blocks
+// holding other bytes go through the scalar loop.
+void wc_count_sse2(const unsigned char *p, size_t n, WcCounts *wc, bool words)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned int lines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        if (!words)
+        {
+            wc->lines += __builtin_popcount(lines);
+            continue;
+        }
+        unsigned int space = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                                            _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1)))));
+        unsigned int print = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(' ')), _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f))));
+        if ((space | print) != 0xffff)
+        {
+            wc_count_scalar(p + i, 16, wc, words);
+            continue;
+        }
+        wc->lines += __builtin_popcount(lines);
+        wc->words += __builtin_popcount(print & ~((print << 1) | wc->in_word));
+        wc->in_word = print >> 15;
+    }
+    wc_count_scalar(p + i, n - i, wc, words);
+}
+
+__attribute__((target("avx2,popcnt"))) void wc_count_avx2(const unsigned char *p, size_t n, WcCounts *wc, bool words)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned int lines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+        if (!words)
+        {
+            wc->lines += __builtin_popcount(lines);
+            continue;
+        }
+        unsigned int space = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                                                  _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), v))));
+        unsigned int print = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), v)));
+        if ((space | print) != 0xffffffffu)
+        {
+            wc_count_scalar(p + i, 32, wc, words);
+            continue;
+        }
+        wc->lines += __builtin_popcount(lines);
+        wc->words += __builtin_popcount(print & ~((print << 1) | wc->in_word));
+        wc->in_word = print >> 31;
+    }
+    wc_count_scalar(p + i, n - i, wc, words);
+}
+#endif
+
+// wc -w in a multibyte locale, for reads holding non-ASCII bytes: printable
+// characters start words, white space and no-break spaces end them. Invalid
+// bytes are skipped.
+void wc_count_multibyte(const unsigned char *p, size_t n, WcCounts *wc, bool nbsp)
+{
+    size_t i = 0;
+    while (i < n)
+    {
+        bool initial = mbsinit(&wc->state);
+        if (p[i] < 0x80 && initial)
+        {
+            wc_count_scalar(p + i++, 1, wc, true);
+            continue;
+        }
+        wchar_t ch;
+        size_t len = mbrtowc(&ch, (const char *)p + i, n - i, &wc->state);
+        if (len == (size_t)-2)
+        {
+            return; // The state holds the start of the character
+        }
+        if (len == (size_t)-1)
+        {
+            memset(&wc->state, 0, sizeof(wc->state));
+            i += initial; // Otherwise this byte ended a bad sequence, retry it
+            continue;
+        }
+        i += len > 0 ? len : 1;
+        if (!iswprint(ch))
+        {
+            continue;
+        }
+        if (iswspace(ch) || (nbsp && (ch == 0xa0 || ch == 0x2007 || ch == 0x202f || ch == 0x2060)))
+        {
+            wc->in_word = false;
+        }
+        else
+        {
+            wc->words += !wc->in_word;
+            wc->in_word = true;
+        }
+    }
+}
+
+bool has_high_bytes(const unsigned char *p, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        unsigned long long word;
+        memcpy(&word, p + i, 8);
+        if (word & 0x8080808080808080ULL)
+        {
+            return true;
+        }
+    }
+    for (; i < n; i++)
+    {
+        if (p[i] & 0x80)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+WcCounter wc_count_block()
+{
+#if defined(__x86_64__)
+    return __builtin_cpu_supports("avx2") ? wc_count_avx2 : wc_count_sse2;
+#else
+    return wc_count_scalar;
+#endif
+}
+
+unsigned long long count_lines(const char *buf, size_t len)
+{
+    WcCounts wc = {0};
+    wc_count_block()((const unsigned char *)buf, len, &wc, false);
+    return wc.lines;
+}
+
+void wc_block(WcCounts *wc, const unsigned char *p, size_t n, bool lines, bool words)
+{
+    wc->bytes += n;
+    if (words && MB_CUR_MAX > 1 && (!mbsinit(&wc->state) || has_high_bytes(p, n)))
+    {
+        wc_count_multibyte(p, n, wc, getenv("POSIXLY_CORRECT") == NULL);
+    }
+    else if (lines || words)
+    {
+        wc_count_block()(p, n, wc, words);
+    }
+}
+
+// Counts one input. Returns 0, or errno if reading failed.
+int wc_fd(int fd, struct stat *st, WcCounts *wc, bool lines, bool words, char *buf)
+{
+    if (!lines && !words && st != NULL && S_ISREG(st->st_mode) && st->st_size % sysconf(_SC_PAGESIZE) != 0)
+    {
+        // Sizes that are a multiple of the page size may be /proc files, read those
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        wc->bytes = pos != -1 && pos < st->st_size ? st->st_size - pos : 0;
+        return 0;
+    }
+    ssize_t n;
+    while ((n = util_read(fd, buf, UTIL_BLOCK)) > 0)
+    {
+        wc_block(wc, (unsigned char *)buf, n, lines, words);
+    }
+    return n == 0 ? 0 : errno;
+}
+
+void wc_print(bool show[4], WcCounts *wc, int width, const char *name, Filter *out)
+{
+    unsigned long long values[4] = {wc->lines, wc->words, wc->bytes, wc->bytes};
+    char line[4 * 24 + PATH_MAX + 2];
+    int len = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        if (show[i])
+        {
+            len += snprintf(line + len, sizeof(line) - len, "%s%*llu", len > 0 ? " " : "", width, values[i]);
+        }
+    }
+    len += snprintf(line + len, sizeof(line) - len, "%s%s\n", name != NULL ? " " : "", name != NULL ? name : "");
+    util_output(out, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+}
+
+// Field width as coreutils picks it: wide enough for the total size of the
+// regular files, and 7 if anything else is read, unless it is one count of
+// one input
+int wc_width(char **files, int nfiles, int counts)
+{
+    if (nfiles == 1 && counts == 1)
+    {
+        return 1;
+    }
+    int width = 1;
+    int min_width = 1;
+    unsigned long long total = 0;
+    for (int i = 0; i < nfiles; i++)
+    {
+        struct stat st;
+        bool use_stdin = files[i] == NULL || !strcmp(files[i], "-");
+        if ((use_stdin ? fstat(STDIN_FILENO, &st) : stat(files[i], &st)) == -1)
+        {
+            continue;
+        }
+        if (S_ISREG(st.st_mode))
+        {
+            total += st.st_size;
+        }
+        else
+        {
+            min_width = 7;
+        }
+    }
+    for (; total >= 10; total /= 10)
+    {
+        width++;
+    }
+    return width > min_width ? width : min_width;
+}
+
+// Whether the locale from the environment has multibyte characters, without
+// changing the shell's own locale
+bool multibyte_locale()
+{
+    locale_t loc = newlocale(LC_CTYPE_MASK, "", (locale_t)0);
+    if (loc == (locale_t)0)
+    {
+        return false;
+    }
+    locale_t old = uselocale(loc);
+    bool multibyte = MB_CUR_MAX > 1;
+    uselocale(old);
+    freelocale(loc);
+    return multibyte;
+}
+
+// wc [-clmw] [file ...]
+bool wc_parse(Command *cmd, UtilArgs *args)
+{
+    if (!util_args(cmd, 1, "clmw", "", args) || (args->opts['m'] != NULL && multibyte_locale()))
+    {
+        return false;
+    }
+    bool *show = args->show;
+    show[0] = args->opts['l'] != NULL;
+    show[1] = args->opts['w'] != NULL;
+    show[2] = args->opts['m'] != NULL;
+    show[3] = args->opts['c'] != NULL;
+    if (!show[0] && !show[1] && !show[2] && !show[3])
+    {
+        show[0] = show[1] = show[3] = true;
+    }
+    return true;
+}
+
+int wc_run(UtilArgs *args, Filter *out)
+{
+    char **files = args->files;
+    bool *show = args->show;
+    int nfiles = args->nfiles;
+    if (nfiles == 0)
+    {
+        files[nfiles++] = NULL; // stdin, printed without a name
+    }
+    int width = wc_width(files, nfiles, show[0] + show[1] + show[2] + show[3]);
+    char *buf = util_buffer(UTIL_BLOCK);
+    WcCounts total = {0};
+    int status = EXIT_SUCCESS;
+    for (int i = 0; i < nfiles; i++)
+    {
+        WcCounts wc = {0};
+        bool use_stdin = files[i] == NULL || !strcmp(files[i], "-");
+        int fd = use_stdin ? STDIN_FILENO : open(files[i], O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        int err = fd == -1 ? errno : 0;
+        if (fd != -1)
+        {
+            err = wc_fd(fd, fstat(fd, &st) == 0 ? &st : NULL, &wc, show[0], show[1], buf);
+        }
+        if (err != 0)
+        {
+            fprintf(stderr, "wc: %s: %s\n", files[i] != NULL ? files[i] : "standard input", strerror(err));
+            status = EXIT_FAILURE;
+        }
+        if (fd != -1)
+        {
+            wc_print(show, &wc, width, files[i], out);
+        }
+        if (fd > STDIN_FILENO)
+        {
+            close(fd);
+        }
+        total.lines += wc.lines;
+        total.words += wc.words;
+        total.bytes += wc.bytes;
+    }
+    if (nfiles > 1)
+    {
+        wc_print(show, &total, width, "total", out);
+    }
+    return status;
+}
+
+bool wc_input(Filter *f, const char *buf, size_t len)
+{
+    wc_block(&f->wc, (const unsigned char *)buf, len, f->args.show[0], f->args.show[1]);
+    return true;
+}
+
+// Prints what wc reading a pipe would
+int wc_finish(Filter *f)
+{
+    bool *show = f->args.show;
+    int width = f->args.nfiles <= 1 && show[0] + show[1] + show[2] + show[3] == 1 ? 1 : 7;
+    wc_print(show, &f->wc, width, f->args.nfiles == 1 ? f->args.files[0] : NULL, f->next);
+    return EXIT_SUCCESS;
+}
+
+// Options shared by head and tail, with the obsolete -N for -n N
+bool head_tail_parse(Command *cmd, UtilArgs *args, char sign)
+{
+    int start = 1;
+    char *obsolete = NULL;
+    if (cmd->argc > 1 && cmd->argv[1][0] == '-' && isdigit(cmd->argv[1][1]))
+    {
+        obsolete = cmd->argv[start++] + 1;
+    }
+    if (!util_args(cmd, start, "qv", "nc", args))
+    {
+        return false;
+    }
+    if (obsolete != NULL && args->opts['n'] == NULL)
+    {
+        args->opts['n'] = obsolete;
+    }
+    if (args->opts['n'] != NULL && args->opts['c'] != NULL)
+    {
+        return false;
+    }
+    args->count = 10;
+    args->bytes = args->opts['c'] != NULL;
+    args->headers = args->opts['v'] != NULL || (args->nfiles > 1 && args->opts['q'] == NULL);
+    char *value = args->bytes ? args->opts['c'] : args->opts['n'];
+    if (value == NULL)
+    {
+        return true;
+    }
+    if (sign == '+' && value[0] == '-')
+    {
+        value++; // tail -n -N is tail -n N
+    }
+    bool signed_value;
+    if (!util_count(value, sign, &args->count, &signed_value))
+    {
+        return false; // Suffixes
+    }
+    if (sign == '-' && signed_value)
+    {
+        return false; // head -n -N: all but the last N
+    }
+    args->from_start = signed_value;
+    return true;
+}
+
+// head [-n lines | -c bytes | -lines] [-qv] [file ...]
+bool head_parse(Command *cmd, UtilArgs *args)
+{
+    return head_tail_parse(cmd, args, '-');
+}
+
+// Takes what head passes on from the next block of input, f->left is what
+// is still to be passed on after it
+size_t head_take(Filter *f, const char *buf, size_t len)
+{
+    unsigned long long lines;
+    if (f->args.bytes)
+    {
+        len = f->left < len ? f->left : len;
+        f->left -= len;
+    }
+    else if ((lines = count_lines(buf, len)) < f->left)
+    {
+        f->left -= lines;
+    }
+    else
+    {
+        const char *p = buf;
+        for (; f->left > 0; f->left--)
+        {
+            p = (const char *)memchr(p, '\n', buf + len - p) + 1;
+        }
+        len = p - buf;
+    }
+    return len;
+}
+
+int head_run(UtilArgs *args, Filter *out)
+{
+    char **files = args->files;
+    int nfiles = args->nfiles;
+    if (nfiles == 0)
+    {
+        files[nfiles++] = "-";
+    }
+    bool first = true;
+    char *buf = util_buffer(UTIL_BLOCK);
+    int status = EXIT_SUCCESS;
+    for (int i = 0; i < nfiles; i++)
+    {
+        char *name = strcmp(files[i], "-") ? files[i] : "standard input";
+        int fd = util_open(files[i]);
+        if (fd == -1)
+        {
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (args->headers && !util_header(name, &first, out))
+        {
+            break;
+        }
+        Filter head = {.args = *args, .left = args->count};
+        ssize_t n = 1;
+        bool more = true;
+        while (head.left > 0 && more && (n = util_read(fd, buf, args->bytes && head.left < UTIL_BLOCK ? head.left : UTIL_BLOCK)) > 0)
+        {
+            size_t keep = head_take(&head, buf, n);
+            if (head.left == 0 && !args->bytes)
+            {
+                lseek(fd, (off_t)keep - n, SEEK_CUR); // Leave the rest to whoever reads next
+            }
+            more = util_output(out, buf, keep);
+        }
+        if (n == -1)
+        {
+            fprintf(stderr, "head: error reading '%s': %s\n", name, strerror(errno));
+            status = EXIT_FAILURE;
+        }
+        if (fd != STDIN_FILENO)
+        {
+            close(fd);
+        }
+        if (!more)
+        {
+            break;
+        }
+    }
+    return status;
+}
+
+bool head_input(Filter *f, const char *buf, size_t len)
+{
+    if (f->left == 0)
+    {
+        return false;
+    }
+    len = head_take(f, buf, len);
+    return util_output(f->next, buf, len) && f->left > 0;
+}
+
+// Offset in buf[0, len) of the last `lines` lines, an unterminated last
+// line counts as one. Returns -1 if there are fewer lines than that.
+ssize_t tail_lines_in(const char *buf, size_t len, unsigned long long *lines, bool at_end)
+{
+    if (at_end && len > 0 && buf[len - 1] == '\n')
+    {
+        len--;
+    }
+    while (len > 0)
+    {
+        const char *nl = memrchr(buf, '\n', len);
+        if (nl == NULL)
+        {
+            break;
+        }
+        if (--*lines == 0)
+        {
+            return nl - buf + 1;
+        }
+        len = nl - buf;
+    }
+    return -1;
+}
+
+// Start of the last `lines` lines of a regular file, found by reading blocks
+// backwards from the end
+off_t tail_seek_lines(int fd, off_t start, off_t size, unsigned long long lines, char *buf)
+{
+    off_t pos = size;
+    bool at_end = true;
+    while (pos > start)
+    {
+        size_t len = pos - start < UTIL_BLOCK ? pos - start : UTIL_BLOCK;
+        pos -= len;
+        ssize_t n;
+        while ((n = pread(fd, buf, len, pos)) == -1 && errno == EINTR)
+        {
+        }
+        if (n != (ssize_t)len)
+        {
+            return -1;
+        }
+        ssize_t found = tail_lines_in(buf, len, &lines, at_end);
+        if (found != -1)
+        {
+            return pos + found;
+        }
+        at_end = false;
+    }
+    return start;
+}
+
+// Where the last lines or bytes tail prints start in f->buf, -1 if that is
+// before the start of the buffer
+ssize_t tail_start(Filter *f, bool at_end)
+{
+    unsigned long long lines = f->args.count;
+    if (f->args.bytes)
+    {
+        return f->len > f->args.count ? (ssize_t)(f->len - f->args.count) : -1;
+    }
+    return tail_lines_in(f->buf, f->len, &lines, at_end);
+}
+
+// tail +N passes on everything after the first f->left lines or bytes.
+// Otherwise only the input that may still be printed is kept.
+bool tail_input(Filter *f, const char *buf, size_t len)
+{
+    if (f->args.from_start)
+    {
+        size_t skip = len;
+        if (f->args.bytes)
+        {
+            skip = f->left < len ? f->left : len;
+            f->left -= skip;
+        }
+        else
+        {
+            const char *p = buf;
+            while (f->left > 0 && (p = memchr(p, '\n', buf + len - p)) != NULL)
+            {
+                p++;
+                f->left--;
+            }
+            skip = f->left == 0 ? (size_t)(p - buf) : len;
+        }
+        return util_output(f->next, buf + skip, len - skip);
+    }
+    if (f->args.count == 0)
+    {
+        return false;
+    }
+    if (f->len + len > f->cap)
+    {
+        f->cap = f->cap * 2 > f->len + len ? f->cap * 2 : f->len + len + UTIL_BLOCK;
+        f->buf = realloc(f->buf, f->cap);
+        if (f->buf == NULL)
+        {
+            error_exit("realloc");
+        }
+    }
+    memcpy(f->buf + f->len, buf, len);
+    f->len += len;
+    if (f->len >= f->compact_at)
+    {
+        ssize_t start = tail_start(f, false);
+        if (start > 0)
+        {
+            memmove(f->buf, f->buf + start, f->len - start);
+            f->len -= start;
+        }
+        f->compact_at = 2 * f->len > f->len + UTIL_BLOCK ? 2 * f->len : f->len + UTIL_BLOCK;
+    }
+    return true;
+}
+
+int tail_finish(Filter *f)
+{
+    ssize_t start = tail_start(f, true);
+    if (start == -1)
+    {
+        start = 0;
+    }
+    util_output(f->next, f->buf + start, f->len - start);
+    free(f->buf);
+    f->buf = NULL;
+    f->len = 0;
+    return EXIT_SUCCESS;
+}
+
+// tail of a pipe or terminal
+int tail_stream(int fd, UtilArgs *args, char *buf, Filter *out)
+{
+    Filter tail = {.args = *args, .next = out, .compact_at = UTIL_BLOCK};
+    ssize_t n;
+    while ((n = util_read(fd, buf, UTIL_BLOCK)) > 0 && tail_input(&tail, buf, n))
+    {
+    }
+    int err = n == -1 ? errno : 0;
+    tail_finish(&tail);
+    return err;
+}
+
+// tail -n +N / -c +N: skips to line or byte N and copies the rest
+int tail_from(int fd, struct stat *st, UtilArgs *args, char *buf, Filter *out)
+{
+    Filter tail = {.args = *args, .next = out, .left = args->count > 0 ? args->count - 1 : 0};
+    if (args->bytes && S_ISREG(st->st_mode) && lseek(fd, tail.left, SEEK_CUR) != -1)
+    {
+        tail.left = 0;
+    }
+    ssize_t n = 1;
+    bool more = true;
+    while (tail.left > 0 && more && (n = util_read(fd, buf, UTIL_BLOCK)) > 0)
+    {
+        more = tail_input(&tail, buf, n);
+    }
+    if (n == -1)
+    {
+        return errno;
+    }
+    return more ? copy_fd(fd, buf, out) : 0;
+}
+
+// tail [-n [+]lines | -c [+]bytes | -lines] [-qv] [file ...]
+bool tail_parse(Command *cmd, UtilArgs *args)
+{
+    return head_tail_parse(cmd, args, '+');
+}
+
+int tail_run(UtilArgs *args, Filter *out)
+{
+    char **files = args->files;
+    int nfiles = args->nfiles;
+    if (nfiles == 0)
+    {
+        files[nfiles++] = "-";
+    }
+    unsigned long long count = args->count;
+    bool first = true;
+    char *buf = util_buffer(UTIL_BLOCK);
+    int status = EXIT_SUCCESS;
+    for (int i = 0; i < nfiles && (out == NULL || !out->done); i++)
+    {
+        char *name = strcmp(files[i], "-") ? files[i] : "standard input";
+        int fd = util_open(files[i]);
+        if (fd == -1)
+        {
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (args->headers && !util_header(name, &first, out))
+        {
+            break;
+        }
+        struct stat st;
+        off_t pos;
+        int err = fstat(fd, &st) == -1 ? errno : 0;
+        if (err == 0 && args->from_start)
+        {
+            err = tail_from(fd, &st, args, buf, out);
+        }
+        else if (count == 0)
+        {
+            err = 0; // Nothing to print, the input isn't read
+        }
+        else if (err == 0 && S_ISREG(st.st_mode) && (pos = lseek(fd, 0, SEEK_CUR)) != -1 && pos <= st.st_size)
+        {
+            off_t start = args->bytes ? (st.st_size - pos > (off_t)count ? st.st_size - (off_t)count : pos) : tail_seek_lines(fd, pos, st.st_size, count, buf);
+            err = start == -1 ? errno : lseek(fd, start, SEEK_SET) == -1 ? errno : copy_fd(fd, buf, out);
+        }
+        else if (err == 0)
+        {
+            err = tail_stream(fd, args, buf, out);
+        }
+        if (err != 0)
+        {
+            fprintf(stderr, "tail: error reading '%s': %s\n", name, strerror(err));
+            status = EXIT_FAILURE;
+        }
+        if (fd != STDIN_FILENO)
+        {
+            close(fd);
+        }
+    }
+    return status;
+}
+
+// cat [-u] [file ...]
+bool cat_parse(Command *cmd, UtilArgs *args)
+{
+    return util_args(cmd, 1, "u", "", args);
+}
+
+int cat_run(UtilArgs *args, Filter *out)
+{
+    char **files = args->files;
+    int nfiles = args->nfiles;
+    if (nfiles == 0)
+    {
+        files[nfiles++] = "-";
+    }
+    struct stat out_st;
+    bool out_regular = out == NULL && fstat(STDOUT_FILENO, &out_st) == 0 && S_ISREG(out_st.st_mode);
+    char *buf = util_buffer(UTIL_BLOCK);
+    int status = EXIT_SUCCESS;
+    for (int i = 0; i < nfiles && (out == NULL || !out->done); i++)
+    {
+        int fd = strcmp(files[i], "-") ? open(files[i], O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+        struct stat st;
+        int err = fd == -1 ? errno : 0;
+        if (fd != -1 && out_regular && fstat(fd, &st) == 0 && st.st_dev == out_st.st_dev && st.st_ino == out_st.st_ino &&
+            lseek(fd, 0, SEEK_CUR) < st.st_size)
+        {
+            fprintf(stderr, "cat: %s: input file is output file\n", files[i]);
+            status = EXIT_FAILURE;
+        }
+        else if (fd != -1)
+        {
+            err = copy_fd(fd, buf, out);
+        }
+        if (err != 0)
+        {
+            fprintf(stderr, "cat: %s: %s\n", files[i], strerror(err));
+            status = EXIT_FAILURE;
+        }
+        if (fd > STDIN_FILENO)
+        {
+            close(fd);
+        }
+    }
+    return status;
+}
+
+bool cat_input(Filter *f, const char *buf, size_t len)
+{
+    return util_output(f->next, buf, len);
+}
+
+int filter_finish(Filter *f)
+{
+    (void)f; // Filters that keep no state have nothing left to write
+    return EXIT_SUCCESS;
+}
+
+Util utils[] = {
+    {"cat", cat_parse, cat_run, cat_input, filter_finish},
+    {"head", head_parse, head_run, head_input, filter_finish},
+    {"tail", tail_parse, tail_run, tail_input, tail_finish},
+    {"wc", wc_parse, wc_run, wc_input, wc_finish},
+};
+
+// Only bare names are taken over, a path asks for that binary
+Util *find_util(const char *name)
+{
+    if (!use_builtin_utils)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(utils) / sizeof(Util); i++)
+    {
+        if (!strcmp(utils[i].name, name))
+        {
+            return &utils[i];
+        }
+    }
+    return NULL;
+}
+
+// The filter for a util stage fused after another one. NULL if the stage
+// doesn't just read its stdin, such as wc with file operands.
+Filter *make_filter(Command *cmd)
+{
+    Util *util = find_util(cmd->argv[0]);
+    if (util == NULL)
+    {
+        return NULL;
+    }
+    Filter *f = arena_alloc(&line_arena, sizeof(Filter));
+    memset(f, 0, sizeof(Filter));
+    if (!util->parse(cmd, &f->args) || f->args.headers || f->args.nfiles > 1 || (f->args.nfiles == 1 && strcmp(f->args.files[0], "-")))
+    {
+        return NULL;
+    }
+    f->name = cmd->argv[0];
+    f->input = util->input;
+    f->finish = util->finish;
+    f->left = f->args.from_start && f->args.count > 0 ? f->args.count - 1 : f->args.count;
+    f->compact_at = UTIL_BLOCK;
+    return f;
+}
+
+// Fuses the util stages that read stage i's output through a plain pipe
+// into stage i's process, if it runs a util too. Returns their filters in
+// pipeline order and sets *last to the last stage fused.
+Filter *fuse_stages(Command *stages, int count, int i, int *last)
+{
+    UtilArgs args;
+    Filter *first = NULL;
+    Filter **link = &first;
+    Util *util = find_util(stages[i].argv[0]);
+    *last = i;
+    if (util == NULL || !util->parse(&stages[i], &args))
+    {
+        return NULL;
+    }
+    for (int k = i; k < count - 1; k++)
+    {
+        Command *cmd = &stages[k];
+        Command *next = &stages[k + 1];
+        bool branch = k + 1 < count - 1 && next->out_count == 0; // Fed by a fan-out helper
+        if (cmd->out_count == 0 || branch || cmd->output_redirect || cmd->output_append || next->input_redirect ||
+            next->output_redirect || next->output_append)
+        {
+            break;
+        }
+        Filter *f = make_filter(next);
+        if (f == NULL)
+        {
+            break;
+        }
+        *link = f;
+        link = &f->next;
+        *last = k + 1;
+    }
+    return first;
+}
+
+// Runs a util, then ends the input of each stage fused after it in turn.
+// Returns the status of the last stage.
+int run_util(Util *util, Command *cmd, Filter *fused)
+{
+    UtilArgs args;
+    util_name = cmd->argv[0];
+    setlocale(LC_CTYPE, "");
+    if (!util->parse(cmd, &args))
+    {
+        return UTIL_EXTERNAL;
+    }
+    int status = util->run(&args, fused);
+    for (Filter *f = fused; f != NULL; f = f->next)
+    {
+        util_name = f->name;
+        status = f->finish(f);
+    }
+    return status;
+}
+
+// Fallback launcher: fork, wire the stage up in the child and exec. Also
+// runs the stages that have an in-process util, which exec only when the
+// util hands the arguments back, together with the stages fused after them.
+pid_t fork_stage(Command *cmd, char *path, Util *util, Filter *fused, int in_fd, int out_fd, Job *job)
+{
+    pid_t ret = fork();
+    if (ret == -1)
+    {
+        error_exit("fork");
+    }
+    if (ret != 0)
+    {
+        return ret;
+    }
+    enter_job(job);
+    if (in_fd != -1 && dup2(in_fd, STDIN_FILENO) == -1)
+    {
+        error_exit("dup2");
+    }
+    if (out_fd != -1 && dup2(out_fd, STDOUT_FILENO) == -1)
+    {
+        error_exit("dup2");
+    }
+    if (cmd->input_redirect == true && is_valid_filename(cmd->input_file))
+    {
+        redirect_fd(cmd->input_file, O_RDONLY, STDIN_FILENO);
+    }
+    if (cmd->output_redirect == true && is_valid_filename(cmd->output_file))
+    {
+        redirect_fd(cmd->output_file, O_TRUNC | O_WRONLY | O_CREAT, STDOUT_FILENO);
+    }
+    if (cmd->output_append == true && is_valid_filename(cmd->output_file))
+    {
+        redirect_fd(cmd->output_file, O_APPEND | O_WRONLY | O_CREAT, STDOUT_FILENO);
+    }
+    if (util != NULL)
+    {
+        // Without an exec every other inherited fd stays open, such as
+        // the write end of a fan-out pipe this stage reads
+        close_range(STDERR_FILENO + 1, ~0U, 0);
+        long long traced = trace_clock();
+        int status = run_util(util, cmd, fused);
+        if (status != UTIL_EXTERNAL)
+        {
+            trace_span("util", traced, -1, cmd->argv[0]);
+            _exit(status);
+        }
+    }
+    trace_event("exec", trace_clock(), -1, getpid(), -1, cmd->argv[0]);
+    if (path != NULL)
+    {
+        execv(path, cmd->argv);
+    }
+    if (execvp(cmd->argv[0], cmd->argv) == -1)
+    {
+        error_exit("execvp");
+    }
+    return -1;
+}
+
+// Default launcher: the pipe wiring and redirections become posix_spawn file
+// actions, so glibc can start the child with CLONE_VFORK without copying the
+// shell's page tables. All pipes are O_CLOEXEC, dup2 onto 0/1 clears the flag
+// for the two ends the stage keeps.
+pid_t spawn_stage(Command *cmd, char *path, int in_fd, int out_fd, Job *job)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigdefault, none;
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP;
+    if (posix_spawn_file_actions_init(&actions) != 0 || posix_spawnattr_init(&attr) != 0)
+    {
+        error_exit("posix_spawn_init");
+    }
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGQUIT);
+    sigaddset(&sigdefault, SIGTSTP);
+    sigaddset(&sigdefault, SIGTTIN);
+    sigaddset(&sigdefault, SIGTTOU);
+    sigemptyset(&none);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setpgroup(&attr, job->pgid);
+#ifdef POSIX_SPAWN_TCSETPGROUP
+    if (job->tty && job->pgid == 0)
+    {
+        // The child takes the terminal before it runs, so it can't be
+        // stopped by reading it before we hand it over
+        flags |= POSIX_SPAWN_TCSETPGROUP;
+        posix_spawnattr_tcsetpgrp_np(&attr, STDIN_FILENO);
+    }
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+    if (in_fd != -1)
+    {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1)
+    {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    if (cmd->input_redirect == true && is_valid_filename(cmd->input_file))
+    {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, cmd->input_file, O_RDONLY, 0);
+    }
+    if (cmd->output_redirect == true && is_valid_filename(cmd->output_file))
+    {
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, cmd->output_file, O_TRUNC | O_WRONLY | O_CREAT, 0777);
+    }
+    if (cmd->output_append == true && is_valid_filename(cmd->output_file))
+    {
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, cmd->output_file, O_APPEND | O_WRONLY | O_CREAT, 0777);
+    }
+    pid_t pid;
+    int err = ENOENT;
+    if (path != NULL)
+    {
+        err = posix_spawn(&pid, path, &actions, &attr, cmd->argv, environ);
+        if (err == ENOENT)
+        {
+            // Cached binary was removed, search $PATH again
+            forget_command(cmd->argv[0]);
+        }
+    }
+    if (err == ENOENT)
+    {
+        err = posix_spawnp(&pid, cmd->argv[0], &actions, &attr, cmd->argv, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0)
+    {
+        errno = err;
+        perror(cmd->argv[0]);
+        return -1;
+    }
+    return pid;
+}
+
+// Parses a kernel CPU list such as "0-3,8,10-11"
+bool parse_cpu_list(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    while (*list != '\0' && *list != '\n')
+    {
+        char *end;
+        if (!isdigit(*list))
+        {
+            return false;
+        }
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (*end == '-' && isdigit(end[1]))
+        {
+            last = strtol(end + 1, &end, 10);
+        }
+        if (last < first || last >= CPU_SETSIZE || (*end != ',' && *end != '\0' && *end != '\n'))
+        {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, set);
+        }
+        list = end + (*end == ',');
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+// Reads a small sysfs file, returns false if there is none
+bool read_sysfs(const char *path, char *buf, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = '\0';
+    return n > 0;
+}
+
+// The lowest CPU of a sysfs CPU list file, fallback if it can't be read
+int first_cpu_in(const char *path, int fallback)
+{
+    char buf[1024];
+    cpu_set_t set;
+    if (!read_sysfs(path, buf, sizeof(buf)) || !parse_cpu_list(buf, &set))
+    {
+        return fallback;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &set))
+        {
+            return cpu;
+        }
+    }
+    return fallback;
+}
+
+// Compact order: by package, then last level cache, then core
+int compare_cpus(const void *a, const void *b)
+{
+    const CpuInfo *x = a;
+    const CpuInfo *y = b;
+    if (x->package != y->package)
+    {
+        return x->package - y->package;
+    }
+    if (x->llc != y->llc)
+    {
+        return x->llc - y->llc;
+    }
+    return x->core != y->core ? x->core - y->core : x->cpu - y->cpu;
+}
+
+// Reads where each CPU the shell may run on sits, from
+// /sys/devices/system/cpu. Missing files leave a CPU in a domain of its own.
+void load_topology()
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+    topology = malloc(CPU_COUNT(&allowed) * sizeof(CpuInfo));
+    if (topology == NULL)
+    {
+        error_exit("malloc");
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed))
+        {
+            continue;
+        }
+        char path[128];
+        char buf[32];
+        CpuInfo *info = &topology[topology_count++];
+        info->cpu = cpu;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        info->core = first_cpu_in(path, cpu);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        info->package = read_sysfs(path, buf, sizeof(buf)) ? atoi(buf) : 0;
+        info->llc = info->core;
+        int best = 0;
+        for (int index = 0;; index++)
+        {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+            if (!read_sysfs(path, buf, sizeof(buf)))
+            {
+                break;
+            }
+            if (atoi(buf) > best)
+            {
+                best = atoi(buf);
+                snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+                info->llc = first_cpu_in(path, info->core);
+            }
+        }
+    }
+    qsort(topology, topology_count, sizeof(CpuInfo), compare_cpus);
+    for (int i = 0; i < topology_count; i++)
+    {
+        bool same = i > 0 && topology[i].llc == topology[i - 1].llc && topology[i].package == topology[i - 1].package;
+        topology[i].domain = same ? topology[i - 1].domain : topology_domains++;
+    }
+}
+
+// off, compact, spread, or a CPU list per stage separated by colons, such
+// as 0-1:2:3, which the stages of a longer pipeline cycle through
+bool set_placement(const char *value)
+{
+    if (!strcmp(value, "off") || !strcmp(value, "compact") || !strcmp(value, "spread"))
+    {
+        placement = value[0] == 'o' ? PLACE_OFF : value[0] == 'c' ? PLACE_COMPACT : PLACE_SPREAD;
+    }
+    else
+    {
+        int count = 1;
+        for (const char *p = value; *p != '\0'; p++)
+        {
+            count += *p == ':';
+        }
+        cpu_set_t *sets = malloc(count * sizeof(cpu_set_t));
+        char *copy = strdup(value);
+        if (sets == NULL || copy == NULL)
+        {
+            error_exit("malloc");
+        }
+        char *rest = copy;
+        for (int i = 0; i < count; i++)
+        {
+            if (!parse_cpu_list(strsep(&rest, ":"), &sets[i]))
+            {
+                free(copy);
+                free(sets);
+                return false;
+            }
+        }
+        free(copy);
+        free(placement_sets);
+        placement_sets = sets;
+        placement_set_count = count;
+        placement = PLACE_LIST;
+    }
+    snprintf(placement_text, sizeof(placement_text), "%s", value);
+    return true;
+}
+
+// Pins a process of stage i of a pipeline whose placement starts at slot
+// base. compact puts consecutive stages on consecutive CPUs in topology
+// order, so a producer and its consumer share a core or at least a last
+// level cache; spread gives each stage a whole cache domain of its own,
+// a different one from its neighbours'.
+void place_proc(pid_t pid, int i, int base)
+{
+    cpu_set_t set;
+    if (placement == PLACE_OFF || pid == -1)
+    {
+        return;
+    }
+    if (topology == NULL)
+    {
+        load_topology();
+    }
+    CPU_ZERO(&set);
+    if (placement == PLACE_LIST)
+    {
+        set = placement_sets[i % placement_set_count];
+    }
+    else if (placement == PLACE_COMPACT)
+    {
+        CPU_SET(topology[(base + i) % topology_count].cpu, &set);
+    }
+    else
+    {
+        int domain = (base + i) % topology_domains;
+        for (int j = 0; j < topology_count; j++)
+        {
+            if (topology[j].domain == domain)
+            {
+                CPU_SET(topology[j].cpu, &set);
+            }
+        }
+    }
+    if (sched_setaffinity(pid, sizeof(set), &set) == -1 && errno != ESRCH)
+    {
+        perror("sched_setaffinity");
+    }
+}
+
+bool set_option(char *assignment)
+{
+    char *value = strchr(assignment, '=');
+    if (value == NULL)
+    {
+        return false;
+    }
+    *value++ = '\0';
+    if (!strcmp(assignment, "spawn") && (!strcmp(value, "posix") || !strcmp(value, "fork")))
+    {
+        use_posix_spawn = !strcmp(value, "posix");
+        return true;
+    }
+    if (!strcmp(assignment, "utils") && (!strcmp(value, "builtin") || !strcmp(value, "external")))
+    {
+        use_builtin_utils = !strcmp(value, "builtin");
+        return true;
+    }
+    if (!strcmp(assignment, "fuse") && (!strcmp(value, "on") || !strcmp(value, "off")))
+    {
+        use_fusion = !strcmp(value, "on");
+        return true;
+    }
+    if (!strcmp(assignment, "trace"))
+    {
+        return set_trace(value);
+    }
+    if (!strcmp(assignment, "branches"))
+    {
+        const char *modes[] = {"ordered", "stream", "direct"};
+        for (int i = 0; i < 3; i++)
+        {
+            if (!strcmp(value, modes[i]))
+            {
+                branch_output = (enum BranchOutput)i;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (!strcmp(assignment, "placement"))
+    {
+        return set_placement(value);
+    }
+    if (!strcmp(assignment, "cachesize") && isdigit(value[0]))
+    {
+        char *end;
+        unsigned long long size = strtoull(value, &end, 10);
+        int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+        if (end[shift != 0] != '\0')
+        {
+            return false;
+        }
+        cache_limit = size << shift;
+        return true;
+    }
+    if (!strcmp(assignment, "histsize") && isdigit(value[0]))
+    {
+        resize_history(strtoul(value, NULL, 10));
+        return true;
+    }
+    return false;
+}
+
+// set -o name=value changes an option, set -o lists them
+void set_builtin(Command *cmd)
+{
+    if (cmd->argc < 2 || strcmp(cmd->argv[1], "-o") != 0)
+    {
+        fprintf(stderr, "usage: set -o [name=value]\n");
+        return;
+    }
+    if (cmd->argc == 2)
+    {
+        printf("spawn=%s\n", use_posix_spawn ? "posix" : "fork");
+        printf("utils=%s\n", use_builtin_utils ? "builtin" : "external");
+        printf("fuse=%s\n", use_fusion ? "on" : "off");
+        printf("branches=%s\n", branch_output == BRANCH_ORDERED ? "ordered" : branch_output == BRANCH_STREAM ? "stream" : "direct");
+        printf("placement=%s\n", placement_text);
+        printf("trace=%s\n", trace_ring != NULL ? trace_file : "off");
+        printf("cachesize=%llu\n", cache_limit);
+        printf("histsize=%u\n", history.cap);
+        return;
+    }
+    for (int i = 2; i < cmd->argc; i++)
+    {
+        if (!set_option(cmd->argv[i]))
+        {
+            fprintf(stderr, "set: invalid option %s\n", cmd->argv[i]);
+        }
+    }
+}
+
+long long now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Adds a started process to the supervisor. Its pidfd becomes readable
+// when it exits, which is when it is reaped.
+void watch_proc(ProcStat *ps)
+{
+    ps->pidfd = pidfd_open(ps->pid, 0);
+    if (ps->pidfd == -1)
+    {
+        return;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = ps};
+    if (epoll_ctl(supervisor_fd, EPOLL_CTL_ADD, ps->pidfd, &ev) == -1)
+    {
+        close(ps->pidfd);
+        ps->pidfd = -1;
+        return;
+    }
+    watched_fds++;
+}
+
+// Raises the soft RLIMIT_NOFILE, up to the hard one, when it is too low for
+// a pidfd for each of procs more processes. Children inherit the raised
+// limit. A process that still gets no pidfd is reaped on SIGCHLD instead.
+void raise_fd_limit(int procs)
+{
+    rlim_t needed = (rlim_t)watched_fds + procs + FD_RESERVE;
+    struct rlimit rl;
+    if (needed <= fd_limit || getrlimit(RLIMIT_NOFILE, &rl) == -1)
+    {
+        return;
+    }
+    if (rl.rlim_cur < needed && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max != RLIM_INFINITY && rl.rlim_max < 2 * needed ? rl.rlim_max : 2 * needed;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1 && getrlimit(RLIMIT_NOFILE, &rl) == -1)
+        {
+            return;
+        }
+    }
+    fd_limit = rl.rlim_cur;
+}
+
+void record_proc(ProcStat *ps, pid_t pid, int stage, enum ProcKind kind, char *name)
+{
+    ps->pid = pid;
+    ps->stage = stage;
+    ps->kind = kind;
+    ps->name = name;
+    clock_gettime(CLOCK_MONOTONIC, &ps->start);
+    ps->end = ps->start;
+    ps->pidfd = -1;
+    ps->reaped = false;
+}
+
+bool pipe_has_relay(ProcStat *stats, int nstats, int stage)
+{
+    for (int i = 0; i < nstats; i++)
+    {
+        if (stats[i].kind == PROC_RELAY && stats[i].stage == stage)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+double elapsed_ms(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+double timeval_ms(struct timeval *tv)
+{
+    return tv->tv_sec * 1e3 + tv->tv_usec / 1e3;
+}
+
+// Per-process table on stderr, relays only carry the byte counts
+void print_stats(ProcStat *stats, int nstats, struct timespec *pipeline_start, bool json)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (json)
+    {
+        fprintf(stderr, "{\"wall_ms\": %.3f, \"stages\": [", elapsed_ms(pipeline_start, &now));
+    }
+    else
+    {
+        fprintf(stderr, "%-5s %-8s %-16s %6s %10s %10s %10s %10s %8s %8s %12s\n", "stage", "pid", "command", "status",
+                "wall_ms", "user_ms", "sys_ms", "maxrss_kb", "vcsw", "ivcsw", "bytes_out");
+    }
+    bool first = true;
+    for (int i = 0; i < nstats; i++)
+    {
+        ProcStat *ps = &stats[i];
+        if (ps->kind == PROC_RELAY || ps->pid == -1)
+        {
+            continue;
+        }
+        int status = WIFEXITED(ps->status) ? WEXITSTATUS(ps->status) : 128 + WTERMSIG(ps->status);
+        if (json)
+        {
+            fprintf(stderr, "%s\n  {\"stage\": %d, \"pid\": %d, \"command\": ", first ? "" : ",", ps->stage, ps->pid);
+            print_json_string(stderr, ps->name);
+            fprintf(stderr, ", \"status\": %d, \"wall_ms\": %.3f, \"user_ms\": %.3f, \"sys_ms\": %.3f, \"maxrss_kb\": %ld, "
+                            "\"vcsw\": %ld, \"ivcsw\": %ld, \"bytes_out\": ",
+                    status, elapsed_ms(&ps->start, &ps->end),
+                    timeval_ms(&ps->usage.ru_utime), timeval_ms(&ps->usage.ru_stime), ps->usage.ru_maxrss,
+                    ps->usage.ru_nvcsw, ps->usage.ru_nivcsw);
+            if (ps->bytes == -1ULL)
+            {
+                fprintf(stderr, "null}");
+            }
+            else
+            {
+                fprintf(stderr, "%llu}", ps->bytes);
+            }
+        }
+        else
+        {
+            char bytes_out[32] = "-";
+            if (ps->bytes != -1ULL)
+            {
+                snprintf(bytes_out, sizeof(bytes_out), "%llu", ps->bytes);
+            }
+            fprintf(stderr, "%-5d %-8d %-16.16s %6d %10.3f %10.3f %10.3f %10ld %8ld %8ld %12s\n", ps->stage, ps->pid, ps->name,
+                    status, elapsed_ms(&ps->start, &ps->end), timeval_ms(&ps->usage.ru_utime),
+                    timeval_ms(&ps->usage.ru_stime), ps->usage.ru_maxrss, ps->usage.ru_nvcsw, ps->usage.ru_nivcsw,
+                    bytes_out);
+        }
+        first = false;
+    }
+    if (json)
+    {
+        fprintf(stderr, "\n]}\n");
+    }
+    else
+    {
+        fprintf(stderr, "real %.3f ms\n", elapsed_ms(pipeline_start, &now));
+    }
+}
+
+// Allocates a job with room for the accounting of every process it may
+// start and copies of the texts it refers to, plans can be freed before
+// a background job ends
+Job *create_job(Plan *plan, Command *stages, bool background)
+{
+    size_t names = strlen(plan->text) + 1;
+    for (int i = 0; i < plan->cnt; i++)
+    {
+        names += strlen(stages[i].argv[0]) + 1;
+    }
+    Job *job = malloc(sizeof(Job) + 3 * plan->cnt * sizeof(ProcStat) + names);
+    if (job == NULL)
+    {
+        error_exit("malloc");
+    }
+    job->stats = (ProcStat *)(job + 1);
+    job->text = (char *)(job->stats + 3 * plan->cnt);
+    strcpy(job->text, plan->text);
+    job->names = job->text + strlen(job->text) + 1;
+    job->id = jobs != NULL ? jobs->id + 1 : 1;
+    job->pgid = 0;
+    job->last_pid = -1;
+    job->exit_status = 127; // Last command could not be started
+    job->live = 0;
+    job->stopped = false;
+    job->tty = interactive && !background;
+    job->count = plan->cnt;
+    job->timing = timing;
+    job->bytes = NULL;
+    job->deadline_ms = timeout_ms > 0 ? now_ms() + timeout_ms : 0;
+    job->kill_after_ms = kill_after_ms;
+    job->timed_out = false;
+    job->nstats = 0;
+    job->next = jobs;
+    jobs = job;
+    timing = TIME_OFF;
+    return job;
+}
+
+// Records a started process. The first one starts the process group,
+// setpgid is done here as well as in the child so neither can race ahead.
+void add_proc(Job *job, pid_t pid, int stage, enum ProcKind kind, char *name)
+{
+    if (pid == -1)
+    {
+        return;
+    }
+    if (job->pgid == 0)
+    {
+        job->pgid = pid;
+        if (job->tty)
+        {
+            tcsetpgrp(STDIN_FILENO, pid);
+        }
+    }
+    setpgid(pid, job->pgid);
+    if (kind == PROC_STAGE)
+    {
+        name = strcpy(job->names, name);
+        job->names += strlen(name) + 1;
+    }
+    record_proc(&job->stats[job->nstats], pid, stage, kind, name);
+    watch_proc(&job->stats[job->nstats++]);
+    job->live++;
+}
+
+Job *find_job_pid(pid_t pid, ProcStat **ps)
+{
+    for (Job *job = jobs; job != NULL; job = job->next)
+    {
+        for (int i = 0; i < job->nstats; i++)
+        {
+            if (job->stats[i].pid == pid)
+            {
+                *ps = &job->stats[i];
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Records how a reaped process ended. This is the per-stage completion
+// event: the status line, and the job's status once its last stage is done.
+void proc_ended(Job *job, ProcStat *ps, int status, struct rusage *usage)
+{
+    if (interactive && fg_pgid == job->pgid)
+    {
+        printf("-------- PID: %d status: %d --------\n", ps->pid, status);
+    }
+    if (ps->pid == job->last_pid)
+    {
+        job->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        if (job->timed_out && !(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL))
+        {
+            job->exit_status = TIMEOUT_STATUS;
+        }
+    }
+    if (ps->pidfd != -1)
+    {
+        // A forked helper may still hold a copy of the pidfd, which would keep
+        // it in the epoll set after close, readable and pointing at ps
+        epoll_ctl(supervisor_fd, EPOLL_CTL_DEL, ps->pidfd, NULL);
+        close(ps->pidfd);
+        ps->pidfd = -1;
+        watched_fds--;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ps->end);
+    if (trace_ring != NULL)
+    {
+        // The whole life of the process, on its own track
+        char detail[32];
+        snprintf(detail, sizeof(detail), WIFEXITED(status) ? "exit %d" : "signal %d", WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+        trace_event(ps->name, timespec_ns(&ps->start), timespec_ns(&ps->end), ps->pid, ps->stage, detail);
+    }
+    ps->usage = *usage;
+    ps->status = status;
+    ps->reaped = true;
+    job->live--;
+}
+
+// Reaps one process if it has exited, returns 1 if it had
+int reap_proc(Job *job, ProcStat *ps)
+{
+    int status;
+    struct rusage usage;
+    if (ps->reaped || wait4(ps->pid, &status, WNOHANG, &usage) <= 0)
+    {
+        return 0;
+    }
+    proc_ended(job, ps, status, &usage);
+    return 1;
+}
+
+// Job control state changes, which pidfds don't report, and exits of the
+// processes that have no pidfd. Returns how many there were.
+int reap_unwatched()
+{
+    int changes = 0;
+    siginfo_t info;
+    while (1)
+    {
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WSTOPPED | WCONTINUED | WNOHANG) == -1 || info.si_pid == 0)
+        {
+            break;
+        }
+        ProcStat *ps;
+        Job *job = find_job_pid(info.si_pid, &ps);
+        if (job != NULL)
+        {
+            job->stopped = info.si_code == CLD_STOPPED;
+        }
+        changes++;
+    }
+    for (Job *job = jobs; job != NULL; job = job->next)
+    {
+        for (int i = 0; i < job->nstats; i++)
+        {
+            if (job->stats[i].pidfd == -1)
+            {
+                changes += reap_proc(job, &job->stats[i]);
+            }
+        }
+    }
+    return changes;
+}
+
+// Sends SIGTERM to each job past its timeout, and SIGKILL to those still
+// running kill_after_ms later
+int expire_jobs()
+{
+    int expired = 0;
+    long long now = now_ms();
+    for (Job *job = jobs; job != NULL; job = job->next)
+    {
+        if (job->deadline_ms == 0 || job->deadline_ms > now || job->live == 0)
+        {
+            continue;
+        }
+        int sig = job->timed_out ? SIGKILL : SIGTERM;
+        killpg(job->pgid, sig);
+        killpg(job->pgid, SIGCONT);
+        job->deadline_ms = !job->timed_out && job->kill_after_ms > 0 ? now + job->kill_after_ms : 0;
+        job->timed_out = true;
+        expired++;
+    }
+    return expired;
+}
+
+// Shortens a wait in ms to end at the earliest job timeout
+int until_deadline(int wait_ms)
+{
+    long long now = now_ms();
+    for (Job *job = jobs; job != NULL; job = job->next)
+    {
+        if (job->deadline_ms != 0 && job->live > 0)
+        {
+            long long left = job->deadline_ms > now ? job->deadline_ms - now : 0;
+            if (wait_ms == -1 || left < wait_ms)
+            {
+                wait_ms = left;
+            }
+        }
+    }
+    return wait_ms;
+}
+
+// SIGINT is passed on to the foreground job; SIGCHLD only wakes the loop
+int read_signals()
+{
+    struct signalfd_siginfo info;
+    int count = 0;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+    {
+        if (info.ssi_signo == SIGINT)
+        {
+            // The terminal sends Ctrl-C straight to a foreground job it was
+            // handed, this covers batch mode or a kill aimed at the shell
+            if (fg_pgid > 0)
+            {
+                killpg(fg_pgid, SIGINT);
+            }
+            interrupted = true;
+        }
+        count++;
+    }
+    return count;
+}
+
+// The shell's event loop. Waits up to wait_ms (-1 for ever) for a child to
+// exit or stop, a signal, a job timeout or input at the prompt, then
+// handles everything that is ready. Returns how many events there were.
+int supervise(int wait_ms)
+{
+    struct epoll_event events[SUPERVISE_EVENTS];
+    int handled = reap_unwatched();
+    int n = epoll_wait(supervisor_fd, events, SUPERVISE_EVENTS, handled > 0 ? 0 : until_deadline(wait_ms));
+    for (int i = 0; i < n; i++)
+    {
+        void *ptr = events[i].data.ptr;
+        if (ptr == &signal_fd)
+        {
+            handled += read_signals();
+        }
+        else if (ptr == &input_ready)
+        {
+            input_ready = true;
+            handled++;
+        }
+        else
+        {
+            ProcStat *ps = ptr;
+            Job *job = find_job_pid(ps->pid, &ps);
+            handled += job != NULL ? reap_proc(job, ps) : 0;
+        }
+    }
+    return handled + expire_jobs();
+}
+
+// The supervisor's epoll set starts with the signalfd. SIGCHLD and SIGINT
+// stay blocked in the shell, children unblock them.
+void init_supervisor()
+{
+    sigemptyset(&supervised_signals);
+    sigaddset(&supervised_signals, SIGCHLD);
+    sigaddset(&supervised_signals, SIGINT);
+    sigprocmask(SIG_BLOCK, &supervised_signals, NULL);
+    supervisor_fd = epoll_create1(EPOLL_CLOEXEC);
+    signal_fd = signalfd(-1, &supervised_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (supervisor_fd == -1 || signal_fd == -1)
+    {
+        error_exit("supervisor");
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &signal_fd};
+    if (epoll_ctl(supervisor_fd, EPOLL_CTL_ADD, signal_fd, &ev) == -1)
+    {
+        error_exit("epoll_ctl");
+    }
+}
+
+// Unlinks a job whose processes are all reaped and prints its accounting
+void finish_job(Job *job)
+{
+    Job **link = &jobs;
+    while (*link != job)
+    {
+        link = &(*link)->next;
+    }
+    *link = job->next;
+    if (trace_ring != NULL)
+    {
+        trace_event("job", timespec_ns(&job->start), trace_clock(), getpid(), -1, job->text);
+    }
+    if (job->timing != TIME_OFF)
+    {
+        ProcStat *stats = job->stats;
+        int count = job->count;
+        for (int i = 0; i < job->nstats; i++)
+        {
+            stats[i].bytes = stats[i].kind == PROC_FANOUT ? job->bytes[count + stats[i].stage] : job->bytes[stats[i].stage];
+            if (stats[i].kind == PROC_COLLECT ||
+                (stats[i].kind == PROC_STAGE && (stats[i].stage == count - 1 || pipe_has_relay(stats, job->nstats, stats[i].stage) == false)))
+            {
+                stats[i].bytes = -1ULL; // Not writing to a pipe
+            }
+        }
+        print_stats(stats, job->nstats, &job->start, job->timing == TIME_JSON);
+        munmap(job->bytes, 2 * count * sizeof(unsigned long long));
+    }
+    free(job);
+}
+
+// Blocks until the job has ended or been stopped and returns its status.
+// A foreground job gets the terminal and Ctrl-C for that time.
+int wait_job(Job *job, bool foreground)
+{
+    if (foreground)
+    {
+        fg_pgid = job->pgid;
+        if (job->tty)
+        {
+            tcsetpgrp(STDIN_FILENO, job->pgid);
+        }
+    }
+    while (job->live > 0 && !job->stopped && (foreground || !interrupted))
+    {
+        supervise(-1);
+    }
+    if (foreground)
+    {
+        fg_pgid = 0;
+        if (job->tty)
+        {
+            tcsetpgrp(STDIN_FILENO, shell_pgid);
+        }
+    }
+    int status = job->exit_status;
+    if (job->live == 0)
+    {
+        finish_job(job);
+    }
+    else if (job->stopped)
+    {
+        printf("\n[%d]  Stopped\t%s\n", job->id, job->text);
+        status = 128 + SIGTSTP;
+    }
+    else
+    {
+        status = 128 + SIGINT; // wait was interrupted
+    }
+    return status;
+}
+
+// Reports and drops background jobs that have ended, run before a prompt
+void notify_jobs()
+{
+    supervise(0);
+    Job *job = jobs;
+    while (job != NULL)
+    {
+        Job *next = job->next;
+        if (job->live == 0)
+        {
+            if (interactive)
+            {
+                printf("[%d]  Done\t%s\n", job->id, job->text);
+            }
+            finish_job(job);
+        }
+        job = next;
+    }
+}
+
+// %N or N names job N, no argument the newest job
+Job *job_arg(Command *cmd)
+{
+    if (cmd->argc < 2)
+    {
+        return jobs;
+    }
+    int id = atoi(cmd->argv[1][0] == '%' ? cmd->argv[1] + 1 : cmd->argv[1]);
+    for (Job *job = jobs; job != NULL; job = job->next)
+    {
+        if (job->id == id)
+        {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+int jobs_builtin()
+{
+    supervise(0);
+    for (Job *job = jobs; job != NULL; job = job->next)
+    {
+        printf("[%d]  %s\t%s\n", job->id, job->live == 0 ? "Done" : job->stopped ? "Stopped" : "Running", job->text);
+    }
+    return EXIT_SUCCESS;
+}
+
+// fg [N] continues a job in the foreground, bg [N] in the background
+int fg_bg_builtin(Command *cmd, bool foreground)
+{
+    Job *job = job_arg(cmd);
+    if (job == NULL)
+    {
+        fprintf(stderr, "%s: no such job\n", cmd->argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (foreground)
+    {
+        printf("%s\n", job->text);
+    }
+    else
+    {
+        printf("[%d]  %s &\n", job->id, job->text);
+    }
+    job->tty = interactive && foreground;
+    if (job->tty)
+    {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    if (job->stopped && killpg(job->pgid, SIGCONT) == -1)
+    {
+        perror("killpg");
+    }
+    job->stopped = false;
+    return foreground ? wait_job(job, true) : EXIT_SUCCESS;
+}
+
+// wait N waits for job N, wait for every background job
+int wait_builtin(Command *cmd)
+{
+    if (cmd->argc > 1)
+    {
+        Job *job = job_arg(cmd);
+        if (job == NULL)
+        {
+            fprintf(stderr, "wait: no such job\n");
+            return 127;
+        }
+        return wait_job(job, false);
+    }
+    int status = EXIT_SUCCESS;
+    while (jobs != NULL && !interrupted)
+    {
+        Job *job = jobs;
+        while (job->next != NULL)
+        {
+            job = job->next; // Oldest first
+        }
+        status = wait_job(job, false);
+        if (job->stopped)
+        {
+            break;
+        }
+    }
+    return status;
+}
+
+void flush_plan_cache()
+{
+    for (size_t i = 0; i < plan_table.size; i++)
+    {
+        free(plan_table.slots[i].value);
+    }
+    table_clear(&plan_table);
+}
+
+// plans shows cache counters, plans -r empties the cache
+void plans_builtin(Command *cmd)
+{
+    if (cmd->argc == 2 && !strcmp(cmd->argv[1], "-r"))
+    {
+        flush_plan_cache();
+        plan_hits = 0;
+        plan_misses = 0;
+        return;
+    }
+    int alias_plans = 0;
+    for (size_t i = 0; i < alias_table.size; i++)
+    {
+        Alias *alias = alias_table.slots[i].value;
+        alias_plans += alias != NULL && alias->plan != NULL;
+    }
+    printf("hits\t%lu\nmisses\t%lu\ncached\t%zu\naliases\t%d\n", plan_hits, plan_misses, plan_table.live, alias_plans);
+}
+
+void word_push(WordList *list, char *word)
+{
+    if (list->count == list->cap)
+    {
+        int cap = list->cap == 0 ? DEFAULT_MALLOC_SIZE : 2 * list->cap;
+        list->words = arena_realloc(&line_arena, list->words, list->cap * sizeof(char *), cap * sizeof(char *));
+        list->cap = cap;
+    }
+    list->words[list->count++] = word;
+}
+
+// Sets the bytes of the [...] class starting at s[i] and returns the index of
+// its closing ], or 0 if it is not closed
+size_t glob_class(const char *s, size_t n, size_t i, unsigned long long class[4])
+{
+    static const struct
+    {
+        const char *name;
+        int (*test)(int);
+    } names[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"digit", isdigit}, {"lower", islower},
+        {"print", isprint}, {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+    };
+    memset(class, 0, 4 * sizeof(unsigned long long));
+    size_t j = i + 1;
+    bool negate = j < n && (s[j] == '!' || s[j] == '^');
+    j += negate;
+    size_t first = j; // A ] here is a member
+    for (; j < n && (s[j] != ']' || j == first); j++)
+    {
+        j += s[j] == '\\' && j + 1 < n; // A quoted member
+        unsigned int lo = (unsigned char)s[j];
+        unsigned int hi = lo;
+        const char *end = s[j] == '[' && j + 1 < n && s[j + 1] == ':' ? memmem(s + j + 2, n - j - 2, ":]", 2) : NULL;
+        if (end != NULL)
+        {
+            size_t len = end - (s + j + 2);
+            for (size_t k = 0; k < sizeof(names) / sizeof(names[0]); k++)
+            {
+                if (strlen(names[k].name) == len && !memcmp(names[k].name, s + j + 2, len))
+                {
+                    for (unsigned int c = 0; c < 256; c++)
+                    {
+                        class[c >> 6] |= (unsigned long long)(names[k].test(c) != 0) << (c & 63);
+                    }
+                }
+            }
+            j = end + 1 - s;
+            continue;
+        }
+        if (j + 2 < n && s[j + 1] == '-' && s[j + 2] != ']')
+        {
+            j += 2 + (s[j + 2] == '\\' && j + 3 < n);
+            hi = (unsigned char)s[j];
+        }
+        for (unsigned int c = lo; c <= hi; c++)
+        {
+            class[c >> 6] |= 1ULL << (c & 63);
+        }
+    }
+    if (j >= n)
+    {
+        return 0;
+    }
+    for (int k = 0; negate && k < 4; k++)
+    {
+        class[k] = ~class[k];
+    }
+    return j;
+}
+
+// Copies n bytes of a pattern to dst without the backslashes the lexer put
+// before quoted bytes, and NUL-terminates it. Returns the length copied.
+size_t glob_unescape(char *dst, const char *s, size_t n)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        i += s[i] == '\\' && i + 1 < n;
+        dst[len++] = s[i];
+    }
+    dst[len] = '\0';
+    return len;
+}
+
+// Compiles one path component. Returns false if it has no wildcard, an
+// unclosed [ being an ordinary byte. Bytes after a backslash are literal.
+bool glob_compile(const char *s, size_t n, GlobPattern *pat)
+{
+    pat->tokens = arena_alloc(&line_arena, n * sizeof(GlobToken));
+    pat->count = 0;
+    pat->dot = n > 0 && s[0] == '.';
+    bool wild = false;
+    for (size_t i = 0; i < n; i++)
+    {
+        GlobToken *t = &pat->tokens[pat->count++];
+        t->op = GLOB_CHAR;
+        if (s[i] == '\\' && i + 1 < n)
+        {
+            t->c = s[++i]; // Quoted in the word
+            continue;
+        }
+        t->c = s[i];
+        if (s[i] == '*')
+        {
+            t->op = GLOB_STAR;
+            while (i + 1 < n && s[i + 1] == '*')
+            {
+                i++;
+            }
+        }
+        else if (s[i] == '?')
+        {
+            t->op = GLOB_ANY;
+        }
+        else if (s[i] == '[')
+        {
+            size_t end = glob_class(s, n, i, t->class);
+            if (end != 0)
+            {
+                t->op = GLOB_CLASS;
+                i = end;
+            }
+        }
+        wild |= t->op != GLOB_CHAR;
+    }
+    pat->head_len = 0;
+    while (pat->head_len < (size_t)pat->count && pat->tokens[pat->head_len].op == GLOB_CHAR)
+    {
+        pat->head_len++;
+    }
+    int tail = pat->count;
+    while (tail > 0 && pat->tokens[tail - 1].op == GLOB_CHAR)
+    {
+        tail--;
+    }
+    pat->tail_len = pat->count - tail;
+    pat->tail = arena_alloc(&line_arena, pat->tail_len + 1);
+    for (size_t i = 0; i < pat->tail_len; i++)
+    {
+        pat->tail[i] = pat->tokens[tail + i].c;
+    }
+    return wild;
+}
+
+// Backtracks only to the last * seen: a later * can always take up what an
+// earlier one would have, so matching is linear in most cases
+bool glob_match(GlobPattern *pat, const char *name, size_t len)
+{
+    if ((name[0] == '.' && !pat->dot) || len < pat->tail_len ||
+        memcmp(name + len - pat->tail_len, pat->tail, pat->tail_len) != 0)
+    {
+        return false;
+    }
+    int t = 0;
+    int star = -1;
+    size_t i = 0;
+    size_t mark = 0;
+    while (i < len)
+    {
+        GlobToken *token = t < pat->count ? &pat->tokens[t] : NULL;
+        unsigned char c = name[i];
+        if (token != NULL && token->op == GLOB_STAR)
+        {
+            star = t++;
+            mark = i;
+        }
+        else if (token != NULL && (token->op == GLOB_ANY || (token->op == GLOB_CHAR && token->c == c) ||
+                                   (token->op == GLOB_CLASS && (token->class[c >> 6] >> (c & 63) & 1))))
+        {
+            t++;
+            i++;
+        }
+        else if (star != -1)
+        {
+            t = star + 1;
+            i = ++mark;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (t < pat->count && pat->tokens[t].op == GLOB_STAR)
+    {
+        t++;
+    }
+    return t == pat->count;
+}
+
+// Indexes a reused listing by name, so that a pattern with a literal start
+// only looks at the names starting with it
+void glob_sort(GlobDir *gd)
+{
+    gd->count = 0;
+    for (size_t off = 0; off < gd->len; off += ((struct dirent64 *)(gd->buf + off))->d_reclen)
+    {
+        gd->count++;
+    }
+    if ((gd->names = malloc(gd->count * sizeof(char *) + 1)) == NULL)
+    {
+        error_exit("malloc");
+    }
+    size_t i = 0;
+    for (size_t off = 0; off < gd->len; off += ((struct dirent64 *)(gd->buf + off))->d_reclen)
+    {
+        gd->names[i++] = ((struct dirent64 *)(gd->buf + off))->d_name;
+    }
+    qsort(gd->names, gd->count, sizeof(char *), compare_names);
+}
+
+// Sets *pos and *end to the part of the listing glob_next should go
+// through for the pattern: the names with its literal start if the listing
+// is sorted, else all of it
+void glob_range(GlobDir *gd, GlobPattern *pat, size_t *pos, size_t *end)
+{
+    *pos = 0;
+    *end = gd->names != NULL ? gd->count : gd->len;
+    if (gd->names == NULL || pat->head_len == 0)
+    {
+        return;
+    }
+    char head[pat->head_len];
+    for (size_t i = 0; i < pat->head_len; i++)
+    {
+        head[i] = pat->tokens[i].c;
+    }
+    size_t lo = 0;
+    size_t hi = gd->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(gd->names[mid], head, pat->head_len) < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    *pos = lo;
+    while (hi < gd->count && !strncmp(gd->names[hi], head, pat->head_len))
+    {
+        hi++;
+    }
+    *end = hi;
+}
+
+// The next entry from *pos, by name order if the listing is sorted, or
+// NULL at end
+struct dirent64 *glob_next(GlobDir *gd, size_t *pos, size_t end)
+{
+    if (*pos >= end)
+    {
+        return NULL;
+    }
+    if (gd->names != NULL)
+    {
+        return (struct dirent64 *)(gd->names[(*pos)++] - offsetof(struct dirent64, d_name));
+    }
+    struct dirent64 *d = (struct dirent64 *)(gd->buf + *pos);
+    *pos += d->d_reclen;
+    return d;
+}
+
+// The entries of a directory. A cached listing is used if the directory's
+// mtime is the same and was already in the past when it was read, so a
+// change in the same clock tick as the read is not missed. NULL if it is
+// not a readable directory.
+GlobDir *glob_listing(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+    {
+        return NULL;
+    }
+    GlobDir *gd = NULL;
+    GlobDir *oldest = &glob_cache[0];
+    for (int i = 0; i < GLOB_CACHE_DIRS && gd == NULL; i++)
+    {
+        if (glob_cache[i].buf != NULL && glob_cache[i].dev == st.st_dev && glob_cache[i].ino == st.st_ino)
+        {
+            gd = &glob_cache[i];
+        }
+        else if (glob_cache[i].used < oldest->used)
+        {
+            oldest = &glob_cache[i];
+        }
+    }
+    if (gd != NULL && gd->mtime.tv_sec == st.st_mtim.tv_sec && gd->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+        timespec_ns(&gd->mtime) < timespec_ns(&gd->read))
+    {
+        gd->used = ++glob_clock;
+        if (gd->names == NULL)
+        {
+            glob_sort(gd);
+        }
+        return gd;
+    }
+    gd = gd != NULL ? gd : oldest;
+    struct timespec read;
+    clock_gettime(CLOCK_REALTIME_COARSE, &read);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    char *buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    ssize_t n;
+    do
+    {
+        if (cap - len < GLOB_DENTS_BLOCK)
+        {
+            cap = 2 * cap + GLOB_DENTS_BLOCK;
+            if ((buf = realloc(buf, cap)) == NULL)
+            {
+                error_exit("realloc");
+            }
+        }
+        n = getdents64(fd, buf + len, cap - len);
+        len += n > 0 ? n : 0;
+    } while (n > 0);
+    close(fd);
+    if (n == -1)
+    {
+        free(buf);
+        return NULL;
+    }
+    free(gd->buf);
+    free(gd->names);
+    *gd = (GlobDir){st.st_dev, st.st_ino, st.st_mtim, read, buf, len, ++glob_clock, NULL, 0};
+    return gd;
+}
+
+// Whether an entry is a directory, stat only being needed if d_type doesn't
+// tell. Symbolic links are followed unless follow is false.
+bool glob_is_dir(struct dirent64 *d, char *path, bool follow)
+{
+    struct stat st;
+    if (d->d_type == DT_DIR || (d->d_type != DT_UNKNOWN && (d->d_type != DT_LNK || !follow)))
+    {
+        return d->d_type == DT_DIR;
+    }
+    return (follow ? stat(path, &st) : lstat(path, &st)) == 0 && S_ISDIR(st.st_mode);
+}
+
+void glob_walk(char *path, size_t len, const char *rest, WordList *matches);
+
+// ** matches any number of directories below path, never going into hidden
+// directories or following symbolic links. As the last component it
+// matches every file and directory below path, and followed only by
+// slashes (rest is then those slashes) every directory, with a / added.
+void glob_recurse(char *path, size_t len, const char *rest, WordList *matches)
+{
+    bool last = rest[strspn(rest, "/")] == '\0';
+    if (!last)
+    {
+        glob_walk(path, len, rest, matches);
+        path[len] = '\0';
+    }
+    GlobDir *gd = glob_listing(len == 0 ? "." : path);
+    if (gd == NULL)
+    {
+        return;
+    }
+    // Directories are gone into after the listing is done with, a deeper
+    // glob_listing may replace it in the cache
+    WordList dirs = {NULL, 0, 0};
+    for (size_t off = 0; off < gd->len; off += ((struct dirent64 *)(gd->buf + off))->d_reclen)
+    {
+        struct dirent64 *d = (struct dirent64 *)(gd->buf + off);
+        size_t n = strlen(d->d_name);
+        if (d->d_name[0] == '.' || len + n + 2 > PATH_MAX)
+        {
+            continue;
+        }
+        memcpy(path + len, d->d_name, n + 1);
+        bool dir = glob_is_dir(d, path, false);
+        if (last && (*rest == '\0' || dir))
+        {
+            strcpy(path + len + n, *rest == '\0' ? "" : "/");
+            word_push(matches, memcpy(arena_alloc(&line_arena, len + n + 2), path, len + n + 2));
+        }
+        if (dir)
+        {
+            word_push(&dirs, memcpy(arena_alloc(&line_arena, n + 1), d->d_name, n + 1));
+        }
+    }
+    for (int i = 0; i < dirs.count; i++)
+    {
+        size_t n = strlen(dirs.words[i]);
+        memcpy(path + len, dirs.words[i], n);
+        strcpy(path + len + n, "/");
+        glob_recurse(path, len + n + 1, rest, matches);
+    }
+    path[len] = '\0';
+}
+
+// Adds the paths made of path (len bytes) and names matching each
+// component of rest
+void glob_walk(char *path, size_t len, const char *rest, WordList *matches)
+{
+    for (; *rest == '/' && len + 1 < PATH_MAX; rest++)
+    {
+        path[len++] = '/';
+    }
+    path[len] = '\0';
+    if (*rest == '\0')
+    {
+        word_push(matches, memcpy(arena_alloc(&line_arena, len + 1), path, len + 1));
+        return;
+    }
+    const char *end = strchrnul(rest, '/');
+    size_t n = end - rest;
+    if (len + n + 2 > PATH_MAX)
+    {
+        return;
+    }
+    if (n == 2 && rest[0] == '*' && rest[1] == '*')
+    {
+        const char *next = end + strspn(end, "/");
+        struct stat st;
+        if (*next == '\0' && len > 0 && stat(path, &st) == 0)
+        {
+            // A trailing ** or **/ also matches the directory it starts in
+            word_push(matches, memcpy(arena_alloc(&line_arena, len + 1), path, len + 1));
+        }
+        glob_recurse(path, len, *next == '\0' ? end : next, matches);
+        return;
+    }
+    GlobPattern pat;
+    if (!glob_compile(rest, n, &pat))
+    {
+        struct stat st;
+        n = glob_unescape(path + len, rest, n);
+        // The last component must exist, and be a directory if slashes follow
+        if (end[strspn(end, "/")] != '\0' || (*end == '\0' ? lstat(path, &st) == 0 : stat(path, &st) == 0 && S_ISDIR(st.st_mode)))
+        {
+            glob_walk(path, len + n, end, matches);
+        }
+        return;
+    }
+    GlobDir *gd = glob_listing(len == 0 ? "." : path);
+    if (gd == NULL)
+    {
+        return;
+    }
+    WordList dirs = {NULL, 0, 0};
+    size_t pos;
+    size_t stop;
+    glob_range(gd, &pat, &pos, &stop);
+    for (struct dirent64 *d; (d = glob_next(gd, &pos, stop)) != NULL;)
+    {
+        size_t name_len = strlen(d->d_name);
+        if (len + name_len + 2 > PATH_MAX || !glob_match(&pat, d->d_name, name_len) ||
+            !strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+        {
+            continue;
+        }
+        memcpy(path + len, d->d_name, name_len + 1);
+        if (*end == '\0')
+        {
+            word_push(matches, memcpy(arena_alloc(&line_arena, len + name_len + 1), path, len + name_len + 1));
+        }
+        else if (glob_is_dir(d, path, true))
+        {
+            word_push(&dirs, memcpy(arena_alloc(&line_arena, name_len + 1), d->d_name, name_len + 1));
+        }
+    }
+    for (int i = 0; i < dirs.count; i++)
+    {
+        size_t name_len = strlen(dirs.words[i]);
+        memcpy(path + len, dirs.words[i], name_len + 1);
+        glob_walk(path, len + name_len, end, matches);
+    }
+    path[len] = '\0';
+}
+
+// Adds the paths matching a pattern word to list in sorted order, or the
+// word itself, without the escapes of its quoted bytes, if nothing matches
+void glob_word(char *word, WordList *list)
+{
+    char path[PATH_MAX];
+    int first = list->count;
+    glob_walk(path, 0, word, list);
+    if (list->count == first)
+    {
+        size_t len = strlen(word);
+        word_push(list, arena_alloc(&line_arena, len + 1));
+        glob_unescape(list->words[first], word, len);
+    }
+    qsort(list->words + first, list->count - first, sizeof(char *), compare_names);
+}
+
+// Plans only record which words are patterns, so they are expanded each
+// time a pipeline runs, into a per-line copy of the stage array
+Command *expand_globs(Plan *plan, Command *stages)
+{
+    Command *copy = NULL;
+    long long traced = trace_clock();
+    for (int i = 0; i < plan->cnt; i++)
+    {
+        if (stages[i].patterns == NULL)
+        {
+            continue;
+        }
+        if (copy == NULL)
+        {
+            copy = arena_alloc(&line_arena, plan->cnt * sizeof(Command));
+            memcpy(copy, stages, plan->cnt * sizeof(Command));
+        }
+        WordList argv = {NULL, 0, 0};
+        for (int j = 0; j < stages[i].argc; j++)
+        {
+            if (stages[i].patterns[j])
+            {
+                glob_word(stages[i].argv[j], &argv);
+            }
+            else
+            {
+                word_push(&argv, stages[i].argv[j]);
+            }
+        }
+        word_push(&argv, NULL);
+        copy[i].argv = argv.words;
+        copy[i].argc = argv.count - 1;
+        copy[i].patterns = NULL;
+    }
+    if (copy == NULL)
+    {
+        return stages;
+    }
+    trace_span("glob", traced, -1, plan->text);
+    return copy;
+}
+
+// time [-j] cmd ... turns on accounting for this pipeline, which execute
+// passes on only once it launches a job so builtins leave it off. Plans are
+// shared, so the prefix is dropped from a per-line copy of the stage array.
+Command *time_prefix(Plan *plan, Command *stages, enum TimeMode *mode)
+{
+    int skip = 1;
+    *mode = TIME_TABLE;
+    if (stages[0].argc > 1 && !strcmp(stages[0].argv[1], "-j"))
+    {
+        *mode = TIME_JSON;
+        skip = 2;
+    }
+    Command *copy = arena_alloc(&line_arena, plan->cnt * sizeof(Command));
+    memcpy(copy, stages, plan->cnt * sizeof(Command));
+    copy[0].argv += skip;
+    copy[0].argc -= skip;
+    return copy;
+}
+
+// A timeout prefix duration in ms: a number with an optional s, m, h or d
+// suffix. Returns -1 if it is not one.
+long long parse_duration(char *str)
+{
+    char *end;
+    double value = strtod(str, &end);
+    long long unit = 1000;
+    switch (*end)
+    {
+    case 'd':
+        unit *= 24;
+        // fall through
+    case 'h':
+        unit *= 60;
+        // fall through
+    case 'm':
+        unit *= 60;
+        // fall through
+    case 's':
+        end++;
+        break;
+    }
+    if (end == str || *end != '\0' || !(value >= 0 && value * unit < 1e15) || (!isdigit(str[0]) && str[0] != '.'))
+    {
+        return -1;
+    }
+    double ms = value * unit;
+    return (long long)ms + ((long long)ms < ms); // Rounded up, a tiny timeout is still one
+}
+
+// timeout [-k duration] duration cmd ... bounds the whole pipeline: it gets
+// SIGTERM once duration has passed, and SIGKILL that long after with -k. The
+// job's status is then 124, or 137 if it had to be killed.
+Command *timeout_prefix(Plan *plan, Command *stages)
+{
+    int skip = 1;
+    kill_after_ms = 0;
+    if (stages[0].argc > 2 && !strcmp(stages[0].argv[1], "-k"))
+    {
+        kill_after_ms = parse_duration(stages[0].argv[2]);
+        skip = 3;
+    }
+    timeout_ms = stages[0].argc > skip + 1 ? parse_duration(stages[0].argv[skip]) : -1;
+    if (timeout_ms == -1 || kill_after_ms == -1)
+    {
+        timeout_ms = kill_after_ms = 0;
+        return NULL;
+    }
+    Command *copy = arena_alloc(&line_arena, plan->cnt * sizeof(Command));
+    memcpy(copy, stages, plan->cnt * sizeof(Command));
+    copy[0].argv += skip + 1;
+    copy[0].argc -= skip + 1;
+    return copy;
+}
+
+// Starts every process of the pipeline in a new process group and returns
+// without waiting for them. job_in_fd and job_out_fd replace the shell's
+// stdin and stdout for the job if they are not -1.
+Job *launch_job(Plan *plan, Command *stages, bool background, int job_in_fd, int job_out_fd)
+{
+    validate_path_cache();
+    fflush(stdout); // Builtin output must come before the children's
+    raise_fd_limit(3 * plan->cnt + 1);
+    Job *job = create_job(plan, stages, background);
+    int count = plan->cnt;
+    unsigned long long *bytes = NULL;
+    if (job->timing != TIME_OFF)
+    {
+        // Shared with the helpers, which do the counting
+        bytes = mmap(NULL, 2 * count * sizeof(unsigned long long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (bytes == MAP_FAILED)
+        {
+            error_exit("mmap");
+        }
+        job->bytes = bytes;
+    }
+    int base = placement_next;
+    placement_next += count;
+    int outputs = 0;
+    for (int i = 0; i < count; i++)
+    {
+        outputs += i == count - 1 || stages[i].out_count == 0;
+    }
+    int *branch_fds = NULL; // Read ends for the collector, one per branch
+    int branches = 0;
+    if (outputs > 1 && branch_output != BRANCH_DIRECT)
+    {
+        branch_fds = arena_alloc(&line_arena, outputs * sizeof(int));
+    }
+    // Each pipe is made just before the stage writing it starts, and the
+    // read end of the one into stage i is the only pipe fd kept between
+    // stages, so the fds in use don't grow with the pipeline
+    int prev_fd = -1;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    for (int i = 0; i < count; i++)
+    {
+        Command *cmd = &stages[i];
+        int fan_fd[2] = {-1, -1};
+        int relay_fd[2] = {-1, -1};
+        int branch_fd[2] = {-1, -1};
+        int next_fd[2] = {-1, -1}; // Out of this stage or its fan-out helper
+        int in_fd = -1;
+        int out_fd = -1;
+        int last = i;
+        Filter *fused = NULL;
+        if (use_fusion && job->timing == TIME_OFF)
+        {
+            // Stages i + 1 to last run in stage i's process, relays need them apart
+            fused = fuse_stages(stages, count, i, &last);
+        }
+        Command *last_cmd = &stages[last];
+        if (i > 0 && prev_fd == -1)
+        {
+            // After a comma: the previous stage writes no pipe, this one reads an empty one
+            make_pipe(next_fd, i);
+            close(next_fd[1]);
+            prev_fd = next_fd[0];
+            next_fd[0] = next_fd[1] = -1;
+        }
+        if (i > 0 && i < count - 1 && cmd->out_count == 0)
+        {
+            make_pipe(fan_fd, i);
+            make_pipe(next_fd, i);
+            unsigned long long unused = 0;
+            pid_t pid = spawn_fanout(prev_fd, fan_fd, next_fd[1], i, bytes != NULL ? &bytes[count + i] : &unused, job);
+            add_proc(job, pid, i, PROC_FANOUT, "(fanout)");
+            place_proc(pid, i, base);
+            in_fd = fan_fd[0];
+        }
+        else if (i != 0 && (i == count - 1 || cmd->out_count > 0))
+        {
+            in_fd = prev_fd;
+        }
+        else if (i == 0)
+        {
+            in_fd = job_in_fd;
+        }
+        if (last == count - 1 || last_cmd->out_count == 0)
+        {
+            out_fd = job_out_fd; // Last stage or a branch
+            if (branch_fds != NULL)
+            {
+                make_pipe(branch_fd, i);
+                branch_fds[branches++] = branch_fd[0];
+                out_fd = branch_fd[1];
+            }
+        }
+        if (last < count - 1 && last_cmd->out_count > 0)
+        {
+            make_pipe(next_fd, i);
+            out_fd = next_fd[1];
+            if (bytes != NULL)
+            {
+                make_pipe(relay_fd, i);
+                pid_t pid = spawn_relay(relay_fd, next_fd[1], i, &bytes[i], job);
+                add_proc(job, pid, i, PROC_RELAY, "(relay)");
+                place_proc(pid, i, base);
+                out_fd = relay_fd[1];
+            }
+        }
+        pid_t pid;
+        Util *util = find_util(cmd->argv[0]);
+        long long traced = trace_clock();
+        if (use_posix_spawn && util == NULL)
+        {
+            pid = spawn_stage(cmd, resolve_command(cmd->argv[0]), in_fd, out_fd, job);
+            trace_span("posix_spawn", traced, i, cmd->argv[0]);
+        }
+        else
+        {
+            pid = fork_stage(cmd, resolve_command(cmd->argv[0]), util, fused, in_fd, out_fd, job);
+            trace_span("fork", traced, i, cmd->argv[0]);
+        }
+        add_proc(job, pid, i, PROC_STAGE, cmd->argv[0]);
+        place_proc(pid, i, base);
+        if (last == count - 1)
+        {
+            job->last_pid = pid;
+        }
+        if (prev_fd != -1)
+        {
+            close(prev_fd);
+        }
+        prev_fd = next_fd[0];
+        if (next_fd[1] != -1)
+        {
+            close(next_fd[1]);
+        }
+        if (fan_fd[0] != -1)
+        {
+            close(fan_fd[0]);
+            close(fan_fd[1]);
+        }
+        if (relay_fd[0] != -1)
+        {
+            close(relay_fd[0]);
+            close(relay_fd[1]);
+        }
+        if (branch_fd[1] != -1)
+        {
+            close(branch_fd[1]);
+        }
+        i = last;
+    }
+    if (prev_fd != -1)
+    {
+        close(prev_fd);
+    }
+    if (branch_fds != NULL)
+    {
+        pid_t pid = spawn_collector(branch_fds, branches, job_out_fd, job);
+        add_proc(job, pid, count - 1, PROC_COLLECT, "(collect)");
+        place_proc(pid, count - 1, base);
+        for (int k = 0; k < branches; k++)
+        {
+            close(branch_fds[k]);
+        }
+    }
+    return job;
+}
+
+int parallel_builtin(Plan *plan); // Needs compile_plan, defined with it below
+int cached_prefix(Plan *plan, Command *stages, bool background); // Runs the rest through execute, defined below
+
+// Runs the plan and returns the exit status of its last command, or
+// starts it and returns at once if it is run in the background
+int execute(Plan *plan, bool background)
+{
+    if (plan == NULL || !(plan->cnt))
+    {
+        return last_status;
+    }
+    Command *stages = expand_globs(plan, plan->stages);
+    enum TimeMode mode = TIME_OFF;
+    if (!strcmp(stages[0].argv[0], "cached"))
+    {
+        return cached_prefix(plan, stages, background);
+    }
+    if (!strcmp(stages[0].argv[0], "time"))
+    {
+        stages = time_prefix(plan, stages, &mode);
+        if (stages[0].argc == 0)
+        {
+            return EXIT_SUCCESS;
+        }
+    }
+    timeout_ms = kill_after_ms = 0;
+    if (!strcmp(stages[0].argv[0], "timeout"))
+    {
+        stages = timeout_prefix(plan, stages);
+        if (stages == NULL)
+        {
+            fprintf(stderr, "usage: timeout [-k duration] duration cmd ...\n");
+            return 125; // As coreutils timeout fails itself
+        }
+    }
+    if (!strcmp(stages[0].argv[0], "cd"))
+    {
+        return change_dir(stages[0].argv);
+    }
+    if (!strcmp(stages[0].argv[0], "history"))
+    {
+        return history_builtin(&stages[0]);
+    }
+    if (!strcmp(stages[0].argv[0], "alias"))
+    {
+        if (stages[0].argc == 1)
+        {
+            for (size_t i = 0; i < alias_table.size; i++)
+            {
+                Alias *alias = alias_table.slots[i].value;
+                if (alias != NULL)
+                {
+                    printf("alias %s = %s\n", alias->name, alias->command);
+                }
+            }
+            return EXIT_SUCCESS;
+        }
+        if (stages[0].argc < 4)
+        {
+            perror("Less arguments than expected");
+            return EXIT_FAILURE;
+        }
+        size_t len = 0;
+        for (int i = 3; i < stages[0].argc; i++)
+        {
+            len += strlen(stages[0].argv[i]) + 1;
+        }
+        char *command = arena_alloc(&line_arena, len);
+        command[0] = '\0';
+        for (int i = 3; i < stages[0].argc; i++)
+        {
+            strcat(command, stages[0].argv[i]);
+            if (i != stages[0].argc - 1)
+            {
+                strcat(command, " ");
+            }
+        }
+        insert_alias(stages[0].argv[1], command);
+        return EXIT_SUCCESS;
+    }
+    if (!strcmp(stages[0].argv[0], "unalias"))
+    {
+        if (stages[0].argc < 2 || !remove_alias(stages[0].argv[1]))
+        {
+            perror("Alias not found");
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    if (!strcmp(stages[0].argv[0], "exit"))
+    {
+        exit(stages[0].argc > 1 ? atoi(stages[0].argv[1]) : last_status);
+    }
+    if (!strcmp(stages[0].argv[0], "set"))
+    {
+        set_builtin(&stages[0]);
+        return EXIT_SUCCESS;
+    }
+    if (!strcmp(stages[0].argv[0], "hash"))
+    {
+        hash_builtin(&stages[0]);
+        return EXIT_SUCCESS;
+    }
+    if (!strcmp(stages[0].argv[0], "complete"))
+    {
+        return complete_builtin(&stages[0]);
+    }
+    if (!strcmp(stages[0].argv[0], "plans"))
+    {
+        plans_builtin(&stages[0]);
+        return EXIT_SUCCESS;
+    }
+    if (!strcmp(stages[0].argv[0], "jobs"))
+    {
+        return jobs_builtin();
+    }
+    if (!strcmp(stages[0].argv[0], "fg") || !strcmp(stages[0].argv[0], "bg"))
+    {
+        return fg_bg_builtin(&stages[0], stages[0].argv[0][0] == 'f');
+    }
+    if (!strcmp(stages[0].argv[0], "wait"))
+    {
+        return wait_builtin(&stages[0]);
+    }
+    if (!strcmp(stages[0].argv[0], "parallel"))
+    {
+        return parallel_builtin(plan);
+    }
+    timing = mode;
+    jobs_launched++;
+    Job *job = launch_job(plan, stages, background, -1, -1);
+    if (background)
+    {
+        if (interactive)
+        {
+            printf("[%d] %d\n", job->id, job->pgid);
+        }
+        return EXIT_SUCCESS;
+    }
+    return wait_job(job, true);
+}
+
+// The output cache directory: $NPSHELL_CACHE, or npshell in
+// $XDG_CACHE_HOME or ~/.cache, made on first use. NULL if there is none.
+const char *open_cache_dir()
+{
+    if (cache_dir[0] != '\0')
+    {
+        return cache_dir;
+    }
+    char *dir = getenv("NPSHELL_CACHE");
+    char *xdg = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    if (dir != NULL && dir[0] != '\0')
+    {
+        snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+    }
+    else if (xdg != NULL && xdg[0] != '\0')
+    {
+        snprintf(cache_dir, sizeof(cache_dir), "%s/npshell", xdg);
+    }
+    else if (home != NULL)
+    {
+        snprintf(cache_dir, sizeof(cache_dir), "%s/.cache", home);
+        mkdir(cache_dir, 0700);
+        strncat(cache_dir, "/npshell", sizeof(cache_dir) - strlen(cache_dir) - 1);
+    }
+    if (cache_dir[0] == '\0' || (mkdir(cache_dir, 0700) == -1 && errno != EEXIST))
+    {
+        cache_dir[0] = '\0';
+        return NULL;
+    }
+    return cache_dir;
+}
+
+// Two 64-bit lanes, FNV-1a and a multiply-xorshift, make a 128-bit key
+void cache_hash(unsigned long long h[2], const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        h[0] = (h[0] ^ p[i]) * 1099511628211ULL;
+        h[1] = (h[1] + p[i] + 1) * 0x9E3779B97F4A7C15ULL;
+        h[1] ^= h[1] >> 29;
+    }
+}
+
+// Strings are hashed with their length, so a missing one differs from ""
+void cache_hash_str(unsigned long long h[2], const char *str)
+{
+    size_t len = str != NULL ? strlen(str) + 1 : 0;
+    cache_hash(h, &len, sizeof(len));
+    cache_hash(h, str, len);
+}
+
+// Adds what identifies a file's contents: device, inode, size and mtime. A
+// name that is not a file or directory adds nothing, devices have no mtime
+// worth keying on.
+void cache_hash_file(unsigned long long h[2], const char *path)
+{
+    struct stat st;
+    if (path == NULL || stat(path, &st) == -1 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+    {
+        return;
+    }
+    unsigned long long id[5] = {st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+    cache_hash(h, id, sizeof(id));
+}
+
+// Names a pipeline's cache entry after its stages, the cwd, the variables
+// that change what commands print, and the identity of the shell, each
+// command's binary, each < file and each argument that names a file.
+// Returns false if a stage writes a file with > or >>, which a replay
+// wouldn't do.
+bool cache_key(Command *stages, int count, char key[33])
+{
+    static const char *env[] = {"PATH", "LANG", "LC_ALL", "LC_COLLATE", "LC_CTYPE", "LC_MESSAGES", "LC_NUMERIC", "LC_TIME", "TZ"};
+    unsigned long long h[2] = {14695981039346656037ULL, 0x6a09e667f3bcc908ULL};
+    char cwd[PATH_MAX];
+    cache_hash_str(h, CACHE_MAGIC);
+    cache_hash_file(h, "/proc/self/exe");
+    cache_hash_str(h, getcwd(cwd, sizeof(cwd)));
+    for (size_t i = 0; i < sizeof(env) / sizeof(env[0]); i++)
+    {
+        cache_hash_str(h, getenv(env[i]));
+    }
+    cache_hash(h, &count, sizeof(count));
+    validate_path_cache();
     for (int i = 0; i < count; i++)
     {
-        pid_t ret = fork();
-        if (ret == -1)
+        Command *cmd = &stages[i];
+        if (cmd->output_redirect || cmd->output_append)
+        {
+            return false;
+        }
+        int shape[3] = {cmd->argc, cmd->out_count, cmd->input_redirect};
+        cache_hash(h, shape, sizeof(shape));
+        cache_hash_file(h, resolve_command(cmd->argv[0]));
+        for (int j = 0; j < cmd->argc; j++)
+        {
+            cache_hash_str(h, cmd->argv[j]);
+            if (j > 0)
+            {
+                cache_hash_file(h, cmd->argv[j]);
+            }
+        }
+        if (cmd->input_redirect)
+        {
+            cache_hash_str(h, cmd->input_file);
+            cache_hash_file(h, cmd->input_file);
+        }
+    }
+    snprintf(key, 33, "%016llx%016llx", h[0], h[1]);
+    return true;
+}
+
+// Copies len bytes at off in in_fd to out_fd
+bool cache_copy(int in_fd, off_t off, unsigned long long len, int out_fd)
+{
+    char buffer[BUFFER_SIZE * 64];
+    while (len > 0)
+    {
+        ssize_t n = sendfile(out_fd, in_fd, &off, len < FANOUT_CHUNK ? len : FANOUT_CHUNK);
+        if (n == -1 && errno == EINVAL)
+        {
+            // Such as an output opened with O_APPEND
+            n = pread(in_fd, buffer, len < sizeof(buffer) ? len : sizeof(buffer), off);
+            if (n > 0 && write_all(out_fd, buffer, n) == -1)
+            {
+                return false;
+            }
+            off += n > 0 ? n : 0;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+// Writes a stored entry's stdout and stderr and returns its status, or -1
+// if there is no complete entry at path
+int cache_replay(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    CacheEntry entry;
+    struct stat st;
+    if (pread(fd, &entry, sizeof(entry), 0) != sizeof(entry) || memcmp(entry.magic, CACHE_MAGIC, 8) != 0 ||
+        fstat(fd, &st) == -1 || (unsigned long long)st.st_size != sizeof(entry) + entry.out_len + entry.err_len)
+    {
+        close(fd);
+        return -1;
+    }
+    futimens(fd, NULL); // Now the most recently used
+    fflush(stdout);
+    cache_copy(fd, sizeof(entry), entry.out_len, STDOUT_FILENO);
+    cache_copy(fd, sizeof(entry) + entry.out_len, entry.err_len, STDERR_FILENO);
+    close(fd);
+    return entry.status;
+}
+
+// Writes an entry under a name of its own and renames it into place, so a
+// shell replaying the same key at once sees either no entry or all of it
+void cache_store(const char *path, int status, int out_fd, int err_fd)
+{
+    struct stat out_st;
+    struct stat err_st;
+    if (fstat(out_fd, &out_st) == -1 || fstat(err_fd, &err_st) == -1 ||
+        sizeof(CacheEntry) + out_st.st_size + err_st.st_size > cache_limit)
+    {
+        return;
+    }
+    CacheEntry entry = {CACHE_MAGIC, status, out_st.st_size, err_st.st_size};
+    char tmp[PATH_MAX + 64];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        return;
+    }
+    bool written = write_all(fd, (char *)&entry, sizeof(entry)) != -1 && cache_copy(out_fd, 0, entry.out_len, fd) &&
+                   cache_copy(err_fd, 0, entry.err_len, fd);
+    if (close(fd) == -1 || !written || rename(tmp, path) == -1)
+    {
+        unlink(tmp);
+    }
+}
+
+int compare_cache_files(const void *a, const void *b)
+{
+    const CacheFile *x = a;
+    const CacheFile *y = b;
+    long long dx = timespec_ns((struct timespec *)&x->mtime);
+    long long dy = timespec_ns((struct timespec *)&y->mtime);
+    return (dx > dy) - (dx < dy);
+}
+
+// Removes the least recently used entries until the cache is within its
+// limit, and the temporary files of stores that never finished. Shells
+// sharing the cache may do this at the same time, an entry that is already
+// gone is skipped.
+void cache_evict()
+{
+    DIR *dir = opendir(cache_dir);
+    if (dir == NULL)
+    {
+        return;
+    }
+    CacheFile *files = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    unsigned long long total = 0;
+    struct dirent *d;
+    time_t now = time(NULL);
+    while ((d = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        size_t len = strlen(d->d_name);
+        if (len < 32 || fstatat(dirfd(dir), d->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+        if (len > 32)
+        {
+            // <key>.<pid>.tmp, still written to unless its shell died
+            if (len > 36 && !strcmp(d->d_name + len - 4, ".tmp") && now - st.st_mtim.tv_sec > CACHE_TMP_AGE)
+            {
+                unlinkat(dirfd(dir), d->d_name, 0);
+            }
+            continue;
+        }
+        if (count == cap)
+        {
+            cap = cap == 0 ? 64 : 2 * cap;
+            if ((files = realloc(files, cap * sizeof(CacheFile))) == NULL)
+            {
+                error_exit("realloc");
+            }
+        }
+        memcpy(files[count].name, d->d_name, 33);
+        files[count].mtime = st.st_mtim;
+        files[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+    if (total > cache_limit)
+    {
+        qsort(files, count, sizeof(CacheFile), compare_cache_files);
+        for (size_t i = 0; i < count && total > cache_limit; i++)
+        {
+            unlinkat(dirfd(dir), files[i].name, 0);
+            total -= files[i].size;
+        }
+    }
+    closedir(dir);
+    free(files);
+}
+
+// cached cmd ... replays the stdout, stderr and status stored for the same
+// pipeline over the same files, or runs it and stores them. The pipeline
+// reads /dev/null rather than stdin, which is not part of the key, and its
+// output is held back until it ends so that a run and a replay look alike.
+// Builtins, which never reach launch_job, a pipeline writing files or run
+// in the background are not cached, and neither is one ended by a signal
+// or a timeout. cached on its own prints the counters.
+int cached_prefix(Plan *plan, Command *stages, bool background)
+{
+    if (stages[0].argc == 1)
+    {
+        const char *dir = open_cache_dir();
+        printf("hits\t%lu\nmisses\t%lu\ndir\t%s\nlimit\t%llu\n", cache_hits, cache_misses, dir != NULL ? dir : "-",
+               cache_limit);
+        return EXIT_SUCCESS;
+    }
+    Command *copy = arena_alloc(&line_arena, plan->cnt * sizeof(Command));
+    memcpy(copy, stages, plan->cnt * sizeof(Command));
+    copy[0].argv++;
+    copy[0].argc--;
+    if (!copy[0].input_redirect)
+    {
+        copy[0].input_redirect = true;
+        copy[0].input_file = "/dev/null";
+    }
+    Plan rest = {plan->cnt, copy, plan->text};
+    char key[33];
+    bool builtin = false;
+    for (size_t i = 0; i < sizeof(builtin_names) / sizeof(builtin_names[0]); i++)
+    {
+        // time and timeout are prefixes, what they run is checked after it
+        builtin |= strcmp(builtin_names[i], "time") && strcmp(builtin_names[i], "timeout") &&
+                   !strcmp(builtin_names[i], copy[0].argv[0]);
+    }
+    const char *dir = background || builtin ? NULL : open_cache_dir();
+    if (dir == NULL || !cache_key(copy, plan->cnt, key))
+    {
+        return execute(&rest, background);
+    }
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", dir, key);
+    int status = cache_replay(path);
+    if (status != -1)
+    {
+        cache_hits++;
+        return status;
+    }
+    cache_misses++;
+    fflush(stdout);
+    fflush(stderr);
+    int out_fd = make_memfd("cached-stdout");
+    int err_fd = make_memfd("cached-stderr");
+    int saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    int saved_err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+    if (saved_out == -1 || saved_err == -1 || dup2(out_fd, STDOUT_FILENO) == -1 || dup2(err_fd, STDERR_FILENO) == -1)
+    {
+        error_exit("dup2");
+    }
+    bool was_interactive = interactive;
+    interactive = false; // No status lines in the stored output
+    unsigned long launched = jobs_launched;
+    status = execute(&rest, false);
+    interactive = was_interactive;
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+    if (jobs_launched != launched && status < 128 && !interrupted && !(timeout_ms > 0 && status == TIMEOUT_STATUS))
+    {
+        cache_store(path, status, out_fd, err_fd);
+        cache_evict();
+    }
+    collect_held(out_fd, STDOUT_FILENO);
+    collect_held(err_fd, STDERR_FILENO);
+    return status;
+}
+
+Command *create_cmd()
+{
+    Command *cmd = arena_alloc(&line_arena, sizeof(Command));
+    cmd->argc = 0;
+    cmd->argv = NULL;
+    cmd->input_redirect = false;
+    cmd->output_redirect = false;
+    cmd->output_append = false;
+    cmd->input_file = NULL;
+    cmd->output_file = NULL;
+    cmd->patterns = NULL;
+    cmd->out_count = 0;
+    cmd->next = NULL;
+    return cmd;
+}
+
+// Keeps supervising jobs while the prompt waits for a line, so timeouts of
+// background jobs fire on time
+void wait_for_input()
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &input_ready};
+    if (stdin->_IO_read_ptr < stdin->_IO_read_end || epoll_ctl(supervisor_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == -1)
+    {
+        return; // A line is buffered already, or stdin can't be polled
+    }
+    input_ready = false;
+    while (!input_ready)
+    {
+        supervise(-1);
+    }
+    epoll_ctl(supervisor_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+}
+
+// One key from the terminal, escape sequences for arrows and friends
+// become a single Key. -1 at end of input.
+int read_key()
+{
+    unsigned char c;
+    unsigned char seq[3];
+    wait_for_input();
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, &c, 1)) == -1 && errno == EINTR)
+    {
+    }
+    if (n != 1)
+    {
+        return -1;
+    }
+    if (c != '\033' || read(STDIN_FILENO, seq, 2) != 2)
+    {
+        return c;
+    }
+    if (seq[0] == 'O' || (seq[0] == '[' && isalpha(seq[1])))
+    {
+        const char *keys = "ABCDHF";
+        const char *key = strchr(keys, seq[1]);
+        return key != NULL ? KEY_UP + (key - keys) : 0;
+    }
+    if (seq[0] == '[' && isdigit(seq[1]) && read(STDIN_FILENO, &seq[2], 1) == 1 && seq[2] == '~')
+    {
+        return seq[1] == '1' || seq[1] == '7' ? KEY_HOME : seq[1] == '4' || seq[1] == '8' ? KEY_END : seq[1] == '3' ? KEY_DELETE : 0;
+    }
+    return 0;
+}
+
+// Redraws the prompt and line with the cursor in place, lines are assumed
+// to fit the terminal's width
+void edit_refresh(LineEdit *ed)
+{
+    printf("\r%s%.*s\033[K", ed->prompt, (int)ed->len, ed->buf);
+    if (ed->pos < ed->len)
+    {
+        printf("\033[%zuD", ed->len - ed->pos);
+    }
+    fflush(stdout);
+}
+
+void edit_insert(LineEdit *ed, const char *text, size_t n)
+{
+    if (ed->len + n + 2 > ed->cap)
+    {
+        ed->cap = 2 * (ed->len + n + 2);
+        ed->buf = realloc(ed->buf, ed->cap);
+        if (ed->buf == NULL)
+        {
+            error_exit("realloc");
+        }
+    }
+    memmove(ed->buf + ed->pos + n, ed->buf + ed->pos, ed->len - ed->pos);
+    memcpy(ed->buf + ed->pos, text, n);
+    ed->len += n;
+    ed->pos += n;
+}
+
+// Removes n bytes from the line at from
+void edit_delete(LineEdit *ed, size_t from, size_t n)
+{
+    memmove(ed->buf + from, ed->buf + from + n, ed->len - from - n);
+    ed->len -= n;
+    if (ed->pos > from)
+    {
+        ed->pos = ed->pos > from + n ? ed->pos - n : from;
+    }
+}
+
+// Replaces the line with a history entry, back lines before the newest,
+// or with the line being typed for 0
+void edit_history(LineEdit *ed, unsigned int back)
+{
+    if (ed->history_back == 0)
+    {
+        free(ed->typed);
+        ed->typed = strndup(ed->buf, ed->len);
+    }
+    ed->history_back = back;
+    const char *text = back > 0 ? history.ring[(history.next_seq - back) % history.cap] : ed->typed;
+    ed->len = ed->pos = 0;
+    edit_insert(ed, text != NULL ? text : "", text != NULL ? strlen(text) : 0);
+}
+
+// Prints the matches in columns under the line, at most COMPLETION_LIST_MAX
+void print_completions(Completions *list)
+{
+    struct winsize ws;
+    int width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    int shown = list->count < COMPLETION_LIST_MAX ? list->count : COMPLETION_LIST_MAX;
+    int longest = 1;
+    for (int i = 0; i < shown; i++)
+    {
+        int len = strlen(list->names[i]);
+        longest = len > longest ? len : longest;
+    }
+    int columns = width / (longest + 2) > 0 ? width / (longest + 2) : 1;
+    int rows = (shown + columns - 1) / columns;
+    printf("\n");
+    for (int row = 0; row < rows; row++)
+    {
+        for (int i = row; i < shown; i += rows)
+        {
+            printf("%-*s", i + rows < shown ? longest + 2 : 0, list->names[i]);
+        }
+        printf("\n");
+    }
+    if (shown < list->count)
+    {
+        printf("... and %d more\n", list->count - shown);
+    }
+}
+
+// Tab: completes the word before the cursor as far as every match agrees,
+// a command name in the first word of a stage and a path anywhere else.
+// With show, as on a second Tab, lists the matches instead. Returns false
+// if there was nothing to add.
+bool edit_complete(LineEdit *ed, bool show)
+{
+    size_t start = ed->pos;
+    while (start > 0 && !isspace(ed->buf[start - 1]) && strchr("|,<>", ed->buf[start - 1]) == NULL)
+    {
+        start--;
+    }
+    size_t before = start;
+    while (before > 0 && isspace(ed->buf[before - 1]))
+    {
+        before--;
+    }
+    const char *word = ed->buf + start;
+    size_t len = ed->pos - start;
+    bool command = (before == 0 || ed->buf[before - 1] == '|' || ed->buf[before - 1] == ',') && memchr(word, '/', len) == NULL;
+    Completions list = {NULL, 0, 0};
+    char ext[PATH_MAX];
+    enum Match match = command ? complete_command(word, len, ext, sizeof(ext), show ? &list : NULL) : complete_file(word, len, ext, sizeof(ext), show ? &list : NULL);
+    if (show)
+    {
+        sort_completions(&list);
+        if (list.count > 1)
+        {
+            print_completions(&list);
+        }
+        free_completions(&list);
+        return true;
+    }
+    size_t ext_len = strlen(ext);
+    if (match == MATCH_NONE || (ext_len == 0 && match == MATCH_MANY))
+    {
+        return false;
+    }
+    edit_insert(ed, ext, ext_len);
+    if (match == MATCH_ONE && (ext_len == 0 || ext[ext_len - 1] != '/'))
+    {
+        edit_insert(ed, " ", 1);
+    }
+    return true;
+}
+
+// Reads a line in raw mode with the editing keys of a readline prompt, Tab
+// completion and history on the arrows. Returns it with a newline, as
+// getline would, or NULL at end of input.
+char *edit_line(const char *prompt, struct termios *cooked)
+{
+    static LineEdit ed = {NULL, 0, 0, 0, NULL, NULL, 0};
+    struct termios raw = *cooked;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    ed.prompt = prompt;
+    ed.len = ed.pos = 0;
+    ed.history_back = 0;
+    bool tabbed = false; // The last key was a Tab that added nothing
+    int key;
+    while ((key = read_key()) != -1)
+    {
+        bool tab = key == '\t';
+        if (key == '\r' || key == '\n')
+        {
+            break;
+        }
+        else if (key == '\t')
+        {
+            tab = !edit_complete(&ed, tabbed);
+        }
+        else if (key == 4 && ed.len == 0) // Ctrl-D
+        {
+            tcsetattr(STDIN_FILENO, TCSADRAIN, cooked);
+            return NULL;
+        }
+        else if (key == 3) // Ctrl-C drops the line
+        {
+            printf("^C\n");
+            ed.len = ed.pos = 0;
+            ed.history_back = 0;
+        }
+        else if ((key == 127 || key == 8) && ed.pos > 0)
+        {
+            edit_delete(&ed, ed.pos - 1, 1);
+        }
+        else if ((key == KEY_DELETE || key == 4) && ed.pos < ed.len)
+        {
+            edit_delete(&ed, ed.pos, 1);
+        }
+        else if ((key == KEY_LEFT || key == 2) && ed.pos > 0)
+        {
+            ed.pos--;
+        }
+        else if ((key == KEY_RIGHT || key == 6) && ed.pos < ed.len)
+        {
+            ed.pos++;
+        }
+        else if (key == KEY_HOME || key == 1)
+        {
+            ed.pos = 0;
+        }
+        else if (key == KEY_END || key == 5)
+        {
+            ed.pos = ed.len;
+        }
+        else if (key == 21) // Ctrl-U
+        {
+            edit_delete(&ed, 0, ed.pos);
+        }
+        else if (key == 11) // Ctrl-K
+        {
+            ed.len = ed.pos;
+        }
+        else if (key == 23) // Ctrl-W
+        {
+            size_t start = ed.pos;
+            while (start > 0 && isspace(ed.buf[start - 1]))
+            {
+                start--;
+            }
+            while (start > 0 && !isspace(ed.buf[start - 1]))
+            {
+                start--;
+            }
+            edit_delete(&ed, start, ed.pos - start);
+        }
+        else if (key == 12) // Ctrl-L
+        {
+            printf("\033[H\033[2J");
+        }
+        else if ((key == KEY_UP || key == 16) && ed.history_back < history.count)
+        {
+            edit_history(&ed, ed.history_back + 1);
+        }
+        else if ((key == KEY_DOWN || key == 14) && ed.history_back > 0)
+        {
+            edit_history(&ed, ed.history_back - 1);
+        }
+        else if (key >= ' ' && key < 256 && key != 127)
+        {
+            char c = key;
+            edit_insert(&ed, &c, 1);
+        }
+        tabbed = tab;
+        edit_refresh(&ed);
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, cooked);
+    printf("\n");
+    if (key == -1 && ed.len == 0)
+    {
+        return NULL;
+    }
+    edit_insert(&ed, "", 0); // Makes room for the newline
+    ed.buf[ed.len] = '\n';
+    ed.buf[ed.len + 1] = '\0';
+    return ed.buf;
+}
+
+// Prints the prompt and reads a line, edited in raw mode on a terminal.
+// Returns NULL at end of input. The line buffer is reused by the next call.
+char *read_cmds(const char *prompt)
+{
+    static char *commands = NULL;
+    static size_t size = 0;
+    struct termios cooked;
+    printf("%s", prompt);
+    fflush(stdout);
+    if (tcgetattr(STDIN_FILENO, &cooked) == 0)
+    {
+        return edit_line(prompt, &cooked);
+    }
+    wait_for_input();
+    ssize_t result = getline(&commands, &size, stdin);
+    if (result == -1)
+    {
+        if (!feof(stdin))
+        {
+            error_exit("read_cmd");
+        }
+        return NULL;
+    }
+    return commands;
+}
+
+void init_reader(LineReader *lr, int fd)
+{
+    lr->fd = fd;
+    lr->cap = READ_BLOCK_SIZE;
+    lr->start = 0;
+    lr->end = 0;
+    lr->eof = false;
+    lr->buf = malloc(lr->cap + 1);
+    if (lr->buf == NULL)
+    {
+        error_exit("malloc");
+    }
+}
+
+void init_string_reader(LineReader *lr, char *str)
+{
+    lr->fd = -1;
+    lr->cap = strlen(str);
+    lr->start = 0;
+    lr->end = lr->cap;
+    lr->eof = true;
+    lr->buf = malloc(lr->cap + 1);
+    if (lr->buf == NULL)
+    {
+        error_exit("malloc");
+    }
+    memcpy(lr->buf, str, lr->cap);
+}
+
+// Batch mode input: reads READ_BLOCK_SIZE blocks and hands out lines in
+// place. The returned line has its newline stripped and stays valid until the
+// next call. Returns NULL at end of input.
+char *read_line(LineReader *lr)
+{
+    size_t scanned = lr->start;
+    while (1)
+    {
+        char *nl = memchr(lr->buf + scanned, '\n', lr->end - scanned);
+        if (nl != NULL)
+        {
+            char *line = lr->buf + lr->start;
+            *nl = '\0';
+            lr->start = nl - lr->buf + 1;
+            return line;
+        }
+        if (lr->eof)
+        {
+            if (lr->start == lr->end)
+            {
+                return NULL;
+            }
+            char *line = lr->buf + lr->start;
+            lr->buf[lr->end] = '\0';
+            lr->start = lr->end;
+            return line;
+        }
+        // Move the partial line to the front, grow if it fills the buffer
+        memmove(lr->buf, lr->buf + lr->start, lr->end - lr->start);
+        lr->end -= lr->start;
+        lr->start = 0;
+        scanned = lr->end;
+        if (lr->end == lr->cap)
+        {
+            lr->cap *= 2;
+            lr->buf = realloc(lr->buf, lr->cap + 1);
+            if (lr->buf == NULL)
+            {
+                error_exit("realloc");
+            }
+        }
+        ssize_t bytes_read = read(lr->fd, lr->buf + lr->end, lr->cap - lr->end);
+        if (bytes_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_read == -1)
+        {
+            error_exit("read_cmd");
+        }
+        if (bytes_read == 0)
+        {
+            lr->eof = true;
+        }
+        lr->end += bytes_read;
+    }
+}
+
+void insert_cmd(Pipeline *pipeline, Command *cmd)
+{
+    pipeline->last->next = cmd;
+    pipeline->last = pipeline->last->next;
+    pipeline->last->next = NULL;
+    pipeline->cnt++;
+}
+
+// The next byte at or after p that lex_line has to look at. The line is
+// followed by LEX_PAD zero bytes, so whole blocks can be read past its end.
+char *lex_skip(char *p)
+{
+#if defined(__x86_64__)
+    const __m128i stops[] = {
+        _mm_set1_epi8('"'), _mm_set1_epi8('\''), _mm_set1_epi8(','), _mm_set1_epi8('<'),
+        _mm_set1_epi8('>'), _mm_set1_epi8('\\'), _mm_set1_epi8('|'), _mm_set1_epi8(' '),
+        _mm_set1_epi8('*'), _mm_set1_epi8('?'), _mm_set1_epi8('['),
+    };
+    for (;; p += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        __m128i ctrl = _mm_sub_epi8(x, _mm_set1_epi8('\t')); // \t to \r become 0 to 4
+        __m128i found = _mm_cmpeq_epi8(_mm_min_epu8(ctrl, _mm_set1_epi8(4)), ctrl);
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(x, _mm_setzero_si128()));
+        for (size_t i = 0; i < sizeof(stops) / sizeof(__m128i); i++)
+        {
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(x, stops[i]));
+        }
+        int mask = _mm_movemask_epi8(found);
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#else
+    while (!lex_stops[(unsigned char)*p])
+    {
+        p++;
+    }
+    return p;
+#endif
+}
+
+// Notes that the bytes written from start to end came from quotes or a
+// backslash, so a pattern word must keep any wildcards among them literal.
+// Whether the word is a pattern is only known at its end.
+void lex_literal(Lexer *lx, char *start, char *end)
+{
+    if (lx->literal_count == lx->literal_cap)
+    {
+        int cap = lx->literal_cap == 0 ? DEFAULT_MALLOC_SIZE : 2 * lx->literal_cap;
+        lx->literal = arena_realloc(&line_arena, lx->literal, 2 * lx->literal_cap * sizeof(char *), 2 * cap * sizeof(char *));
+        lx->literal_cap = cap;
+    }
+    lx->literal[2 * lx->literal_count] = start;
+    lx->literal[2 * lx->literal_count + 1] = end;
+    lx->literal_count++;
+}
+
+// A pattern word with its literal wildcards and backslashes escaped with a
+// backslash, as the glob code reads them
+char *escape_literals(Lexer *lx)
+{
+    char *word = arena_alloc(&line_arena, 2 * (lx->w - lx->word) + 1);
+    char *out = word;
+    char *p = lx->word;
+    for (int i = 0; i < lx->literal_count; i++)
+    {
+        for (; p < lx->literal[2 * i]; p++)
+        {
+            *out++ = *p;
+        }
+        for (; p < lx->literal[2 * i + 1]; p++)
+        {
+            if (*p == '*' || *p == '?' || *p == '[' || *p == ']' || *p == '\\')
+            {
+                *out++ = '\\';
+            }
+            *out++ = *p;
+        }
+    }
+    for (; p < lx->w; p++)
+    {
+        *out++ = *p;
+    }
+    *out = '\0';
+    return word;
+}
+
+void end_word(Lexer *lx)
+{
+    if (lx->word == NULL)
+    {
+        return;
+    }
+    if (lx->pattern && lx->literal_count > 0 && lx->target == WORD_ARG)
+    {
+        // Redirection targets are not globbed, only arguments need escapes
+        lx->word = escape_literals(lx);
+    }
+    lx->literal_count = 0;
+    *lx->w++ = '\0';
+    Command *cmd = lx->cmd;
+    if (lx->target == WORD_INPUT)
+    {
+        cmd->input_file = lx->word;
+    }
+    else if (lx->target == WORD_OUTPUT)
+    {
+        cmd->output_file = lx->word;
+    }
+    else
+    {
+        if (cmd->argc + 1 >= lx->argmax)
+        {
+            int argmax = lx->argmax == 0 ? DEFAULT_MALLOC_SIZE : (lx->argmax * 3) / 2;
+            cmd->argv = arena_realloc(&line_arena, cmd->argv, lx->argmax * sizeof(char *), argmax * sizeof(char *));
+            if (cmd->patterns != NULL)
+            {
+                cmd->patterns = arena_realloc(&line_arena, cmd->patterns, lx->argmax, argmax);
+            }
+            lx->argmax = argmax;
+        }
+        if (lx->pattern && cmd->patterns == NULL)
+        {
+            cmd->patterns = memset(arena_alloc(&line_arena, lx->argmax), 0, lx->argmax);
+        }
+        if (cmd->patterns != NULL)
+        {
+            cmd->patterns[cmd->argc] = lx->pattern;
+        }
+        cmd->argv[cmd->argc++] = lx->word;
+    }
+    lx->word = NULL;
+    lx->pattern = false;
+    lx->target = WORD_ARG;
+}
+
+// Ends the current command at a run of out_count pipes, or at a comma
+void end_command(Lexer *lx, int out_count)
+{
+    end_word(lx);
+    Command *cmd = lx->cmd;
+    if (cmd->argv == NULL)
+    {
+        cmd->argv = arena_alloc(&line_arena, sizeof(char *));
+    }
+    cmd->argv[cmd->argc] = NULL;
+    cmd->out_count = out_count;
+    insert_cmd(lx->pipeline, cmd);
+    lx->cmd = create_cmd();
+    lx->argmax = 0;
+    lx->target = WORD_ARG;
+}
+
+// Copies a quoted string after its opening quote to the word being built.
+// Inside double quotes a backslash only escapes ", \, $, ` and newline.
+bool lex_quoted(Lexer *lx, char quote)
+{
+    char *r = lx->r + 1;
+    char *w = lx->w;
+    if (lx->word == NULL)
+    {
+        lx->word = w;
+    }
+    while (*r != quote)
+    {
+        if (*r == '\0')
+        {
+            return false;
+        }
+        if (quote == '"' && *r == '\\' && r[1] != '\0' && strchr("\"\\$`\n", r[1]) != NULL)
+        {
+            r++;
+        }
+        *w++ = *r++;
+    }
+    if (w != lx->w)
+    {
+        lex_literal(lx, lx->w, w);
+    }
+    lx->r = r + 1;
+    lx->w = w;
+    return true;
+}
+
+// Splits a line into commands in a single pass, in place: argv and the
+// redirection file names point into line. Outside quotes, white space
+// separates words, a run of pipes or a comma ends a command and < > >>
+// take the next word as a file name. When split is false (an alias
+// definition) pipes and commas are part of words. Returns NULL after
+// printing an error if a quote is left open or a redirection has no file.
+Pipeline *lex_line(char *line, bool split)
+{
+    Pipeline *pipeline = arena_alloc(&line_arena, sizeof(Pipeline));
+    pipeline->cnt = 0;
+    pipeline->cmd_list = arena_alloc(&line_arena, sizeof(Command));
+    pipeline->last = pipeline->cmd_list;
+    pipeline->last->next = NULL;
+    Lexer lx = {line, line, NULL, WORD_ARG, create_cmd(), 0, pipeline, false, NULL, 0, 0};
+    while (1)
+    {
+        char *stop = lex_skip(lx.r);
+        if (stop != lx.r)
+        {
+            if (lx.word == NULL)
+            {
+                lx.word = lx.w;
+            }
+            if (lx.w != lx.r)
+            {
+                memmove(lx.w, lx.r, stop - lx.r);
+            }
+            lx.w += stop - lx.r;
+            lx.r = stop;
+        }
+        char c = *lx.r;
+        if (c == '"' || c == '\'')
+        {
+            if (!lex_quoted(&lx, c))
+            {
+                fprintf(stderr, "Unterminated %s quote\n", c == '"' ? "double" : "single");
+                return NULL;
+            }
+        }
+        else if (c == '*' || c == '?' || c == '[')
+        {
+            if (lx.word == NULL)
+            {
+                lx.word = lx.w;
+            }
+            lx.pattern = split; // Not in an alias definition, expanded when it runs
+            *lx.w++ = *lx.r++;
+        }
+        else if (c == '\\' || (!split && (c == '|' || c == ',')))
+        {
+            if (lx.word == NULL)
+            {
+                lx.word = lx.w;
+            }
+            if (c == '\\' && lx.r[1] != '\0')
+            {
+                lx.r++; // A trailing backslash is kept as it is
+            }
+            *lx.w++ = *lx.r++;
+            lex_literal(&lx, lx.w - 1, lx.w);
+        }
+        else if (c == '|' || c == ',')
+        {
+            if (lx.word == NULL && lx.target != WORD_ARG)
+            {
+                break; // A redirection without its file name
+            }
+            int out_count = 0;
+            for (; c == '|' && *lx.r == '|'; lx.r++)
+            {
+                out_count++;
+            }
+            lx.r += c == ',';
+            end_command(&lx, out_count);
+        }
+        else if (c == '<' || c == '>')
+        {
+            if (lx.word == NULL && lx.target != WORD_ARG)
+            {
+                break;
+            }
+            end_word(&lx);
+            if (c == '<')
+            {
+                lx.cmd->input_redirect = true;
+            }
+            else if (lx.r[1] == '>')
+            {
+                lx.cmd->output_append = true;
+                lx.r++;
+            }
+            else
+            {
+                lx.cmd->output_redirect = true;
+            }
+            lx.target = c == '<' ? WORD_INPUT : WORD_OUTPUT;
+            lx.r++;
+        }
+        else
+        {
+            end_word(&lx);
+            if (c == '\0')
+            {
+                break;
+            }
+            lx.r++;
+        }
+    }
+    if (lx.target != WORD_ARG)
+    {
+        fprintf(stderr, "Missing file name after %s\n", lx.target == WORD_INPUT ? "<" : ">");
+        return NULL;
+    }
+    // Nothing after the last delimiter is not a command
+    Command *cmd = lx.cmd;
+    if (cmd->argc > 0 || cmd->input_redirect || cmd->output_redirect || cmd->output_append)
+    {
+        end_command(&lx, 0);
+    }
+    return pipeline;
+}
+
+Pipeline *create_pipeline(char *input)
+{
+    bool is_alias = false;
+    if (strlen(input) > 5 && input[0] == 'a' && input[1] == 'l' && input[2] == 'i' && input[3] == 'a' && input[4] == 's')
+    {
+        is_alias = true;
+    }
+    return lex_line(input, !is_alias);
+}
+
+// Parses text (which is left untouched) and packs the result into a Plan.
+// The words are moved over as one block, with argv rebased onto it, and
+// pattern words the lexer rewrote with escapes are copied after it.
+Plan *compile_plan(char *text)
+{
+    long long traced = trace_clock();
+    size_t text_len = strlen(text);
+    char *input = arena_alloc(&line_arena, text_len + 1 + LEX_PAD);
+    memcpy(input, text, text_len + 1);
+    memset(input + text_len + 1, 0, LEX_PAD);
+    Pipeline *pipeline = create_pipeline(input);
+    if (pipeline == NULL)
+    {
+        return NULL;
+    }
+    size_t size = sizeof(Plan) + pipeline->cnt * sizeof(Command);
+    size_t flags = 0;
+    size_t escaped = 0;
+    for (Command *cmd = pipeline->cmd_list->next; cmd != NULL; cmd = cmd->next)
+    {
+        if (cmd->argc == 0)
+        {
+            fprintf(stderr, "Empty command in pipeline\n");
+            return NULL;
+        }
+        size += (cmd->argc + 1) * sizeof(char *);
+        flags += cmd->patterns != NULL ? cmd->argc : 0;
+        for (int j = 0; cmd->patterns != NULL && j < cmd->argc; j++)
+        {
+            escaped += cmd->argv[j] < input || cmd->argv[j] > input + text_len ? strlen(cmd->argv[j]) + 1 : 0;
+        }
+    }
+    char *mem = malloc(size + flags + 2 * (text_len + 1) + escaped);
+    if (mem == NULL)
+    {
+        error_exit("malloc");
+    }
+    Plan *plan = (Plan *)mem;
+    plan->cnt = pipeline->cnt;
+    plan->stages = (Command *)(mem + sizeof(Plan));
+    char **argv_area = (char **)(plan->stages + plan->cnt);
+    bool *flag_area = (bool *)(mem + size);
+    plan->text = memcpy(mem + size + flags, text, text_len + 1);
+    char *words = memcpy(plan->text + text_len + 1, input, text_len + 1);
+    char *escaped_area = words + text_len + 1;
+    int i = 0;
+    for (Command *cmd = pipeline->cmd_list->next; cmd != NULL; cmd = cmd->next, i++)
+    {
+        Command *stage = &plan->stages[i];
+        *stage = *cmd;
+        stage->next = NULL;
+        stage->argv = argv_area;
+        for (int j = 0; j < cmd->argc; j++)
+        {
+            if (cmd->argv[j] < input || cmd->argv[j] > input + text_len)
+            {
+                size_t len = strlen(cmd->argv[j]) + 1;
+                stage->argv[j] = memcpy(escaped_area, cmd->argv[j], len);
+                escaped_area += len;
+                continue;
+            }
+            stage->argv[j] = words + (cmd->argv[j] - input);
+        }
+        stage->argv[cmd->argc] = NULL;
+        argv_area += cmd->argc + 1;
+        if (cmd->patterns != NULL)
+        {
+            stage->patterns = memcpy(flag_area, cmd->patterns, cmd->argc);
+            flag_area += cmd->argc;
+        }
+        stage->input_file = cmd->input_file != NULL ? words + (cmd->input_file - input) : NULL;
+        stage->output_file = cmd->output_file != NULL ? words + (cmd->output_file - input) : NULL;
+    }
+    trace_span("parse", traced, -1, text);
+    return plan;
+}
+
+// Returns the cached plan for text, compiling and caching it on a miss.
+// *cached is false when the caller owns (and must free) the plan.
+Plan *lookup_plan(char *text, bool *cached)
+{
+    TableSlot *slot = table_find(&plan_table, text);
+    if (slot != NULL)
+    {
+        plan_hits++;
+        *cached = true;
+        return slot->value;
+    }
+    plan_misses++;
+    Plan *plan = compile_plan(text);
+    *cached = plan != NULL && strlen(text) <= PLAN_MAX_TEXT;
+    if (!*cached)
+    {
+        return plan;
+    }
+    if (plan_table.live == PLAN_CACHE_MAX)
+    {
+        flush_plan_cache();
+    }
+    table_insert(&plan_table, plan->text)->value = plan;
+    return plan;
+}
+
+Plan *find_plan(char *input, Alias *alias, bool *cached)
+{
+    *cached = true;
+    if (alias == NULL)
+    {
+        return lookup_plan(input, cached);
+    }
+    if (alias->plan == NULL)
+    {
+        plan_misses++;
+        alias->plan = compile_plan((char *)alias->command);
+    }
+    else
+    {
+        plan_hits++;
+    }
+    return alias->plan;
+}
+
+// Removes a trailing &, so "cmd &" shares its cached plan with "cmd"
+bool strip_background(char *input)
+{
+    char *end = input + strlen(input);
+    while (end > input && isspace(end[-1]))
+    {
+        end--;
+    }
+    if (end == input || end[-1] != '&' || (end - input >= 2 && end[-2] == '\\'))
+    {
+        return false; // An escaped \& is an argument
+    }
+    end--;
+    while (end > input && isspace(end[-1]))
+    {
+        end--;
+    }
+    *end = '\0';
+    return true;
+}
+
+// Default worker count for parallel: the CPUs this process may run on
+int cpu_count()
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        return CPU_COUNT(&set);
+    }
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+// Splits off the next whitespace-separated word of *input in place
+char *next_word(char **input)
+{
+    while (isspace(**input))
+    {
+        (*input)++;
+    }
+    if (**input == '\0')
+    {
+        return NULL;
+    }
+    char *word = *input;
+    while (**input != '\0' && !isspace(**input))
+    {
+        (*input)++;
+    }
+    if (**input != '\0')
+    {
+        *(*input)++ = '\0';
+    }
+    return word;
+}
+
+// Copies arg to out with a backslash before every byte the lexer would
+// stop at, so the instance sees it as one literal word
+char *escape_arg(char *out, char *arg)
+{
+    for (; *arg != '\0'; arg++)
+    {
+        if (lex_stops[(unsigned char)*arg])
         {
-            error_exit("fork");
+            *out++ = '\\';
         }
-        if (ret == 0)
+        *out++ = *arg;
+    }
+    return out;
+}
+
+// The template with every {} replaced by arg, or with arg appended if it has
+// no {}
+char *instance_text(char *template, char *arg)
+{
+    size_t arg_len = 2 * strlen(arg); // Room for an escape before each byte
+    size_t len = strlen(template) + arg_len + 2;
+    for (char *p = strstr(template, "{}"); p != NULL; p = strstr(p + 2, "{}"))
+    {
+        len += arg_len;
+    }
+    char *text = arena_alloc(&line_arena, len);
+    char *out = text;
+    bool replaced = false;
+    for (char *p = template; *p != '\0';)
+    {
+        if (p[0] == '{' && p[1] == '}')
         {
-            signal(SIGINT, SIG_DFL);
-            if (i < count - 1)
-            {
-                if (cmd->out_count == 0 && count != 1)
-                {
-                    int buffersize = BUFFER_SIZE;
-                    char buffer[BUFFER_SIZE];
-                    int position = 0;
-                    int bytes_read = 0;
-                    char *data = (char *)malloc(sizeof(char) * buffersize);
-                    if (data == NULL)
-                    {
-                        error_exit("malloc");
-                    }
-                    while ((bytes_read = read(pipe_fd[i - 1][0], &buffer, BUFFER_SIZE)) != 0)
-                    {
-                        strcpy(data + position, buffer);
-                        if (bytes_read == BUFFER_SIZE)
-                        {
-                            buffersize += BUFFER_SIZE;
-                            data = (char *)realloc(data, sizeof(char) * buffersize);
-                            if (data == NULL)
-                            {
-                                error_exit("realloc");
-                            }
-                        }
-                        position += bytes_read;
-                    }
-                    data[position] = '\0';
-                    int temp_fd[2];
-                    if (pipe(temp_fd) == -1)
-                    {
-                        error_exit("pipe");
-                    }
+            out = escape_arg(out, arg);
+            p += 2;
+            replaced = true;
+        }
+        else
+        {
+            *out++ = *p++;
+        }
+    }
+    if (!replaced)
+    {
+        *out++ = ' ';
+        out = escape_arg(out, arg);
+    }
+    *out = '\0';
+    return text;
+}
 
-                    int ret = fork();
-                    if (ret == 0)
-                    {
-                        close(temp_fd[0]);
-                        // close_all_pipes(pipe_fd, count - 1);
-                        if (write(temp_fd[1], data, position) == -1)
-                        {
-                            error_exit("write_duplicate1");
-                        }
-                        exit(EXIT_SUCCESS);
-                    }
-                    else
-                    {
-                        int ret = fork();
-                        if (ret == 0)
-                        {
-                            close(temp_fd[0]);
-                            close(temp_fd[1]);
-                            // close_all_pipes(pipe_fd, count - 1);
-                            if (write(pipe_fd[i][1], data, position) == -1)
-                            {
-                                error_exit("write_duplicate2");
-                            }
-                            exit(EXIT_SUCCESS);
-                        }
-                    }
+// Compiles the instance's line through the usual pipeline construction and
+// starts it as a background job writing into a fresh memfd
+void start_instance(Instance *in, char *template, char *arg, int in_fd)
+{
+    in->text = instance_text(template, arg);
+    in->job = NULL;
+    in->out_fd = -1;
+    in->status = 2;
+    Plan *plan = compile_plan(in->text);
+    if (plan == NULL)
+    {
+        return;
+    }
+    in->out_fd = memfd_create("parallel", MFD_CLOEXEC);
+    if (in->out_fd == -1)
+    {
+        error_exit("memfd_create");
+    }
+    in->job = launch_job(plan, expand_globs(plan, plan->stages), true, in_fd, in->out_fd);
+    free(plan); // The job keeps copies of the texts it needs
+}
 
-                    if (close(temp_fd[1]) == -1)
-                    {
-                        error_exit("close");
-                    }
-                    if (dup2(temp_fd[0], STDIN_FILENO) == -1)
-                    {
-                        error_exit("dup2");
-                    }
-                }
-                if (cmd->out_count > 0)
-                {
-                    if (dup2(pipe_fd[i][1], STDOUT_FILENO) == -1)
-                    {
-                        error_exit("dup2");
-                    }
-                }
+// Writes a finished instance's output to stdout and closes its memfd
+void print_instance(Instance *in)
+{
+    if (in->out_fd == -1)
+    {
+        return;
+    }
+    off_t offset = 0;
+    off_t size = lseek(in->out_fd, 0, SEEK_END);
+    while (offset < size)
+    {
+        ssize_t n = sendfile(STDOUT_FILENO, in->out_fd, &offset, size - offset);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1 && errno == EINVAL)
+        {
+            // stdout opened with O_APPEND, copy through user space
+            char buffer[BUFFER_SIZE * 64];
+            while ((n = pread(in->out_fd, buffer, sizeof(buffer), offset)) > 0 && write_all(STDOUT_FILENO, buffer, n) != -1)
+            {
+                offset += n;
             }
-            if (i != 0)
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+    }
+    close(in->out_fd);
+    in->out_fd = -1;
+}
 
+// Collects the argument list after ::: or, without one, the lines of stdin.
+// Words after ::: are glob patterns if they have a *, ? or [.
+char **parallel_args(char *list, int *count)
+{
+    WordList args = {NULL, 0, 0};
+    LineReader lr;
+    if (list == NULL)
+    {
+        init_reader(&lr, STDIN_FILENO);
+    }
+    while (1)
+    {
+        char *arg = list != NULL ? next_word(&list) : read_line(&lr);
+        if (arg == NULL)
+        {
+            break;
+        }
+        if (list != NULL && strpbrk(arg, "*?[") != NULL)
+        {
+            glob_word(arg, &args);
+            continue;
+        }
+        if (list == NULL)
+        {
+            if (arg[0] == '\0')
             {
-                if (i == count - 1 || cmd->out_count > 0)
+                continue;
+            }
+            // read_line reuses its buffer
+            size_t len = strlen(arg) + 1;
+            arg = memcpy(arena_alloc(&line_arena, len), arg, len);
+        }
+        word_push(&args, arg);
+    }
+    if (list == NULL)
+    {
+        free(lr.buf);
+    }
+    *count = args.count;
+    return args.words;
+}
 
+// parallel [-j N] cmd ... [::: arg ...] runs the pipeline cmd once per
+// argument, at most N instances at a time (the CPU count by default). {} in
+// cmd is replaced by the argument, which is appended if there is no {}.
+// Without ::: the arguments are the lines of stdin. Instances run with stdin
+// from /dev/null, their stdout is printed whole in argument order, failures
+// are listed on stderr. Returns the number of failed instances, at most 101.
+int parallel_builtin(Plan *plan)
+{
+    char *text = arena_alloc(&line_arena, strlen(plan->text) + 1);
+    strcpy(text, plan->text);
+    char *template = strstr(text, "parallel") + strlen("parallel"); // After any time prefix
+    int limit = cpu_count();
+    while (isspace(*template))
+    {
+        template++;
+    }
+    if (!strncmp(template, "-j", 2))
+    {
+        template += 2;
+        while (isspace(*template))
+        {
+            template++;
+        }
+        limit = strtol(template, &template, 10);
+        if (*template != '\0' && !isspace(*template))
+        {
+            limit = 0;
+        }
+    }
+    char *list = template;
+    while ((list = strstr(list, ":::")) != NULL && !((list == template || isspace(list[-1])) && (list[3] == '\0' || isspace(list[3]))))
+    {
+        list += 3;
+    }
+    if (list != NULL)
+    {
+        *list = '\0';
+        list += 3;
+    }
+    char *end = template + strlen(template);
+    while (end > template && isspace(end[-1]))
+    {
+        *--end = '\0';
+    }
+    while (isspace(*template))
+    {
+        template++;
+    }
+    if (limit < 1 || end <= template)
+    {
+        fprintf(stderr, "usage: parallel [-j N] cmd ... [::: arg ...]\n");
+        return EXIT_FAILURE;
+    }
+    int count;
+    char **args = parallel_args(list, &count);
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (null_fd == -1)
+    {
+        error_exit("open");
+    }
+    int window = limit * PARALLEL_WINDOW; // Bounds the memfds held open
+    Instance *slots = arena_alloc(&line_arena, window * sizeof(Instance));
+    int started = 0;
+    int printed = 0;
+    int running = 0;
+    int failed = 0;
+    bool killed = false;
+    fflush(stdout);
+    while (printed < started || (started < count && !interrupted))
+    {
+        while (!interrupted && started < count && running < limit && started - printed < window)
+        {
+            Instance *in = &slots[started++ % window];
+            start_instance(in, template, args[started - 1], null_fd);
+            running += in->job != NULL;
+        }
+        if (interrupted && !killed)
+        {
+            // Instances don't get the terminal, so Ctrl-C reaches the shell
+            for (int i = printed; i < started; i++)
+            {
+                Job *job = slots[i % window].job;
+                if (job != NULL && job->pgid != 0)
                 {
-                    if (dup2(pipe_fd[i - 1][0], STDIN_FILENO) == -1)
-
-                    {
-                        error_exit("dup2");
-                    }
+                    killpg(job->pgid, SIGINT);
+                    killpg(job->pgid, SIGCONT);
                 }
             }
-            if (cmd->input_redirect == true && is_valid_filename(cmd->input_file))
-
+            killed = true;
+        }
+        for (int i = printed; i < started; i++)
+        {
+            Instance *in = &slots[i % window];
+            if (in->job != NULL && in->job->live == 0)
             {
-                int input_fd = open(cmd->input_file, O_RDONLY);
-                if (input_fd == -1)
+                in->status = in->job->exit_status;
+                finish_job(in->job);
+                in->job = NULL;
+                running--;
+            }
+        }
+        for (; printed < started && slots[printed % window].job == NULL; printed++)
+        {
+            Instance *in = &slots[printed % window];
+            print_instance(in);
+            if (in->status != EXIT_SUCCESS)
+            {
+                fprintf(stderr, "parallel: [%d] status %d: %s\n", printed + 1, in->status, in->text);
+                failed++;
+            }
+        }
+        if (running > 0)
+        {
+            supervise(-1);
+        }
+    }
+    close(null_fd);
+    if (failed > 0)
+    {
+        fprintf(stderr, "parallel: %d of %d failed\n", failed, started);
+    }
+    if (interrupted)
+    {
+        return 128 + SIGINT;
+    }
+    return failed > 100 ? 101 : failed;
+}
 
-                {
-                    error_exit("open");
-                }
-                if (dup2(input_fd, STDIN_FILENO) == -1)
+int run_line(char *input); // Runs the text of a $(...), defined below
+bool expand_text(Expansion *exp, const char *s, size_t n, bool body); // Also expands here-string words
 
-                {
-                    error_exit("dup2");
-                }
-                if (close(input_fd) == -1)
+void expand_append(Expansion *exp, const char *s, size_t n)
+{
+    if (exp->len + n + 1 > exp->cap)
+    {
+        exp->cap = exp->len + n + 1 > 2 * exp->cap ? exp->len + n + 1 : 2 * exp->cap;
+        exp->text = realloc(exp->text, exp->cap);
+        if (exp->text == NULL)
+        {
+            error_exit("realloc");
+        }
+    }
+    memcpy(exp->text + exp->len, s, n);
+    exp->len += n;
+    exp->text[exp->len] = '\0';
+}
 
-                {
-                    error_exit("close");
-                }
+// Seals a finished memfd and makes it the stdin of the command being
+// expanded. The fd stays open until the line has run, its children open
+// it by path, each getting its own offset.
+void expand_stdin(Expansion *exp, int fd)
+{
+    char redirect[48];
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+    {
+        perror("F_ADD_SEALS");
+    }
+    int *fds = realloc(exp->fds, (exp->nfds + 1) * sizeof(int));
+    if (fds == NULL)
+    {
+        error_exit("realloc");
+    }
+    exp->fds = fds;
+    exp->fds[exp->nfds++] = fd;
+    expand_append(exp, redirect, snprintf(redirect, sizeof(redirect), " < /proc/self/fd/%d ", fd));
+}
+
+void free_expansion(Expansion *exp)
+{
+    for (int i = 0; i < exp->nfds; i++)
+    {
+        close(exp->fds[i]);
+    }
+    free(exp->fds);
+    free(exp->text);
+}
+
+// Offset of the ) closing the $( that s starts with, n if there is none.
+// Quoted parens don't count.
+size_t find_close(const char *s, size_t n)
+{
+    int depth = 0;
+    for (size_t i = 1; i < n; i++)
+    {
+        if (s[i] == '\\')
+        {
+            i++;
+        }
+        else if (s[i] == '\'' || s[i] == '"')
+        {
+            char quote = s[i];
+            while (++i < n && s[i] != quote)
+            {
+                i += quote == '"' && s[i] == '\\';
             }
-            if (cmd->output_redirect == true && is_valid_filename(cmd->output_file))
+        }
+        else if (s[i] == '(')
+        {
+            depth++;
+        }
+        else if (s[i] == ')' && --depth == 0)
+        {
+            return i;
+        }
+    }
+    return n;
+}
 
+// End of the word starting at s[i], the way the lexer will split it
+size_t word_end(const char *s, size_t n, size_t i)
+{
+    while (i < n && !isspace(s[i]) && strchr("|,<>", s[i]) == NULL)
+    {
+        if (s[i] == '$' && i + 1 < n && s[i + 1] == '(')
+        {
+            i += find_close(s + i, n - i) + 1;
+        }
+        else if (s[i] == '\'' || s[i] == '"')
+        {
+            char quote = s[i];
+            while (++i < n && s[i] != quote)
             {
-                int output_fd = open(cmd->output_file, O_TRUNC | O_WRONLY | O_CREAT, 0777);
-                if (output_fd == -1)
+                i += quote == '"' && s[i] == '\\';
+            }
+            i++;
+        }
+        else
+        {
+            i += s[i] == '\\' ? 2 : 1;
+        }
+    }
+    return i < n ? i : n;
+}
 
+// Appends a word without its quotes and backslashes, as the lexer reads it
+void unquote(Expansion *out, const char *s, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t run = i;
+        if (s[i] == '\'')
+        {
+            while (++run < n && s[run] != '\'')
+            {
+            }
+            expand_append(out, s + i + 1, run - i - 1);
+            i = run;
+        }
+        else if (s[i] == '"')
+        {
+            for (i++; i < n && s[i] != '"'; i = run)
+            {
+                if (s[i] == '\\' && i + 1 < n && strchr("\"\\$`\n", s[i + 1]) != NULL)
                 {
-                    error_exit("open");
+                    i++;
                 }
-                if (dup2(output_fd, STDOUT_FILENO) == -1)
-
+                for (run = i + 1; run < n && s[run] != '"' && s[run] != '\\'; run++)
                 {
-                    error_exit("dup2");
                 }
-                if (close(output_fd) == -1)
+                expand_append(out, s + i, run - i);
+            }
+        }
+        else
+        {
+            i += s[i] == '\\' && i + 1 < n;
+            expand_append(out, s + i, 1);
+        }
+    }
+}
 
-                {
-                    error_exit("close");
-                }
+// Runs the n bytes of text as a line with its stdout, builtins included,
+// going to a new memfd, and returns the memfd. Unlike a pipe it can't fill
+// up, so the command never waits for the shell to read it. The line runs in
+// a forked subshell, so exit, cd, alias or set in it leave this shell as it
+// was.
+int capture(const char *text, size_t n)
+{
+    int fd = make_memfd("capture");
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        error_exit("fork");
+    }
+    if (pid == 0)
+    {
+        char *line = strndup(text, n);
+        if (line == NULL || dup2(fd, STDOUT_FILENO) == -1)
+        {
+            _exit(EXIT_FAILURE);
+        }
+        // The epoll set and signalfd are shared with the shell until they
+        // are made anew, as in a server session
+        close(supervisor_fd);
+        close(signal_fd);
+        init_supervisor();
+        interactive = false; // No status lines in the output
+        run_line(line);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(last_status); // Without the shell's exit handlers
+    }
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+    {
+    }
+    return fd;
+}
+
+// Appends a capture without its trailing newlines. Unquoted, the bytes the
+// lexer would act on are escaped, so the output is only split into words;
+// in double quotes only what a backslash escapes there.
+void append_capture(Expansion *exp, int fd, enum Quoting quoting)
+{
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            error_exit("mmap");
+        }
+        size_t n = st.st_size;
+        while (n > 0 && data[n - 1] == '\n')
+        {
+            n--;
+        }
+        const char *specials = quoting == QUOTE_DOUBLE ? "\"\\$`" : "\"'\\|,<>";
+        size_t start = 0;
+        for (size_t i = 0; i < n && quoting != QUOTE_RAW; i++)
+        {
+            if (data[i] == '\0' || strchr(specials, data[i]) != NULL)
+            {
+                expand_append(exp, data + start, i - start);
+                expand_append(exp, "\\", data[i] != '\0'); // NULs are dropped
+                start = i + (data[i] == '\0');
             }
-            if (cmd->output_append == true && is_valid_filename(cmd->output_file))
+        }
+        expand_append(exp, data + start, n - start);
+        munmap(data, st.st_size);
+    }
+    close(fd);
+}
 
-            {
-                int output_fd = open(cmd->output_file, O_APPEND | O_WRONLY | O_CREAT, 0777);
-                if (output_fd == -1)
+// <<< word: the word and a newline. A word that is just "$(...)" hands the
+// capture itself on, trimmed to one trailing newline, without copying it.
+int here_string(const char *s, size_t n)
+{
+    if (n > 4 && s[0] == '"' && s[1] == '$' && s[2] == '(' && find_close(s + 1, n - 1) == n - 3 && s[n - 1] == '"')
+    {
+        int fd = capture(s + 3, n - 5);
+        off_t end = lseek(fd, 0, SEEK_END);
+        char c;
+        while (end > 0 && pread(fd, &c, 1, end - 1) == 1 && c == '\n')
+        {
+            end--;
+        }
+        if (ftruncate(fd, end) == -1 || pwrite(fd, "\n", 1, end) != 1)
+        {
+            error_exit("here-string");
+        }
+        return fd;
+    }
+    Expansion word = {NULL, 0, 0, NULL, 0};
+    Expansion text = {NULL, 0, 0, NULL, 0};
+    expand_text(&word, s, n, false);
+    unquote(&text, word.text, word.len);
+    expand_append(&text, "\n", 1);
+    int fd = make_memfd("here-string");
+    write_all(fd, text.text, text.len);
+    free_expansion(&word);
+    free_expansion(&text);
+    return fd;
+}
 
-                {
-                    error_exit("open");
-                }
-                if (dup2(output_fd, STDOUT_FILENO) == -1)
+// The next line of a here-document: from the script being run, or from a
+// > prompt. NULL at end of input, or if there is nowhere to read it from.
+char *next_body_line()
+{
+    if (line_source != NULL)
+    {
+        return read_line(line_source);
+    }
+    if (!interactive)
+    {
+        return NULL;
+    }
+    char *line = read_cmds("> ");
+    if (line != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+    }
+    return line;
+}
 
-                {
-                    error_exit("dup2");
-                }
-                if (close(output_fd) == -1)
+// <<word: the lines up to one that is just the word. $(...) in them is
+// expanded unless the word is quoted, <<- strips leading tabs.
+int here_doc(const char *s, size_t n, bool strip_tabs)
+{
+    Expansion delim = {NULL, 0, 0, NULL, 0};
+    Expansion body = {NULL, 0, 0, NULL, 0};
+    unquote(&delim, s, n);
+    expand_append(&delim, "", 0);
+    bool quoted = memchr(s, '\'', n) != NULL || memchr(s, '"', n) != NULL || memchr(s, '\\', n) != NULL;
+    char *line;
+    while ((line = next_body_line()) != NULL)
+    {
+        while (strip_tabs && *line == '\t')
+        {
+            line++;
+        }
+        if (!strcmp(line, delim.text))
+        {
+            break;
+        }
+        if (quoted || !expand_text(&body, line, strlen(line), true))
+        {
+            expand_append(&body, line, strlen(line));
+        }
+        expand_append(&body, "\n", 1);
+    }
+    if (line == NULL)
+    {
+        fprintf(stderr, "here-document ended by end of input (wanted `%s')\n", delim.text);
+    }
+    int fd = make_memfd("here-doc");
+    write_all(fd, body.text != NULL ? body.text : "", body.len);
+    free_expansion(&delim);
+    free_expansion(&body);
+    return fd;
+}
 
-                {
-                    error_exit("close");
-                }
-            }
-            close_all_pipes(pipe_fd, count - 1);
-            if (execvp(cmd->argv[0], cmd->argv) == -1)
+// Appends the n bytes of s with $(...) replaced by its output and <<<, <<
+// turned into redirections from memfds. A here-document body only has its
+// $(...) replaced. Returns false, after saying why, if the text is malformed.
+bool expand_text(Expansion *exp, const char *s, size_t n, bool body)
+{
+    bool in_double = false;
+    size_t copied = 0;
+    size_t i = 0;
+    while (i < n)
+    {
+        if (s[i] == '$' && i + 1 < n && s[i + 1] == '(')
+        {
+            size_t close = find_close(s + i, n - i);
+            if (close == n - i)
             {
-                error_exit("execvp");
+                fprintf(stderr, "Unterminated command substitution\n");
+                return false;
             }
+            expand_append(exp, s + copied, i - copied);
+            int fd = capture(s + i + 2, close - 2);
+            append_capture(exp, fd, body ? QUOTE_RAW : in_double ? QUOTE_DOUBLE : QUOTE_NONE);
+            i = copied = i + close + 1;
         }
-        else
+        else if (body)
+        {
+            i++;
+        }
+        else if (s[i] == '\\')
         {
-            if (i > 0)
+            i += 2;
+        }
+        else if (s[i] == '\'' && !in_double)
+        {
+            while (++i < n && s[i] != '\'')
             {
-                close(pipe_fd[i - 1][0]);
             }
-            if (i < count - 1)
-
+            i++;
+        }
+        else if (s[i] == '"')
+        {
+            in_double = !in_double;
+            i++;
+        }
+        else if (s[i] == '<' && !in_double && i + 1 < n && s[i + 1] == '<')
+        {
+            bool string = i + 2 < n && s[i + 2] == '<';
+            bool strip_tabs = !string && i + 2 < n && s[i + 2] == '-';
+            size_t start = i + 2 + string + strip_tabs;
+            while (start < n && isspace(s[start]))
             {
-                close(pipe_fd[i][1]);
+                start++;
             }
-            int status;
-            if (out_count > 1)
+            size_t end = word_end(s, n, start);
+            if (end == start)
             {
-                int status;
-                waitpid(ret, &status, 0);
-                printf("-------- PID: %d status: %d --------\n", ret, status);
-                out_count--;
+                fprintf(stderr, string ? "Missing here-string\n" : "Missing here-document delimiter\n");
+                return false;
             }
+            expand_append(exp, s + copied, i - copied);
+            expand_stdin(exp, string ? here_string(s + start, end - start) : here_doc(s + start, end - start, strip_tabs));
+            i = copied = end;
         }
-
-        if (cmd->out_count > 1)
+        else
         {
-            out_count = cmd->out_count;
+            i++;
         }
-        cmd = cmd->next;
     }
-    int status;
-    pid_t pid;
-    while ((pid = wait(&status)) > 0)
+    expand_append(exp, s + copied, (i < n ? i : n) - copied);
+    return true;
+}
+
+// Returns the line as run_line should compile it: input itself if there is
+// nothing to expand, the expansion otherwise, or NULL if it failed
+char *expand_line(const char *input, Expansion *exp)
+{
+    if (strstr(input, "$(") == NULL && strstr(input, "<<") == NULL)
+    {
+        return (char *)input;
+    }
+    // Here-document lines are read into the buffer input may point into
+    char *copy = strdup(input);
+    if (copy == NULL)
     {
-        printf("-------- PID: %d status: %d --------\n", pid, status);
+        error_exit("strdup");
     }
-    close_all_pipes(pipe_fd, count - 1);
+    bool ok = expand_text(exp, copy, strlen(copy), false);
+    free(copy);
+    expand_append(exp, "", 0);
+    return ok ? exp->text : NULL;
 }
 
-Command *create_cmd()
+// Expands an alias, finds or compiles the line's plan and runs it
+int run_line(char *input)
 {
-    Command *cmd = (Command *)malloc(sizeof(Command));
-    if (!cmd)
+    bool background = strip_background(input);
+    Alias *alias = search_alias(input);
+    interrupted = false;
+    if (alias == NULL && strncmp(input, "alias", 5) == 0 && define_alias(input))
     {
-        error_exit("malloc");
+        // Definitions skip the plan cache, rc files can hold thousands
+        return last_status = EXIT_SUCCESS;
     }
-    cmd->argc = 0;
-    cmd->argv = NULL;
-    cmd->input_redirect = false;
-    cmd->output_redirect = false;
-    cmd->output_append = false;
-    cmd->input_file = NULL;
-    cmd->output_file = NULL;
-    cmd->out_count = 0;
-    cmd->next = NULL;
-    return cmd;
+    Expansion exp = {NULL, 0, 0, NULL, 0};
+    char *text = expand_line(alias != NULL ? alias->command : input, &exp);
+    bool cached = true;
+    Plan *plan = NULL;
+    if (text == NULL)
+    {
+        last_status = EXIT_FAILURE;
+    }
+    else if (exp.text != NULL)
+    {
+        // Expanded lines differ from run to run, they are not cached
+        plan = compile_plan(text);
+        cached = false;
+    }
+    else
+    {
+        plan = find_plan(input, alias, &cached);
+    }
+    if (text != NULL)
+    {
+        last_status = plan != NULL ? execute(plan, background) : 2; // A syntax error, as in sh
+    }
+    if (!cached)
+    {
+        free(plan);
+    }
+    free_expansion(&exp);
+    arena_reset(&line_arena);
+    return last_status;
 }
 
-void parse_cmd(Command *cmd, char *token)
+// -c, script files and non-terminal stdin: no prompt and no history
+int run_batch(LineReader *lr)
 {
-    int argc = 0;
-    int len = strlen(token);
-    cmd->argv = malloc(DEFAULT_MALLOC_SIZE * sizeof(char *));
-    if (!cmd->argv)
-        error_exit("malloc");
-    int argmax = DEFAULT_MALLOC_SIZE;
-    enum ParseMode mode = COMMAND_BEGIN;
-    for (int i = 0; i < len; i++)
+    char *input;
+    line_source = lr;
+    while ((input = read_line(lr)) != NULL)
+    {
+        run_line(input);
+        notify_jobs();
+        if (interrupted)
+        {
+            exit(128 + SIGINT); // Ctrl-C ends a script along with its job
+        }
+    }
+    return last_status;
+}
+
+// Receives the next bytes of a client's requests and any fds passed with
+// them, which are kept in fds until the request they belong to has run
+ssize_t recv_request(int conn, char *buf, size_t len, int fds[3], int *nfds)
+{
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+    {
+        return n;
+    }
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
     {
-        switch (token[i])
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+        int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++)
         {
-        case '>':
-            if (i + 1 < len && token[i + 1] == '>')
+            int fd;
+            memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            if (*nfds < 3)
             {
-                cmd->output_append = true;
-                token[i] = token[i + 1] = '\0';
-                i++;
+                fds[(*nfds)++] = fd;
             }
             else
             {
-                cmd->output_redirect = true;
-                token[i] = '\0';
+                close(fd);
             }
-            mode = OUTPUT_BEGIN;
-            break;
+        }
+    }
+    return n;
+}
 
-        case '<':
-            cmd->input_redirect = true;
-            mode = INPUT_BEGIN;
-            token[i] = '\0';
-            break;
-        case ' ':
-        case '\f':
-        case '\n':
-        case '\r':
-        case '\t':
-        case '\v':
-        case '\0':
-            switch (mode)
-            {
-            case INPUT_READ:
-            case OUTPUT_READ:
-            case COMMAND_READ:
-            case ARGS_READ:
-                mode = ARGS_BEGIN;
-
-            default:
-                token[i] = '\0';
-                break;
+// Runs one request line with the fds the client passed as stdout, stderr
+// and stdin, in that order. Without them output goes over the connection.
+// Either way the reply ends with a status frame.
+void run_request(int null_fd, char *line, int fds[3], int nfds)
+{
+    int out = nfds > 0 ? fds[0] : session.out_fd;
+    int err = nfds > 1 ? fds[1] : nfds > 0 ? out : session.err_fd;
+    int in = nfds > 2 ? fds[2] : null_fd;
+    if (dup2(out, STDOUT_FILENO) == -1 || dup2(err, STDERR_FILENO) == -1 || dup2(in, STDIN_FILENO) == -1)
+    {
+        error_exit("dup2");
+    }
+    run_line(line);
+    notify_jobs();
+    fflush(stdout);
+    fflush(stderr);
+    // Later messages go to the client, not to a stale fd
+    dup2(session.out_fd, STDOUT_FILENO);
+    dup2(session.err_fd, STDERR_FILENO);
+    dup2(null_fd, STDIN_FILENO);
+    for (int i = 0; i < nfds; i++)
+    {
+        close(fds[i]);
+    }
+    write_all(session.status_fd, (char *)&last_status, sizeof(last_status));
+}
+
+bool send_frame(int conn, enum FrameType type, const char *data, uint32_t len)
+{
+    char head[5] = {type, len >> 24, len >> 16, len >> 8, len};
+    struct iovec iov[2] = {{head, sizeof(head)}, {(char *)data, len}};
+    size_t total = sizeof(head) + len;
+    ssize_t n = writev(conn, iov, 2);
+    if (n == (ssize_t)total)
+    {
+        return true;
+    }
+    if (n == -1)
+    {
+        return false;
+    }
+    // The rest of a frame a full socket only partly took
+    return (size_t)n < sizeof(head) ? write_all(conn, head + n, sizeof(head) - n) != -1 && write_all(conn, data, len) != -1
+                                    : write_all(conn, data + n - sizeof(head), total - n) != -1;
+}
+
+// A session's only writer to its connection, forked when it starts. The
+// session's stdout and stderr are pipes to it, so whatever its requests and
+// background jobs print goes out as frames of its stream. A status the
+// session sends once a request ends is framed after all the output already
+// in the pipes, which holds everything the request's job wrote.
+void relay_frames(int conn, int out_fd, int err_fd, int status_fd)
+{
+    struct pollfd pfds[3] = {{out_fd, POLLIN, 0}, {err_fd, POLLIN, 0}, {status_fd, POLLIN, 0}};
+    enum FrameType types[2] = {FRAME_STDOUT, FRAME_STDERR};
+    char buffer[BUFFER_SIZE * 64];
+    fcntl(out_fd, F_SETFL, O_NONBLOCK);
+    fcntl(err_fd, F_SETFL, O_NONBLOCK);
+    while (pfds[0].fd != -1 || pfds[1].fd != -1 || pfds[2].fd != -1)
+    {
+        if (poll(pfds, 3, -1) == -1 && errno != EINTR)
+        {
+            error_exit("poll");
+        }
+        bool done = pfds[2].revents != 0;
+        for (int i = 0; i < 2; i++)
+        {
+            if (pfds[i].fd == -1 || (pfds[i].revents == 0 && !done))
+            {
+                continue;
             }
-            break;
-        default:
-            switch (mode)
+            // Read to empty, so a status goes out after all of it
+            ssize_t n;
+            while ((n = read(pfds[i].fd, buffer, sizeof(buffer))) > 0)
             {
-            case INPUT_BEGIN:
-                cmd->input_file = (token + i);
-                mode = INPUT_READ;
-                break;
-
-            case OUTPUT_BEGIN:
-                cmd->output_file = (token + i);
-                mode = OUTPUT_READ;
-                break;
-            case ARGS_BEGIN:
-                cmd->argv[argc++] = (token + i);
-                mode = ARGS_READ;
-                if (argc == argmax)
+                if (!send_frame(conn, types[i], buffer, n))
                 {
-                    argmax = (argmax * 3) / 2;
-                    cmd->argv = realloc(cmd->argv, argmax * sizeof(char *));
-                    if (!cmd->argv)
-                        error_exit("realloc");
+                    _exit(EXIT_FAILURE);
                 }
-
-                break;
-            case COMMAND_BEGIN:
-                cmd->argv[0] = (token + i);
-                mode = COMMAND_READ;
-                argc++;
-            default:
-                break;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EINTR))
+            {
+                pfds[i].fd = -1; // Every writer has gone
+            }
+        }
+        if (done)
+        {
+            int status;
+            if (read(status_fd, &status, sizeof(status)) != sizeof(status))
+            {
+                pfds[2].fd = -1; // The session has ended
+                continue;
+            }
+            uint32_t value = htonl(status);
+            if (!send_frame(conn, FRAME_STATUS, (char *)&value, sizeof(value)))
+            {
+                _exit(EXIT_FAILURE);
             }
         }
     }
-
-    cmd->argc = argc;
-    cmd->argv[argc] = NULL;
+    _exit(EXIT_SUCCESS);
 }
 
-char *read_cmds()
+// Per-client accounting, written to the server's stderr however the
+// session ends, exit included
+void log_session()
 {
-    char *commands = NULL;
-    size_t size = 0;
-    ssize_t result = getline(&commands, &size, stdin);
-    if (result == -1)
+    struct rusage self, children;
+    if (session.pid != getpid())
     {
-        free(commands);
-        commands = NULL;
-        error_exit("read_cmd");
+        return; // A child of the session that failed before its exec
     }
-    return commands;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    dprintf(session.log_fd, "client %d pid %d: %d requests, %lld ms running, user %.3f ms, sys %.3f ms\n", session.client,
+            session.pid, session.requests, session.busy_ms, timeval_ms(&self.ru_utime) + timeval_ms(&children.ru_utime),
+            timeval_ms(&self.ru_stime) + timeval_ms(&children.ru_stime));
 }
 
-char *tokeniser(char **input, int *out_count)
+// A client's session, forked from the server with its rc file and caches
+// already loaded. Being a process of its own, it has its own cwd, aliases
+// and jobs. Ends when the client closes the connection or runs exit.
+void serve_client(int conn, int log_fd, int client)
 {
-    *out_count = 0;
-    if (*input == NULL)
-        return NULL;
-
-    // Remove leading whitespaces
-    while (**input != '\0' && isspace(**input))
-        (*input)++;
-
-    if (*input == NULL || **input == '\0')
+    char *buf = malloc(SERVER_REQUEST_MAX);
+    int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (buf == NULL || null_fd == -1)
     {
-        return NULL;
+        error_exit("serve_client");
     }
-    char *res = *input;
-    // Find delim
-    while (**input != '|' && **input != ',' && **input != '\0')
+    // The epoll set and signalfd are shared with the server and every
+    // other session until they are made anew
+    close(supervisor_fd);
+    close(signal_fd);
+    init_supervisor();
+    signal(SIGPIPE, SIG_DFL);
+    int out_pipe[2];
+    int err_pipe[2];
+    int status_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC) == -1 || pipe2(err_pipe, O_CLOEXEC) == -1 || pipe2(status_pipe, O_CLOEXEC) == -1)
     {
-        (*input)++;
+        error_exit("pipe2");
     }
-
-    if (**input == ',')
+    pid_t relay = fork();
+    if (relay == -1)
     {
-        **input = '\0';
-        (*input)++;
+        error_exit("fork");
     }
-    else
+    if (relay == 0)
+    {
+        close(out_pipe[1]);
+        close(err_pipe[1]);
+        close(status_pipe[1]);
+        relay_frames(conn, out_pipe[0], err_pipe[0], status_pipe[0]);
+    }
+    close(out_pipe[0]);
+    close(err_pipe[0]);
+    close(status_pipe[0]);
+    session = (Session){.log_fd = log_fd, .client = client, .pid = getpid(), .out_fd = out_pipe[1],
+                        .err_fd = err_pipe[1], .status_fd = status_pipe[1]};
+    dup2(session.out_fd, STDOUT_FILENO);
+    dup2(session.err_fd, STDERR_FILENO);
+    atexit(log_session);
+    int fds[3];
+    int nfds = 0;
+    size_t used = 0;
+    ssize_t n;
+    while ((n = recv_request(conn, buf + used, SERVER_REQUEST_MAX - used, fds, &nfds)) > 0)
     {
-        // skip continuous delims
-        while (**input != '\0' && **input == '|')
+        used += n;
+        char *start = buf;
+        char *newline;
+        while ((newline = memchr(start, '\n', buf + used - start)) != NULL)
         {
-            **input = '\0';
-            (*out_count)++;
-            (*input)++;
+            *newline = '\0';
+            long long begin = now_ms();
+            run_request(null_fd, start, fds, nfds);
+            session.busy_ms += now_ms() - begin;
+            session.requests++;
+            nfds = 0;
+            start = newline + 1;
         }
-        if (*out_count > 3)
+        used -= start - buf;
+        memmove(buf, start, used);
+        if (used == SERVER_REQUEST_MAX)
         {
-            *out_count = 3;
+            dprintf(log_fd, "client %d: request longer than %d bytes\n", client, SERVER_REQUEST_MAX);
+            break;
         }
     }
-
-    return res;
-}
-
-void insert_cmd(Pipeline *pipeline, Command *cmd)
-{
-    pipeline->last->next = cmd;
-    pipeline->last = pipeline->last->next;
-    pipeline->last->next = NULL;
-    pipeline->cnt++;
+    exit(last_status);
 }
 
-void populate_pipeline(char *input, Pipeline *pipeline, bool is_alias)
+// shell --listen path: accepts clients on a UNIX socket and forks a session
+// for each, at most max_clients at once; later ones wait in the backlog.
+// Sessions log their accounting to the server's stderr. Ctrl-C stops it.
+int serve(char *path, int max_clients)
 {
-    if (is_alias)
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
     {
-        Command *cmd = create_cmd();
-        cmd->out_count = 0;
-        parse_cmd(cmd, input);
-        insert_cmd(pipeline, cmd);
-        return;
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+    {
+        error_exit("socket");
     }
-    int delim_count = 0;
-    char *token = tokeniser(&input, &delim_count); // Split on pipe and comma
-    while (token != NULL)
+    unlink(path); // Left behind by an earlier server
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, SOMAXCONN) == -1)
     {
-        // Command struct initialization
-        Command *cmd = create_cmd();
-        cmd->out_count = delim_count;
-        parse_cmd(cmd, token);
-        insert_cmd(pipeline, cmd);
-        token = tokeniser(&input, &delim_count);
+        error_exit(path);
+    }
+    int log_fd = dup(STDERR_FILENO);
+    int sessions = 0;
+    int clients = 0;
+    struct pollfd pfds[2] = {{.fd = listen_fd}, {.fd = signal_fd, .events = POLLIN}};
+    while (1)
+    {
+        pfds[0].events = sessions < max_clients ? POLLIN : 0;
+        if (poll(pfds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error_exit("poll");
+        }
+        struct signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+        {
+            if (info.ssi_signo == SIGINT)
+            {
+                unlink(path);
+                return EXIT_SUCCESS;
+            }
+        }
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+        {
+            sessions--;
+        }
+        if (!(pfds[0].revents & POLLIN))
+        {
+            continue;
+        }
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1)
+        {
+            continue;
+        }
+        clients++;
+        pid_t pid = fork();
+        if (pid == -1)
+        {
+            perror("fork");
+        }
+        else if (pid == 0)
+        {
+            close(listen_fd);
+            serve_client(conn, log_fd, clients);
+        }
+        else
+        {
+            sessions++;
+        }
+        close(conn);
     }
 }
-Pipeline *create_pipeline(char *input)
+
+// Runs $NPSHELL_RC, or ~/.npshellrc for an interactive shell, quietly
+void load_rc()
 {
-    Pipeline *pipeline = malloc(sizeof(Pipeline));
-    if (!pipeline)
+    char path[PATH_MAX];
+    char *rc = getenv("NPSHELL_RC");
+    char *home = getenv("HOME");
+    if (rc == NULL && interactive && home != NULL)
     {
-        error_exit("malloc");
+        snprintf(path, sizeof(path), "%s/.npshellrc", home);
+        rc = path;
     }
-    pipeline->cnt = 0;
-    pipeline->cmd_list = malloc(sizeof(Command));
-    if (!(pipeline->cmd_list))
+    if (rc == NULL || rc[0] == '\0')
     {
-        error_exit("malloc");
+        return;
     }
-    pipeline->last = pipeline->cmd_list;
-    pipeline->last->next = NULL;
-    bool is_alias = false;
-    if (strlen(input) > 5 && input[0] == 'a' && input[1] == 'l' && input[2] == 'i' && input[3] == 'a' && input[4] == 's')
+    int fd = open(rc, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
     {
-        is_alias = true;
+        if (errno != ENOENT)
+        {
+            perror(rc);
+        }
+        return;
     }
-    populate_pipeline(input, pipeline, is_alias);
-    return pipeline;
+    bool was_interactive = interactive;
+    LineReader lr;
+    interactive = false;
+    init_reader(&lr, fd);
+    run_batch(&lr);
+    free(lr.buf);
+    close(fd);
+    interactive = was_interactive;
+    last_status = EXIT_SUCCESS;
 }
 
-int main()
+// An interactive shell leads its own process group and owns the terminal
+// whenever no foreground job does; job control signals are left to the jobs
+void init_signals()
 {
-    ptr = (History *)malloc(sizeof(History));
-    if (ptr == NULL)
+    init_supervisor();
+    shell_pgid = getpgrp();
+    if (!interactive)
     {
-        error_exit("malloc");
+        return;
+    }
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    if (setpgid(0, 0) == 0)
+    {
+        shell_pgid = getpid();
     }
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+}
 
-    gpid = getpid();
-    ptr->head = NULL;
-    ptr->tail = NULL;
+int main(int argc, char *argv[])
+{
     char cwd[PATH_MAX];
-    ignore_int();
-    init_table();
+    char prompt[PATH_MAX + 64];
+    char *spawn_env = getenv("NPSHELL_SPAWN");
+    if (spawn_env != NULL && !strcmp(spawn_env, "fork"))
+    {
+        use_posix_spawn = false;
+    }
+    char *placement_env = getenv("NPSHELL_PLACEMENT");
+    if (placement_env != NULL && !set_placement(placement_env))
+    {
+        fprintf(stderr, "NPSHELL_PLACEMENT: invalid placement %s\n", placement_env);
+    }
+    char *trace_env = getenv("NPSHELL_TRACE");
+    if (trace_env != NULL && !set_trace(trace_env))
+    {
+        fprintf(stderr, "NPSHELL_TRACE: invalid trace file %s\n", trace_env);
+    }
+    char *branches_env = getenv("NPSHELL_BRANCHES");
+    if (branches_env != NULL)
+    {
+        char assignment[64];
+        snprintf(assignment, sizeof(assignment), "branches=%s", branches_env);
+        if (!set_option(assignment))
+        {
+            fprintf(stderr, "NPSHELL_BRANCHES: invalid mode %s\n", branches_env);
+        }
+    }
+    char *utils_env = getenv("NPSHELL_UTILS");
+    if (utils_env != NULL && !strcmp(utils_env, "external"))
+    {
+        use_builtin_utils = false;
+    }
+    interactive = argc == 1 && isatty(STDIN_FILENO);
+    init_signals();
+    if (interactive)
+    {
+        init_history();
+    }
+    load_rc();
+    if (argc > 2 && !strcmp(argv[1], "--listen"))
+    {
+        int max_clients = argc > 4 && !strcmp(argv[3], "--max-clients") ? atoi(argv[4]) : SERVER_MAX_CLIENTS;
+        return serve(argv[2], max_clients > 0 ? max_clients : SERVER_MAX_CLIENTS);
+    }
+    LineReader lr;
+    if (argc > 2 && !strcmp(argv[1], "-c"))
+    {
+        interactive = false;
+        init_string_reader(&lr, argv[2]);
+        return run_batch(&lr);
+    }
+    if (argc > 1)
+    {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            error_exit(argv[1]);
+        }
+        interactive = false;
+        init_reader(&lr, fd);
+        return run_batch(&lr);
+    }
+    if (!isatty(STDIN_FILENO))
+    {
+        interactive = false;
+        init_reader(&lr, STDIN_FILENO);
+        return run_batch(&lr);
+    }
     while (1)
     {
-        if (getcwd(cwd, PATH_MAX) != NULL)
-            printf("%s %s", BOLD_GREEN, cwd);
-        printf(GREEN ":=> " RESET);
-        fflush(stdout);
-        char *input = read_cmds();
-        insert_input_in_history(input);
-        HashEntry *he = search_table(input);
-        if (he != NULL && he->present == true)
+        notify_jobs();
+        if (getcwd(cwd, PATH_MAX) == NULL)
         {
-            strcpy(input, he->command);
+            cwd[0] = '\0';
         }
-        Pipeline *pipeline = NULL;
-
-        unignore_int();
-        if (sigsetjmp(senv, 1) == 0)
-            pipeline = create_pipeline(input);
-        ignore_int();
-
-        execute(pipeline);
-        free_pipeline(pipeline);
-        free(input);
+        snprintf(prompt, sizeof(prompt), "%s %s" GREEN ":=> " RESET, cwd[0] != '\0' ? BOLD_GREEN : "", cwd);
+        char *input = read_cmds(prompt);
+        if (input == NULL)
+        {
+            printf("\n");
+            return last_status;
+        }
+        if (input[0] == '!')
+        {
+            char *expanded = expand_history(input);
+            if (expanded == NULL)
+            {
+                fprintf(stderr, "%s: event not found\n", input);
+                continue;
+            }
+            printf("%s\n", expanded);
+            input = expanded;
+        }
+        insert_input_in_history(input);
+        run_line(input);
     }
 }
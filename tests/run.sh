@@ -0,0 +1,89 @@
+#!/bin/sh
+# Runs command lines through the shell in batch mode and compares their
+# output and exit status with the expected ones. Run from the repository
+# root after building ./shell, or set SH to the binary to test.
+
+SH=${SH:-./shell}
+SH=$(cd "$(dirname "$SH")" && pwd)/$(basename "$SH")
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+failed=0
+
+# check NAME LINES EXPECTED [STATUS]: stdout and stderr are compared
+# together, the exit status only when STATUS is given. Each test runs in
+# an empty directory.
+check()
+{
+    out=$(cd "$TMP" && rm -rf ./* && printf '%s\n' "$2" | "$SH" 2>&1)
+    status=$?
+    if [ "$out" != "$3" ] || [ "$status" != "${4:-$status}" ]
+    then
+        printf 'FAIL %s\n  expected (%s): %s\n  got (%s): %s\n' "$1" "${4:-any}" "$3" "$status" "$out"
+        failed=$((failed + 1))
+    fi
+}
+
+check "redirect then pipe" 'echo a>f
+cat<f|wc -l' '1'
+check "output redirect without file" 'echo a >' 'Missing file name after >' 2
+check "input redirect without file" 'cat <' 'Missing file name after <' 2
+check "redirect without file before a pipe" 'cat < | wc' 'Missing file name after <' 2
+check "two redirects in a row" 'echo a > > b' 'Missing file name after >' 2
+check "unterminated quote" 'echo "a' 'Unterminated double quote' 2
+check "empty stage" '| wc' 'Empty command in pipeline' 2
+check "status of a later line" 'echo "a
+echo b' 'Unterminated double quote
+b' 0
+check "parallel argument with a space and a pipe" 'echo x > "a b|c"
+parallel wc -l ::: *' '1 a b|c'
+check "parallel argument in a redirect" 'echo x > "a b|c"
+parallel cat < {} ::: *' 'x'
+check "parallel argument with quotes and a wildcard" "echo x > \"q'*\"
+parallel echo {} ::: q*" "q'*"
+check "quoted wildcard in an input redirect" 'echo hi > "ab*"
+echo no > abc
+cat < "ab"*' 'hi'
+check "quoted wildcard in an output redirect" 'echo x > "o"*
+cat "o*"' 'x'
+check "** matches files and directories" 'mkdir -p a/b/c d
+touch f a/g a/b/h
+echo **' 'a a/b a/b/c a/b/h a/g d f'
+check "**/ matches only directories" 'mkdir -p a/b/c d
+touch f a/g a/b/h
+echo **/' 'a/ a/b/ a/b/c/ d/'
+check "a/** includes a/" 'mkdir -p a/b/c d
+touch f a/g a/b/h
+echo a/**' 'a/ a/b a/b/c a/b/h a/g'
+check "a/**/ includes a/" 'mkdir -p a/b/c d
+touch f a/g a/b/h
+echo a/**/' 'a/ a/b/ a/b/c/'
+check "trailing slash after a literal component" 'mkdir -p a/b/c d
+touch f a/g a/b/h
+echo a/**/b/ */g/' 'a/b/ */g/'
+
+# status EXPECTED ARGS: the exit status of the shell run with ARGS
+status()
+{
+    expected=$1
+    shift
+    "$SH" "$@" >/dev/null 2>&1
+    got=$?
+    if [ "$got" != "$expected" ]
+    then
+        printf 'FAIL %s\n  expected status %s, got %s\n' "$*" "$expected" "$got"
+        failed=$((failed + 1))
+    fi
+}
+
+printf 'echo "a\n' > "$TMP/script"
+status 2 -c 'echo "a'
+status 2 -c 'cat < | wc'
+status 2 "$TMP/script"
+status 0 -c 'echo a'
+
+if [ $failed -ne 0 ]
+then
+    echo "$failed failed"
+    exit 1
+fi
+echo "all passed"